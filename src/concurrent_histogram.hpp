@@ -0,0 +1,256 @@
+
+#if !defined( __P2L_POINT_PROCESS_CORE_concurrent_histogram_HPP__ )
+#define __P2L_POINT_PROCESS_CORE_concurrent_histogram_HPP__
+
+
+#include "histogram.hpp"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <functional>
+
+
+namespace point_process_core {
+
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Atomically adds inc to an atomic value
+  // (std::atomic only has fetch_add for integral types)
+  template< class T >
+  void atomic_add( std::atomic<T>& value, const T& inc )
+  {
+    T current = value.load( std::memory_order_relaxed );
+    while( !value.compare_exchange_weak( current, current + inc,
+					 std::memory_order_relaxed ) )
+      ;
+  }
+
+  //-------------------------------------------------------------------------
+
+
+  // Description:
+  // A histogram which many threads can increment concurrently.
+  // Bins of the window are atomic counters in a flat array when the
+  // histogram is dense. Sparse histograms (and cells outside of the
+  // window) use a set of hash map shards, each with its own lock.
+  // snapshot() returns a consistent copy as a histogram_t: it waits
+  // for increments in flight to finish and holds off new ones while
+  // copying, so every increment is either fully in or fully out.
+  // Increments of dense bins take no lock but are not lock-free in
+  // the strict sense: each one registers itself on a writer counter
+  // shared by a stripe of threads (two sequentially consistent
+  // read-modify-writes) and adds to the bin with a compare-and-swap
+  // loop, and all of them wait while a snapshot is taken. Threads
+  // hitting the same stripe or bin still contend on its cache line.
+  template< class T >
+  class concurrent_histogram_t
+  {
+  public:
+
+    // Description:
+    // Creates a new histogram with a set number of bins per dimension
+    // over the given window (with the same default storage as
+    // histogram_t)
+    concurrent_histogram_t( const nd_aabox_t& window,
+			    const size_t& bins_per_dim,
+			    const size_t num_shards = 64 )
+      : _layout( window,
+		 bins_per_dim,
+		 histogram_t<T>::default_storage( window, bins_per_dim ) )
+    {
+      _init( num_shards );
+    }
+
+    // Description:
+    // Creates a new histogram with a set number of bins per dimension
+    // over the given window, using the given storage
+    concurrent_histogram_t( const nd_aabox_t& window,
+			    const size_t& bins_per_dim,
+			    const marked_grid_storage_t storage,
+			    const size_t num_shards = 64 )
+      : _layout( window, bins_per_dim, storage )
+    {
+      _init( num_shards );
+    }
+
+    // Description:
+    // Increment the count for a given grid cell.
+    // Safe to call from many threads at once
+    void increment_bin( const marked_grid_cell_t& cell, const T& inc = T(1) )
+    {
+      writer_scope_t scope( *this );
+      size_t index;
+      if( _layout.dense_index( cell, index ) ) {
+	atomic_add( _counts[ index ], inc );
+	_present[ index ].store( 1, std::memory_order_relaxed );
+	return;
+      }
+      shard_t& shard = _shards[ hash_value( cell ) % _shards.size() ];
+      std::lock_guard<std::mutex> lock( shard.mutex );
+      shard.hist.increment_bin( cell, inc );
+    }
+
+    // Description:
+    // increment count for the cell for the given point
+    void increment_bin( const math_core::nd_point_t& p, const T& inc = T(1) )
+    {
+      this->increment_bin( _layout.cell( p ), inc );
+    }
+
+    // Description:
+    // increment counts for every point of every point set in the batch
+    void increment_bins( const point_set_batch_t& batch, const T& inc = T(1) )
+    {
+      for( size_t p = 0; p < batch.num_points(); ++p ) {
+	this->increment_bin( _layout.cell( batch.point( p ) ), inc );
+      }
+    }
+
+    // Description:
+    // Returns a consistent copy of the counts
+    histogram_t<T> snapshot() const
+    {
+      snapshot_scope_t scope( *this );
+      histogram_t<T> hist = _layout;
+      for( size_t index = 0; index < _layout.dense_size(); ++index ) {
+	if( _present[ index ].load( std::memory_order_relaxed ) ) {
+	  hist.set( _layout.dense_cell( index ),
+		    _counts[ index ].load( std::memory_order_relaxed ) );
+	}
+      }
+      for( size_t i = 0; i < _shards.size(); ++i ) {
+	std::lock_guard<std::mutex> lock( _shards[i].mutex );
+	_shards[i].hist.for_each_mark( [&]( const marked_grid_cell_t& cell,
+					    const T& count ) {
+					 hist.increment_bin( cell, count );
+				       } );
+      }
+      return hist;
+    }
+
+    // Description:
+    // Returns the window of this histogram
+    nd_aabox_t window() const { return _layout.window(); }
+
+    // Description:
+    // Returns the number of bins per dimension
+    size_t bins_per_dimension() const { return _layout.bins_per_dimension(); }
+
+  protected:
+
+    // Description:
+    // An empty histogram giving the cells and layout of the counts
+    histogram_t<T> _layout;
+
+    // Description:
+    // The atomic counts and presence flags for dense bins
+    std::unique_ptr<std::atomic<T>[]> _counts;
+    std::unique_ptr<std::atomic<unsigned char>[]> _present;
+
+    // Description:
+    // The locked shards for all other cells
+    struct shard_t
+    {
+      mutable std::mutex mutex;
+      histogram_t<T> hist;
+    };
+    std::vector<shard_t> _shards;
+
+    // Description:
+    // Counts of the increments in flight, striped over cache lines
+    // so that threads do not contend on a single counter
+    struct alignas(64) writer_stripe_t
+    {
+      std::atomic<long> count;
+    };
+    static const size_t num_writer_stripes = 16;
+    mutable writer_stripe_t _writers[ num_writer_stripes ];
+
+    // Description:
+    // Set while a snapshot is being taken
+    mutable std::atomic<bool> _snapshotting;
+    mutable std::mutex _snapshot_mutex;
+
+    // Description:
+    // Registers an increment in flight, waiting for any snapshot
+    // being taken to finish first
+    struct writer_scope_t
+    {
+      std::atomic<long>& count;
+      writer_scope_t( const concurrent_histogram_t& h )
+	: count( h._writers[ std::hash<std::thread::id>()( std::this_thread::get_id() ) % num_writer_stripes ].count )
+      {
+	for( ;; ) {
+	  count.fetch_add( 1 );
+	  if( !h._snapshotting.load() ) {
+	    break;
+	  }
+	  count.fetch_sub( 1 );
+	  while( h._snapshotting.load() ) {
+	    std::this_thread::yield();
+	  }
+	}
+      }
+      ~writer_scope_t()
+      {
+	count.fetch_sub( 1 );
+      }
+    };
+
+    // Description:
+    // Holds off new increments and waits for the ones in flight
+    struct snapshot_scope_t
+    {
+      const concurrent_histogram_t& h;
+      std::lock_guard<std::mutex> lock;
+      snapshot_scope_t( const concurrent_histogram_t& h )
+	: h( h ),
+	  lock( h._snapshot_mutex )
+      {
+	h._snapshotting.store( true );
+	for( size_t i = 0; i < num_writer_stripes; ++i ) {
+	  while( h._writers[i].count.load() != 0 ) {
+	    std::this_thread::yield();
+	  }
+	}
+      }
+      ~snapshot_scope_t()
+      {
+	h._snapshotting.store( false );
+      }
+    };
+
+    // Description:
+    // Allocate the counters and shards
+    void _init( const size_t num_shards )
+    {
+      size_t n = _layout.dense_size();
+      _counts.reset( new std::atomic<T>[ n ] );
+      _present.reset( new std::atomic<unsigned char>[ n ] );
+      for( size_t i = 0; i < n; ++i ) {
+	_counts[i].store( T(0) );
+	_present[i].store( 0 );
+      }
+      _shards = std::vector<shard_t>( num_shards > 0 ? num_shards : 1 );
+      for( size_t i = 0; i < _shards.size(); ++i ) {
+	_shards[i].hist = histogram_t<T>( _layout.window(),
+					  _layout.bins_per_dimension(),
+					  MARKED_GRID_SPARSE_STORAGE );
+      }
+      for( size_t i = 0; i < num_writer_stripes; ++i ) {
+	_writers[i].count.store( 0 );
+      }
+      _snapshotting.store( false );
+    }
+  };
+
+  //-------------------------------------------------------------------------
+
+}
+
+
+#endif
+
@@ -1,11 +1,14 @@
 
 #include "entropy.hpp"
 #include "marked_grid.hpp"
+#include "mcmc_chains.hpp"
+#include "parallel.hpp"
 #include <math-core/geom.hpp>
 #include <math-core/io.hpp>
 #include <algorithm>
 #include <iterator>
 #include <iostream>
+#include <limits>
 
 
 using namespace math_core;
@@ -13,6 +16,340 @@ using namespace math_core;
 namespace point_process_core {
 
 
+  //=========================================================================
+
+  size_t grid_signature_table_t::add( const marked_grid_t<size_t>& grid,
+				      const size_t count )
+  {
+    return add( grid, marked_grid_fingerprint( grid ), count );
+  }
+
+  //=========================================================================
+
+  size_t grid_signature_table_t::add( const marked_grid_t<size_t>& grid,
+				      const boost::uint64_t fingerprint,
+				      const size_t count )
+  {
+    _num_samples += count;
+    
+    // look for the grid amongst the ones with the same fingerprint
+    std::pair<index_t::const_iterator, index_t::const_iterator> range
+      = _index.equal_range( fingerprint );
+    for( index_t::const_iterator iter = range.first;
+	 iter != range.second;
+	 ++iter ) {
+      if( _grids[ iter->second ] == grid ) {
+	_counts[ iter->second ] += count;
+	_last_added_index = iter->second;
+	return _counts[ iter->second ];
+      }
+    }
+
+    // a new grid
+    _last_added_index = _grids.size();
+    _index.insert( std::make_pair( fingerprint, _grids.size() ) );
+    _grids.push_back( grid );
+    _counts.push_back( count );
+    return count;
+  }
+
+  //=========================================================================
+
+  void grid_signature_table_t::merge( const grid_signature_table_t& other )
+  {
+    index_t::const_iterator iter;
+    for( iter = other._index.begin(); iter != other._index.end(); ++iter ) {
+      add( other._grids[ iter->second ],
+	   iter->first,
+	   other._counts[ iter->second ] );
+    }
+  }
+
+  //=========================================================================
+
+  double grid_signature_table_t::entropy() const
+  {
+    double entropy = 0;
+    for( size_t i = 0; i < _counts.size(); ++i ) {
+      double p = _counts[i] / (double)_num_samples;
+      entropy += p * log(p);
+    }
+    return -entropy;
+  }
+
+  //=========================================================================
+
+  void grid_signature_table_t::clear()
+  {
+    _index.clear();
+    _grids.clear();
+    _counts.clear();
+    _num_samples = 0;
+    _last_added_index = 0;
+  }
+
+  //=========================================================================
+
+  void concurrent_grid_signature_table_t::add( const marked_grid_t<size_t>& grid,
+					       const size_t count )
+  {
+    // fingerprint outside of the lock
+    boost::uint64_t fingerprint = marked_grid_fingerprint( grid );
+    shard_t& shard = _shards[ fingerprint % _shards.size() ];
+    std::lock_guard<std::mutex> lock( shard.mutex );
+    shard.table.add( grid, fingerprint, count );
+  }
+
+  //=========================================================================
+
+  size_t concurrent_grid_signature_table_t::num_samples() const
+  {
+    size_t total = 0;
+    for( size_t i = 0; i < _shards.size(); ++i ) {
+      std::lock_guard<std::mutex> lock( _shards[i].mutex );
+      total += _shards[i].table.num_samples();
+    }
+    return total;
+  }
+
+  //=========================================================================
+
+  double concurrent_grid_signature_table_t::entropy() const
+  {
+    // gather and sort the counts so the sum does not depend
+    // on the order grids were added in
+    std::vector<size_t> counts;
+    size_t total = 0;
+    for( size_t i = 0; i < _shards.size(); ++i ) {
+      std::lock_guard<std::mutex> lock( _shards[i].mutex );
+      const std::vector<size_t>& c = _shards[i].table.counts();
+      counts.insert( counts.end(), c.begin(), c.end() );
+      total += _shards[i].table.num_samples();
+    }
+    std::sort( counts.begin(), counts.end() );
+    
+    double entropy = 0;
+    for( size_t i = 0; i < counts.size(); ++i ) {
+      double p = counts[i] / (double)total;
+      entropy += p * log(p);
+    }
+    return -entropy;
+  }
+
+  //=========================================================================
+
+  grid_signature_table_t concurrent_grid_signature_table_t::merged() const
+  {
+    grid_signature_table_t table;
+    for( size_t i = 0; i < _shards.size(); ++i ) {
+      std::lock_guard<std::mutex> lock( _shards[i].mutex );
+      table.merge( _shards[i].table );
+    }
+    return table;
+  }
+
+  //=========================================================================
+
+  online_entropy_estimator_t::
+  online_entropy_estimator_t( const math_core::nd_aabox_t& window,
+			      const double cell_size )
+    : _window( window ),
+      _cell_size( cell_size ),
+      _sum_c_log_c( 0 ),
+      _sum_c_log2_c( 0 ),
+      _ess_ratio( 1 ),
+      _ess_num_samples( 0 )
+  {}
+
+  //=========================================================================
+
+  void online_entropy_estimator_t::add_sample( const std::vector<nd_point_t>& sample )
+  {
+    add_grid( point_set_count_grid( sample, _window, _cell_size ) );
+  }
+
+  //=========================================================================
+
+  void online_entropy_estimator_t::add_sample_batch( const point_set_batch_t& batch )
+  {
+    for( size_t i = 0; i < batch.size(); ++i ) {
+      add_grid( point_set_count_grid( batch, i, _window, _cell_size ) );
+    }
+  }
+
+  //=========================================================================
+
+  void online_entropy_estimator_t::add_grid( const marked_grid_t<size_t>& grid )
+  {
+    // update the running sums for the count going from c-1 to c
+    double c = (double)_grids.add( grid );
+    _sample_grids.push_back( _grids.last_added_index() );
+    double log_c = log( c );
+    _sum_c_log_c += c * log_c;
+    _sum_c_log2_c += c * log_c * log_c;
+    if( c > 1 ) {
+      double log_prev = log( c - 1 );
+      _sum_c_log_c -= ( c - 1 ) * log_prev;
+      _sum_c_log2_c -= ( c - 1 ) * log_prev * log_prev;
+    }
+  }
+
+  //=========================================================================
+
+  double online_entropy_estimator_t::plugin_entropy() const
+  {
+    // H = ln N - (1/N) sum c ln c
+    double n = (double)num_samples();
+    if( n == 0 ) {
+      return 0;
+    }
+    return log( n ) - _sum_c_log_c / n;
+  }
+
+  //=========================================================================
+
+  double online_entropy_estimator_t::bias_correction() const
+  {
+    if( num_samples() == 0 ) {
+      return 0;
+    }
+    return ( num_distinct() - 1.0 ) / ( 2.0 * num_samples() );
+  }
+
+  //=========================================================================
+
+  double online_entropy_estimator_t::entropy() const
+  {
+    return plugin_entropy() + bias_correction();
+  }
+
+  //=========================================================================
+
+  double online_entropy_estimator_t::standard_error() const
+  {
+    // Var = ( sum p ln(p)^2 - H^2 ) / N, where
+    // sum p ln(p)^2 = (1/N) sum c ( ln c - ln N )^2
+    double n = (double)num_samples();
+    if( n == 0 ) {
+      return 0;
+    }
+    double log_n = log( n );
+    double second = ( _sum_c_log2_c 
+		      - 2.0 * log_n * _sum_c_log_c
+		      + n * log_n * log_n ) / n;
+    double h = plugin_entropy();
+    double var = ( second - h * h ) / n;
+    return var > 0 ? sqrt( var ) : 0.0;
+  }
+
+  //=========================================================================
+
+  double online_entropy_estimator_t::effective_sample_size() const
+  {
+    // the trace of -ln p for the grid of each sample, whose mean
+    // is the plug-in entropy
+    double n = (double)num_samples();
+    std::vector<std::vector<double> > trace( 1, std::vector<double>() );
+    trace[0].reserve( _sample_grids.size() );
+    for( size_t i = 0; i < _sample_grids.size(); ++i ) {
+      trace[0].push_back( log( n ) - log( (double)_grids.counts()[ _sample_grids[i] ] ) );
+    }
+    return point_process_core::effective_sample_size( trace );
+  }
+
+  //=========================================================================
+
+  double online_entropy_estimator_t::chain_standard_error() const
+  {
+    double n = (double)num_samples();
+    if( n == 0 ) {
+      return 0;
+    }
+    double ratio = std::min( 1.0, effective_sample_size() / n );
+    if( ratio <= 0 ) {
+      return std::numeric_limits<double>::infinity();
+    }
+    return standard_error() / sqrt( ratio );
+  }
+
+  //=========================================================================
+
+  double online_entropy_estimator_t::confidence_half_width( const double z ) const
+  {
+    return z * standard_error();
+  }
+
+  //=========================================================================
+
+  bool online_entropy_estimator_t::converged( const entropy_estimator_parameters_t& params ) const
+  {
+    if( params.target_precision <= 0 ||
+	num_samples() < params.min_samples ) {
+      return false;
+    }
+
+    // the interval alone is not enough, with mostly unique grids it
+    // collapses while the estimate is still heavily biased
+    if( confidence_half_width( params.confidence_z ) > params.target_precision ||
+	bias_correction() > params.target_precision ) {
+      return false;
+    }
+
+    // the samples come from a correlated chain, so widen the
+    // interval by the effective sample size. It is only recomputed
+    // now and then since it takes a pass over all the samples
+    if( _ess_num_samples == 0 ||
+	num_samples() >= _ess_num_samples + _ess_num_samples / 8 ) {
+      _ess_ratio = std::min( 1.0, effective_sample_size() / num_samples() );
+      _ess_num_samples = num_samples();
+    }
+    if( _ess_ratio <= 0 ) {
+      return false;
+    }
+    return ( confidence_half_width( params.confidence_z ) / sqrt( _ess_ratio )
+	     <= params.target_precision );
+  }
+
+  //=========================================================================
+
+  marked_grid_t<size_t>
+  point_set_count_grid( const std::vector<nd_point_t>& points,
+			const nd_aabox_t& window,
+			const double cell_size )
+  {
+    marked_grid_t<size_t> grid( window, cell_size );
+    for( size_t i = 0; i < points.size(); ++i ) {
+      boost::optional<size_t> mark = grid( points[i] );
+      if( mark ) {
+	grid.set( points[i], *mark + 1 );
+      } else {
+	grid.set( points[i], 1 );
+      }	
+    }
+    return grid;
+  }
+
+  //=========================================================================
+
+  marked_grid_t<size_t>
+  point_set_count_grid( const point_set_batch_t& batch,
+			const size_t i,
+			const nd_aabox_t& window,
+			const double cell_size )
+  {
+    marked_grid_t<size_t> grid( window, cell_size );
+    for( size_t p = batch.offsets[i]; p < batch.offsets[i+1]; ++p ) {
+      marked_grid_cell_t cell = grid.cell( batch.point( p ) );
+      boost::optional<size_t> mark = grid( cell );
+      if( mark ) {
+	grid.set( cell, *mark + 1 );
+      } else {
+	grid.set( cell, 1 );
+      }	
+    }
+    return grid;
+  }
+
   //=========================================================================
 
   double estimate_entropy_from_samples
@@ -22,63 +359,21 @@ namespace point_process_core {
     void* state )
   {
     
-    // an array of the marked grids of point samples seen
-    std::vector<marked_grid_t<size_t> > grids;
-    std::vector<size_t> grid_counts;
+    // the counts of the marked grids of point samples seen
+    online_entropy_estimator_t estimator( window,
+					  params.histogram_grid_cell_size );
 
     // sample a number of times from the sampler,
     // keep counts of the seen grids
     for( size_t i = 0; i < params.num_samples; ++i ) {
       
-      // sample a point set
-      std::vector<nd_point_t> sample = 
-	sampler( state );
-
-      // debug
-      // std::cout << "  sampled process (#" << sample.size() << ")" << std::endl;
-      // for( size_t j = 0; j < sample.size(); ++j ) {
-      // 	std::cout << "    s[" << j << "]: " << sample[j] << std::endl;
-      // }
-
-      // mark the grid according to point set
-      marked_grid_t<size_t> sample_grid( window, params.histogram_grid_cell_size );
-      for( size_t i = 0; i < sample.size(); ++i ) {
-	
-	// debug
-	//std::cout << "  about to mark " << i << std::endl;
-	//std::cout << std::flush;
-	
-	boost::optional<size_t> mark = sample_grid( sample[i] );
-	if( mark ) {
-	  sample_grid.set( sample[i], *mark + 1 );
-	} else {
-	  sample_grid.set( sample[i], 1 );
-	}
-	
-	// debug
-	//std::cout << "    marking " << sample[i] << std::endl;
-	
-      }
-
-      // debug
-      //std::cout << "  marked grid ";
-
-      // now see if we already have this grid
-      std::vector<marked_grid_t<size_t> >::iterator fiter
-	= std::find( grids.begin(), grids.end(), sample_grid );
-      if( fiter != grids.end() ) {
-	grid_counts[ std::distance( grids.begin(), fiter ) ] += 1;
-	
-	// debug
-	//std::cout << "SAME!" << std::endl;
-	
-      } else {
-	grids.push_back( sample_grid );
-	grid_counts.push_back( 1 );
-	
-	// debug
-	//std::cout << "new" << std::endl;
+      // sample a point set, mark the grid according to point set
+      // and count it
+      estimator.add_sample( sampler( state ) );
 
+      // stop once precise enough
+      if( estimator.converged( params ) ) {
+	break;
       }
 
       // skip some sampels if needed
@@ -87,24 +382,11 @@ namespace point_process_core {
       }
     }
 
-    // debug
-    //std::cout << "  counts: ";
-
     // compute empirical entropy of the grids sample
-    double entropy = 0;
-    for( size_t i = 0; i < grid_counts.size(); ++i ) {
-      double p = grid_counts[i] / (double)params.num_samples;
-      entropy += p * log(p);
-      
-      // debug
-      //std::cout << grid_counts[i] << " ";
-      
+    if( params.target_precision > 0 ) {
+      return estimator.entropy();
     }
-    
-    // debug
-    //std::cout << std::endl;
-
-    return -entropy;
+    return estimator.plugin_entropy();
   }
 
 
@@ -114,53 +396,128 @@ namespace point_process_core {
   ( const entropy_estimator_parameters_t& params,
     boost::shared_ptr<mcmc_point_process_t>& process )
   {
-   // an array of the marked grids of point samples seen
-    std::vector<marked_grid_t<size_t> > grids;
-    std::vector<size_t> grid_counts;
+    // the counts of the marked grids of point samples seen
+    online_entropy_estimator_t estimator( process->window(),
+					  params.histogram_grid_cell_size );
 
-    // sample a number of times from the sampler,
-    // keep counts of the seen grids
-    for( size_t i = 0; i < params.num_samples; ++i ) {
+    // sample a number of times from the process in batches,
+    // keep counts of the seen grids.
+    // (one sample at a time when we may stop early)
+    point_set_batch_t batch;
+    const size_t batch_size = ( params.target_precision > 0 ? 1 : 64 );
+    for( size_t i = 0; i < params.num_samples; i += batch_size ) {
       
-      // sample a point set and step it
-      std::vector<nd_point_t> sample = process->sample_and_step();
-
-      // mark the grid according to point set
-      marked_grid_t<size_t> sample_grid( process->window(), 
-					 params.histogram_grid_cell_size );
-      for( size_t i = 0; i < sample.size(); ++i ) {
-	boost::optional<size_t> mark = sample_grid( sample[i] );
-	if( mark ) {
-	  sample_grid.set( sample[i], *mark + 1 );
-	} else {
-	  sample_grid.set( sample[i], 1 );
-	}	
+      // sample point sets, stepping the process once after each
+      // plus any mcmc steps we want to skip, then mark the grids
+      // according to the point sets and count them
+      batch.clear();
+      process->sample_batch( std::min( batch_size, params.num_samples - i ),
+			     batch,
+			     1 + params.num_samples_to_skip );
+      estimator.add_sample_batch( batch );
+
+      // stop once precise enough
+      if( estimator.converged( params ) ) {
+	break;
       }
+    }
 
-      // now see if we already have this grid
-      std::vector<marked_grid_t<size_t> >::iterator fiter
-	= std::find( grids.begin(), grids.end(), sample_grid );
-      if( fiter != grids.end() ) {
-	grid_counts[ std::distance( grids.begin(), fiter ) ] += 1;	
-      } else {
-	grids.push_back( sample_grid );
-	grid_counts.push_back( 1 );
+    // compute empirical entropy of the grids sample
+    if( params.target_precision > 0 ) {
+      return estimator.entropy();
+    }
+    return estimator.plugin_entropy();
+  }
+
+  //=========================================================================
+
+  double estimate_entropy_from_samples_in_parallel
+  ( const entropy_estimator_parameters_t& params,
+    const mcmc_point_process_t& process,
+    const size_t num_chains,
+    const unsigned long seed,
+    const size_t num_threads )
+  {
+    if( num_chains == 0 || params.num_samples == 0 ) {
+      return 0;
+    }
+    
+    // clone and reseed the chains up front. Clones which cannot be
+    // reseeded would all draw the same random stream, so fall back
+    // to a single serial chain for those
+    std::vector<boost::shared_ptr<mcmc_point_process_t> > chains;
+    for( size_t k = 0; k < num_chains; ++k ) {
+      boost::shared_ptr<mcmc_point_process_t> chain = process.clone();
+      if( !chain->seed_rng( chain_seed( seed, k ) ) && num_chains > 1 ) {
+	chain = process.clone();
+	return estimate_entropy_from_samples( params, chain );
       }
+      chains.push_back( chain );
+    }
 
-      // skip some mcmc steps if wanted
+    // the number of samples drawn from each chain
+    std::vector<size_t> chain_samples( num_chains,
+				       params.num_samples / num_chains );
+    for( size_t k = 0; k < params.num_samples % num_chains; ++k ) {
+      ++chain_samples[k];
+    }
+
+    // sample the grid of a point set from a chain, then step the
+    // chain plus any mcmc steps we want to skip
+    auto sample_grid = [&]( const size_t k ) {
+      std::vector<nd_point_t> sample = chains[k]->sample_and_step();
       for( size_t skip_i = 0; skip_i < params.num_samples_to_skip; ++skip_i ) {
-	process->single_mcmc_step();
+	chains[k]->single_mcmc_step();
       }
+      return point_set_count_grid( sample,
+				   chains[k]->window(),
+				   params.histogram_grid_cell_size );
+    };
+
+    // without a target precision every chain counts its sampled
+    // grids into the shared table
+    if( params.target_precision <= 0 ) {
+      concurrent_grid_signature_table_t grids;
+      parallel_for( num_chains,
+		    [&]( const size_t k ) {
+		      for( size_t i = 0; i < chain_samples[k]; ++i ) {
+			grids.add( sample_grid( k ) );
+		      }
+		    },
+		    num_threads );
+      return grids.entropy();
     }
 
-    // compute empirical entropy of the grids sample
-    double entropy = 0;
-    for( size_t i = 0; i < grid_counts.size(); ++i ) {
-      double p = grid_counts[i] / (double)params.num_samples;
-      entropy += p * log(p);
+    // otherwise the chains sample rounds of grids concurrently, and
+    // between rounds the grids are counted in chain order so we can
+    // stop once precise enough. A round is about min_samples samples
+    // over all the chains.
+    online_entropy_estimator_t estimator( process.window(),
+					  params.histogram_grid_cell_size );
+    const size_t round_size = std::max( (size_t)1, 
+					( params.min_samples + num_chains - 1 ) / num_chains );
+    std::vector<std::vector<marked_grid_t<size_t> > > round_grids( num_chains );
+    for( size_t first = 0; first < chain_samples[0]; first += round_size ) {
+      parallel_for( num_chains,
+		    [&]( const size_t k ) {
+		      round_grids[k].clear();
+		      for( size_t i = first;
+			   i < std::min( first + round_size, chain_samples[k] );
+			   ++i ) {
+			round_grids[k].push_back( sample_grid( k ) );
+		      }
+		    },
+		    num_threads );
+      for( size_t k = 0; k < num_chains; ++k ) {
+	for( size_t i = 0; i < round_grids[k].size(); ++i ) {
+	  estimator.add_grid( round_grids[k][i] );
+	}
+      }
+      if( estimator.converged( params ) ) {
+	break;
+      }
     }
-    
-    return -entropy;
+    return estimator.entropy();
   }
 
   //=========================================================================
@@ -3,6 +3,8 @@
 #define __POINT_PROCESS_CORE_ENTROPY_HPP__
 
 #include <math-core/types.hpp>
+#include <boost/unordered_map.hpp>
+#include <mutex>
 #include "point_process.hpp"
 
 namespace point_process_core {
@@ -15,20 +17,279 @@ namespace point_process_core {
 
 
   // Description:
-  // Parameters for extimating the entropy
+  // Parameters for extimating the entropy.
+  // If target_precision is positive, sampling stops early once the
+  // confidence interval half-width (at confidence_z standard errors)
+  // and the bias correction are both below target_precision, after at
+  // least min_samples samples. num_samples is then the maximum number
+  // of samples and the bias-corrected estimate is returned.
   struct entropy_estimator_parameters_t
   {
     size_t num_samples;
     size_t num_samples_to_skip;
     double histogram_grid_cell_size;
+    double target_precision;
+    double confidence_z;
+    size_t min_samples;
     
     entropy_estimator_parameters_t()
       : num_samples( 100 ),
 	num_samples_to_skip( 0 ),
-	histogram_grid_cell_size( 1.0 )
+	histogram_grid_cell_size( 1.0 ),
+	target_precision( 0.0 ),
+	confidence_z( 1.96 ),
+	min_samples( 30 )
     {}
   };
   
+  // Description:
+  // Counts how many times each distinct grid has been seen.
+  // Grids are indexed by their fingerprint and are only compared
+  // exactly when two fingerprints collide, so adding a grid costs
+  // O(1) expected time regardless of the number of distinct grids.
+  class grid_signature_table_t
+  {
+  public:
+
+    grid_signature_table_t()
+      : _num_samples( 0 ),
+	_last_added_index( 0 )
+    {}
+
+    // Description:
+    // Adds count observations of the given grid.
+    // Returns the total count for the grid
+    size_t add( const marked_grid_t<size_t>& grid,
+		const size_t count = 1 );
+
+    // Description:
+    // Adds count observations of the given grid whose fingerprint
+    // (marked_grid_fingerprint) has already been computed
+    size_t add( const marked_grid_t<size_t>& grid,
+		const boost::uint64_t fingerprint,
+		const size_t count );
+
+    // Description:
+    // Adds all the grids and counts of another table
+    void merge( const grid_signature_table_t& other );
+
+    // Description:
+    // Returns the total number of grids added
+    size_t num_samples() const { return _num_samples; }
+
+    // Description:
+    // Returns the number of distinct grids seen
+    size_t num_distinct() const { return _counts.size(); }
+
+    // Description:
+    // Returns the count for each of the distinct grids seen
+    const std::vector<size_t>& counts() const { return _counts; }
+
+    // Description:
+    // Returns the index into counts() of the grid added last
+    size_t last_added_index() const { return _last_added_index; }
+
+    // Description:
+    // Returns the empirical (plug-in) entropy of the grids seen
+    double entropy() const;
+
+    // Description:
+    // Removes all grids from the table
+    void clear();
+
+  protected:
+
+    typedef boost::unordered_multimap<boost::uint64_t, size_t> index_t;
+
+    // Description:
+    // Maps fingerprints to the indices of the distinct grids
+    index_t _index;
+
+    // Description:
+    // The distinct grids and their counts
+    std::vector<marked_grid_t<size_t> > _grids;
+    std::vector<size_t> _counts;
+
+    // Description:
+    // The total number of grids added
+    size_t _num_samples;
+
+    // Description:
+    // The index of the grid added last
+    size_t _last_added_index;
+  };
+
+  // Description:
+  // A grid signature table which many threads can add grids to.
+  // Grids are spread over a number of shards by fingerprint, each
+  // with its own lock, so threads adding different grids rarely
+  // wait on each other. Equal grids always land in the same shard.
+  class concurrent_grid_signature_table_t
+  {
+  public:
+
+    // Description:
+    // Creates a table with the given number of shards
+    concurrent_grid_signature_table_t( const size_t num_shards = 64 )
+      : _shards( num_shards > 0 ? num_shards : 1 )
+    {}
+
+    // Description:
+    // Adds count observations of the given grid
+    void add( const marked_grid_t<size_t>& grid,
+	      const size_t count = 1 );
+
+    // Description:
+    // Returns the total number of grids added
+    size_t num_samples() const;
+
+    // Description:
+    // Returns the empirical (plug-in) entropy of the grids seen.
+    // The result does not depend on the order the grids were added
+    double entropy() const;
+
+    // Description:
+    // Returns all the shards merged into a single table
+    grid_signature_table_t merged() const;
+
+  protected:
+
+    struct shard_t
+    {
+      mutable std::mutex mutex;
+      grid_signature_table_t table;
+    };
+
+    // Description:
+    // The shards
+    std::vector<shard_t> _shards;
+  };
+
+  // Description:
+  // An entropy estimator which takes samples one at a time.
+  // Keeps running sums of the grid counts so the plug-in entropy,
+  // the Miller-Madow bias-corrected entropy and the standard error
+  // are all available in O(1) after every sample.
+  class online_entropy_estimator_t
+  {
+  public:
+
+    // Description:
+    // Creates an estimator for point sets in the given window,
+    // gridded with the given cell size
+    online_entropy_estimator_t( const math_core::nd_aabox_t& window,
+				const double cell_size );
+
+    // Description:
+    // Adds a point set sample
+    void add_sample( const std::vector<math_core::nd_point_t>& sample );
+
+    // Description:
+    // Adds every point set of a batch as a sample
+    void add_sample_batch( const point_set_batch_t& batch );
+
+    // Description:
+    // Adds an already gridded sample
+    void add_grid( const marked_grid_t<size_t>& grid );
+
+    // Description:
+    // Returns the number of samples added
+    size_t num_samples() const { return _grids.num_samples(); }
+
+    // Description:
+    // Returns the number of distinct grids seen
+    size_t num_distinct() const { return _grids.num_distinct(); }
+
+    // Description:
+    // The empirical (plug-in) entropy of the samples
+    double plugin_entropy() const;
+
+    // Description:
+    // The Miller-Madow bias-corrected entropy, the plug-in entropy
+    // plus (K - 1) / 2N for K distinct grids in N samples
+    double entropy() const;
+
+    // Description:
+    // The Miller-Madow bias correction term
+    double bias_correction() const;
+
+    // Description:
+    // The asymptotic standard error of the entropy estimate,
+    // assuming the samples are independent
+    double standard_error() const;
+
+    // Description:
+    // The effective sample size of the samples, from the
+    // autocorrelation of the trace of -ln p(grid) over the samples
+    // in the order they were added
+    double effective_sample_size() const;
+
+    // Description:
+    // The standard error scaled up for correlated samples (such as
+    // those of an mcmc chain) by sqrt( N / ESS ). It is never below
+    // standard_error(). Note that both are zero when all the grid
+    // counts are equal, however correlated the samples are.
+    double chain_standard_error() const;
+
+    // Description:
+    // Returns the half-width of the confidence interval around
+    // entropy() at z standard errors
+    double confidence_half_width( const double z = 1.96 ) const;
+
+    // Description:
+    // Returns true once the estimate has reached the target precision
+    // of the given parameters (never if target_precision is not set).
+    // The interval uses chain_standard_error(), with the effective
+    // sample size recomputed whenever the number of samples has grown
+    // by an eighth. Since the standard error can vanish for equal
+    // counts, min_samples must be large enough for the chain to have
+    // visited the grids it is going to visit.
+    bool converged( const entropy_estimator_parameters_t& params ) const;
+
+  protected:
+
+    // Description:
+    // The window and cell size for the sample grids
+    math_core::nd_aabox_t _window;
+    double _cell_size;
+
+    // Description:
+    // The counts of the grids seen
+    grid_signature_table_t _grids;
+
+    // Description:
+    // Running sums of c ln(c) and c ln(c)^2 over the grid counts
+    double _sum_c_log_c;
+    double _sum_c_log2_c;
+
+    // Description:
+    // The index of the grid of each sample, in order
+    std::vector<size_t> _sample_grids;
+
+    // Description:
+    // The ratio ESS / N last computed by converged() and the number
+    // of samples it was computed at
+    mutable double _ess_ratio;
+    mutable size_t _ess_num_samples;
+  };
+
+  // Description:
+  // Marks a grid over the window with the number of points
+  // of the point set inside each cell
+  marked_grid_t<size_t>
+  point_set_count_grid( const std::vector<math_core::nd_point_t>& points,
+			const math_core::nd_aabox_t& window,
+			const double cell_size );
+
+  // Description:
+  // Marks a grid over the window with the number of points
+  // of point set i of the batch inside each cell
+  marked_grid_t<size_t>
+  point_set_count_grid( const point_set_batch_t& batch,
+			const size_t i,
+			const math_core::nd_aabox_t& window,
+			const double cell_size );
+  
   // Description:
   // Estimate the entropy of a given point process from samples
   double estimate_entropy_from_samples
@@ -42,6 +303,25 @@ namespace point_process_core {
   double estimate_entropy_from_samples
   ( const entropy_estimator_parameters_t& params,
     boost::shared_ptr<mcmc_point_process_t>& process );
+
+  // Description:
+  // Estimate the entropy of a point process using samples from
+  // num_chains clones of it which are run concurrently.
+  // The params.num_samples samples are split between the chains and
+  // their grids are counted in a single concurrent table.
+  // If params.target_precision is positive the chains instead sample
+  // in rounds of about params.min_samples samples in total, and stop
+  // early like estimate_entropy_from_samples once converged; the
+  // bias-corrected estimate is then returned.
+  // If the process does not support seed_rng this falls back to
+  // estimate_entropy_from_samples on a single clone.
+  // The original process is not changed.
+  double estimate_entropy_from_samples_in_parallel
+  ( const entropy_estimator_parameters_t& params,
+    const mcmc_point_process_t& process,
+    const size_t num_chains,
+    const unsigned long seed = 0,
+    const size_t num_threads = 0 );
     
 
 }
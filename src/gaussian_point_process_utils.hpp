@@ -6,6 +6,10 @@
 #include <math-core/matrix.hpp>
 #include <probability-core/distribution_utils.hpp>
 #include <gsl/gsl_sf_erf.h>
+#include "point_math.hpp"
+#include <cmath>
+#include <cassert>
+#include <stdexcept>
 
 
 namespace point_process_core {
@@ -14,9 +18,37 @@ namespace point_process_core {
   using namespace probability_core;
 
 
+  // Description:
+  // An approximation of erfc (Numerical Recipes' erfcc, fractional
+  // error below 1.2e-7 everywhere) which costs a polynomial and a
+  // single exp per value.
+  // The exp is a scalar libm call, so loops over it are not
+  // vectorized.
+  inline
+  double fast_erfc( const double x )
+  {
+    const double z = std::fabs( x );
+    const double t = 1.0 / ( 1.0 + 0.5 * z );
+    const double ans = 
+      t * exp( -z * z - 1.26551223 +
+	       t * ( 1.00002368 +
+	       t * ( 0.37409196 +
+	       t * ( 0.09678418 +
+	       t * ( -0.18628806 +
+	       t * ( 0.27886807 +
+	       t * ( -1.13520398 +
+	       t * ( 1.48851587 +
+	       t * ( -0.82215223 +
+	       t * 0.17087277 ) ) ) ) ) ) ) ) );
+    return x >= 0 ? ans : 2.0 - ans;
+  }
+
+
   // Description:
   // The likelihood of a negtaive observation (a region) given
   // a covariance ( so the mean is the function input / domain )
+  // The per-dimension scales are computed from the covariance
+  // at construction.
   class negative_observation_likelihood_for_mean_t
     : public math_function_t<nd_point_t,double>
   {
@@ -24,33 +56,192 @@ namespace point_process_core {
     double num_points_lambda;
     nd_aabox_t region;
     dense_matrix_t covariance;
+
+    // Description:
+    // The erfc argument scale of each dimension, 1 / (sqrt(2) sig)
+    // with sig the covariance diagonal
+    std::vector<double> erfc_scales;
+    
     negative_observation_likelihood_for_mean_t
     ( const nd_aabox_t& region,
       const dense_matrix_t& covariance,
       const double& num_points_lambda )
-      : region(region),
-	covariance( covariance ),
-	num_points_lambda( num_points_lambda )
-    {}
+      : num_points_lambda( num_points_lambda ),
+	region(region),
+	covariance( covariance )
+    {
+      Eigen::MatrixXd cov = to_eigen_mat( covariance );
+      erfc_scales.resize( cov.rows() );
+      for( long i = 0; i < cov.rows(); ++i ) {
+	double sig = cov(i,i);
+	erfc_scales[i] = 1.0 / ( sqrt(2.0) * sig );
+      }
+    }
     
     virtual
     double operator() ( const nd_point_t& mu ) const
+    {
+      return exp( log_likelihood( mu ) );
+    }
+
+    // Description:
+    // The log of the likelihood
+    double log_likelihood( const nd_point_t& mu ) const
     {
       // treat each dimension of mean independently
-      double p = 1;
-      for( size_t i = 0; i < mu.n; ++i ) {
+      double diff = 0;
+      for( long i = 0; i < mu.n; ++i ) {
 	double x = mu.coordinate[i];
 	double a = region.start.coordinate[i];
 	double b = region.end.coordinate[i];
-	double sig = to_eigen_mat(covariance)(i,i);
-	double amass = gsl_sf_erfc( - ( a - x ) / ( sqrt(2.0) * sig ) );
-	double bmass = gsl_sf_erfc( - ( b - x ) / ( sqrt(2.0) * sig ) );
-	double diff = amass - bmass;
-	double lik = exp( 0.5 * num_points_lambda * diff );
-	p *= lik;
+	double amass = gsl_sf_erfc( ( x - a ) * erfc_scales[i] );
+	double bmass = gsl_sf_erfc( ( x - b ) * erfc_scales[i] );
+	diff += amass - bmass;
+      }
+      return 0.5 * num_points_lambda * diff;
+    }
+
+    // Description:
+    // The log of the likelihood for each of the given means, using
+    // fast_erfc in tight loops over the means
+    void log_likelihood( const soa_point_set_t& mus,
+			 std::vector<double>& log_lik ) const
+    {
+      const size_t n = mus.size();
+      log_lik.assign( n, 0.0 );
+      double* out = log_lik.data();
+      for( size_t i = 0; i < mus.dimension(); ++i ) {
+	const double a = region.start.coordinate[i];
+	const double b = region.end.coordinate[i];
+	const double s = erfc_scales[i];
+	const double* x = mus.coordinates( i );
+	for( size_t k = 0; k < n; ++k ) {
+	  out[k] += fast_erfc( ( x[k] - a ) * s ) - fast_erfc( ( x[k] - b ) * s );
+	}
+      }
+      const double factor = 0.5 * num_points_lambda;
+      for( size_t k = 0; k < n; ++k ) {
+	out[k] *= factor;
+      }
+    }
+  };
+
+
+  // Description:
+  // The conjugate gaussian posterior of a cluster mean given a fixed
+  // (likelihood) covariance, a gaussian prior and the points.
+  // The precisions are computed once from Cholesky factors, and
+  // the points are kept as sufficient statistics (count and sum), so
+  // a single point is added or removed in O(d).
+  // With L the Cholesky factor of the prior precision and
+  // L^-1 P L^-T = V D V^T, the posterior precision n P + P0 is
+  // L V ( n D + I ) V^T L^T for any count n, so the posterior mean
+  // is solved in O(d^2) through the basis W = L^-T V without
+  // refactoring (and without any state changing on const calls).
+  class gaussian_mean_conjugate_posterior_t
+  {
+  public:
+
+    gaussian_mean_conjugate_posterior_t
+    ( const dense_matrix_t& covariance,
+      const gaussian_distribution_t& prior )
+      : _num_points( 0 )
+    {
+      Eigen::MatrixXd cov = to_eigen_mat( covariance );
+      Eigen::MatrixXd prior_cov = to_eigen_mat( prior.covariance );
+      const long dim = cov.rows();
+      _precision = cov.llt().solve( Eigen::MatrixXd::Identity( dim, dim ) );
+      _prior_precision = prior_cov.llt().solve( Eigen::MatrixXd::Identity( dim, dim ) );
+      _prior_term = _prior_precision * to_eigen_mat( prior.means );
+      _sum = Eigen::VectorXd::Zero( dim );
+
+      // the precision in the basis of the prior precision's factor
+      Eigen::LLT<Eigen::MatrixXd> prior_llt( _prior_precision );
+      Eigen::MatrixXd l_inv_p = prior_llt.matrixL().solve( _precision );
+      Eigen::MatrixXd whitened = prior_llt.matrixL().solve( l_inv_p.transpose() );
+      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen( whitened );
+      _eigenvalues = eigen.eigenvalues();
+      _basis = prior_llt.matrixU().solve( eigen.eigenvectors() );
+    }
+
+    // Description:
+    // Adds / removes a point from the sufficient statistics
+    void add_point( const nd_point_t& x )
+    {
+      for( long k = 0; k < _sum.size(); ++k ) {
+	_sum(k) += x.coordinate[k];
+      }
+      ++_num_points;
+    }
+    void remove_point( const nd_point_t& x )
+    {
+      assert( _num_points > 0 );
+      for( long k = 0; k < _sum.size(); ++k ) {
+	_sum(k) -= x.coordinate[k];
       }
-      return p;
+      --_num_points;
     }
+    void add_points( const std::vector<nd_point_t>& points )
+    {
+      for( size_t i = 0; i < points.size(); ++i ) {
+	add_point( points[i] );
+      }
+    }
+
+    // Description:
+    // The sufficient statistics
+    size_t num_points() const { return _num_points; }
+    const Eigen::VectorXd& sum() const { return _sum; }
+
+    // Description:
+    // The posterior covariance and mean of the cluster mean
+    Eigen::MatrixXd posterior_covariance() const
+    {
+      return _basis * _posterior_scales().asDiagonal() * _basis.transpose();
+    }
+    Eigen::VectorXd posterior_mean() const
+    {
+      Eigen::VectorXd b = _basis.transpose() * ( _precision * _sum + _prior_term );
+      return _basis * _posterior_scales().cwiseProduct( b );
+    }
+
+    // Description:
+    // The posterior as a gaussian distribution
+    gaussian_distribution_t posterior() const
+    {
+      gaussian_distribution_t dist;
+      dist.dimension = _sum.size();
+      dist.means = to_vector( posterior_mean() ).component;
+      dist.covariance = to_dense_mat( posterior_covariance() );
+      return dist;
+    }
+
+  protected:
+
+    // Description:
+    // The diagonal of ( n D + I )^-1 for the current count
+    Eigen::VectorXd _posterior_scales() const
+    {
+      return ( _eigenvalues * (double)_num_points
+	       + Eigen::VectorXd::Ones( _eigenvalues.size() ) ).cwiseInverse();
+    }
+
+    // Description:
+    // The precisions of the likelihood and the prior, and the
+    // prior precision times the prior mean
+    Eigen::MatrixXd _precision;
+    Eigen::MatrixXd _prior_precision;
+    Eigen::VectorXd _prior_term;
+
+    // Description:
+    // The basis W and eigenvalues D diagonalizing both precisions
+    Eigen::MatrixXd _basis;
+    Eigen::VectorXd _eigenvalues;
+
+    // Description:
+    // The sufficient statistics of the points
+    size_t _num_points;
+    Eigen::VectorXd _sum;
   };
 
 
@@ -68,9 +259,26 @@ namespace point_process_core {
     gaussian_distribution_t prior;
     poisson_distribution_t num_distribution;
     gaussian_distribution_t posterior_for_points_only;
-    boost::shared_ptr<math_function_t<nd_point_t,double> > posterior;
+
+    // Description:
+    // The conjugate posterior of the points (kept in step with
+    // the points by add_point / remove_point, and rebuilt from them
+    // by calculate_posterior)
+    gaussian_mean_conjugate_posterior_t points_only_conjugate;
 
     double scale;
+
+    // Description:
+    // The likelihood of each negative observation (the factors of
+    // the posterior function after the points-only gaussian)
+    std::vector<boost::shared_ptr<negative_observation_likelihood_for_mean_t> > negative_likelihoods;
+
+    // Description:
+    // The flattened log posterior: the mean, precision (row major)
+    // and log normalizer of the points-only gaussian
+    std::vector<double> fused_mean;
+    std::vector<double> fused_precision;
+    double fused_log_normalizer;
     
     gaussian_mixture_mean_posterior_t
     ( const std::vector<nd_point_t>& points,
@@ -82,79 +290,197 @@ namespace point_process_core {
 	negative_observations(negative_observations),
 	covariance( cov ),
 	num_distribution( num_distribution ),
-	prior( prior )
+	prior( prior ),
+	points_only_conjugate( cov, prior )
     {
-      calculate_posterior();
+      points_only_conjugate.add_points( points );
+      posterior_for_points_only = points_only_conjugate.posterior();
+      calculate_negative_likelihoods();
+      calculate_fused_posterior();
     }
 
-    void calculate_points_only_posterior()
+    // Description:
+    // Adds / removes a point of the cluster and updates the
+    // posterior, without refactoring the prior or recomputing the
+    // negative observation likelihoods (for moving single points
+    // between clusters).
+    // remove_point throws std::runtime_error if the point is not
+    // one of the points.
+    void add_point( const nd_point_t& x )
+    {
+      points.push_back( x );
+      points_only_conjugate.add_point( x );
+      posterior_for_points_only = points_only_conjugate.posterior();
+      calculate_fused_posterior();
+    }
+    void remove_point( const nd_point_t& x )
     {
-      // the dimension of the poitns
-      std::size_t dim = 0;
-      if( points.empty() == false )
-	dim = points[0].n;
-      
-      // invert the covariance to get a precision
-      // (Not sure if this actually works for anything greater than 1D poitns!!)
-      Eigen::MatrixXd prec_mat = to_eigen_mat( covariance ).inverse();
-      
-      // calculate the sum of the data points
-      Eigen::VectorXd sum_vec( dim );
       for( size_t i = 0; i < points.size(); ++i ) {
-	for( size_t k = 0; k < dim; ++k ) {
-	  sum_vec(k) += points[i].coordinate[k];
+	if( points[i].coordinate == x.coordinate ) {
+	  points.erase( points.begin() + i );
+	  points_only_conjugate.remove_point( x );
+	  posterior_for_points_only = points_only_conjugate.posterior();
+	  calculate_fused_posterior();
+	  return;
 	}
       }
-      
-      
-      // Invert the prior's covariance to get a prior precision
-      // and get the prior mean as Eign vector
-      Eigen::MatrixXd prior_prec = to_eigen_mat( prior.covariance ).inverse();
-      Eigen::VectorXd prior_mean = to_eigen_mat( prior.means );
-      
-      // Ok, now calculate the distribution over the new mixture mean
-      Eigen::MatrixXd new_dist_prec = prec_mat * points.size() + prior_prec;
-      Eigen::MatrixXd new_dist_cov = new_dist_prec.inverse();
-      Eigen::VectorXd new_dist_mean 
-	= new_dist_cov * ( prec_mat * sum_vec + prior_prec * prior_mean );
-      
+      throw std::runtime_error( "cannot remove a point which is not in the cluster" );
+    }
+
+    void calculate_points_only_posterior()
+    {
       // This is the posterior if you only include the observation points
       // and do NOT use the negative observations (so conjugate hence gaussian)
-      gaussian_distribution_t new_dist;
-      new_dist.dimension = dim;
-      new_dist.means = to_vector( new_dist_mean ).component;
-      new_dist.covariance = to_dense_mat( new_dist_cov );
-
-      posterior_for_points_only = new_dist;
+      // rebuilt from the points, covariance and prior members
+      points_only_conjugate = gaussian_mean_conjugate_posterior_t( covariance, prior );
+      points_only_conjugate.add_points( points );
+      posterior_for_points_only = points_only_conjugate.posterior();
     }
 
+    // Description:
+    // Recomputes the whole posterior from the members (for callers
+    // which changed them directly rather than with add_point /
+    // remove_point)
     void calculate_posterior()
     {
 
       // cacluate the posterior using only the points and nopt
       // the negative regions
       calculate_points_only_posterior();
+      calculate_negative_likelihoods();
+      calculate_fused_posterior();
+    }
 
-      // create the posterior math function 
-      // (we will start with the point posterior and multiply by the likelihood
-      // of the negaztive observatiosn )
-      posterior = functions::gaussian_pdf( posterior_for_points_only );
-
-      // Now, we need to multiply by the probability of *each* negative 
-      // observation
+    // Description:
+    // Creates the likelihood of *each* negative observation
+    void calculate_negative_likelihoods()
+    {
+      negative_likelihoods.clear();
       for( size_t i = 0; i < negative_observations.size(); ++i ) {
-	boost::shared_ptr<math_function_t<nd_point_t,double> > neg_lik( new negative_observation_likelihood_for_mean_t( negative_observations[i], covariance, num_distribution.lambda ) );
-	posterior = neg_lik * posterior;
+	boost::shared_ptr<negative_observation_likelihood_for_mean_t> neg_lik( new negative_observation_likelihood_for_mean_t( negative_observations[i], covariance, num_distribution.lambda ) );
+	negative_likelihoods.push_back( neg_lik );
       }
+    }
+
+    // Description:
+    // Precomputes the scale (the points-only posterior at its mean)
+    // and the constants of the flattened log posterior
+    void calculate_fused_posterior()
+    {
+      const size_t dim = posterior_for_points_only.means.size();
 
       // set the scale to the mean with only the points
       this->scale = pdf( point(posterior_for_points_only.means),
 			 posterior_for_points_only );
+
+      // the points-only gaussian
+      Eigen::MatrixXd cov = to_eigen_mat( posterior_for_points_only.covariance );
+      Eigen::LLT<Eigen::MatrixXd> llt( cov );
+      Eigen::MatrixXd prec = llt.solve( Eigen::MatrixXd::Identity( dim, dim ) );
+      double log_det = 0;
+      for( size_t i = 0; i < dim; ++i ) {
+	log_det += 2.0 * log( llt.matrixL()( i, i ) );
+      }
+      fused_mean = posterior_for_points_only.means;
+      fused_precision.resize( dim * dim );
+      for( size_t i = 0; i < dim; ++i ) {
+	for( size_t j = 0; j < dim; ++j ) {
+	  fused_precision[ i * dim + j ] = prec( i, j );
+	}
+      }
+      fused_log_normalizer = -0.5 * ( dim * log( 2.0 * M_PI ) + log_det );
+    }
+
+    // Description:
+    // The log of the posterior at mu: the points-only gaussian plus
+    // the log likelihood of every negative region
+    double log_posterior( const nd_point_t& mu ) const
+    {
+      const size_t dim = fused_mean.size();
+
+      // gaussian term
+      double quad = 0;
+      for( size_t i = 0; i < dim; ++i ) {
+	double di = mu.coordinate[i] - fused_mean[i];
+	double row = 0;
+	for( size_t j = 0; j < dim; ++j ) {
+	  row += fused_precision[ i * dim + j ] * ( mu.coordinate[j] - fused_mean[j] );
+	}
+	quad += di * row;
+      }
+
+      // negative regions
+      double neg = 0;
+      for( size_t r = 0; r < negative_likelihoods.size(); ++r ) {
+	neg += negative_likelihoods[r]->log_likelihood( mu );
+      }
+      
+      return fused_log_normalizer - 0.5 * quad + neg;
+    }
+
+    // Description:
+    // The log of the posterior at each of the given means
+    // (as log_posterior( mu ) for every point of the set, with the
+    // negative regions batched through fast_erfc)
+    void log_posterior( const soa_point_set_t& mus,
+			std::vector<double>& log_p ) const
+    {
+      const size_t dim = fused_mean.size();
+      const size_t n = mus.size();
+      std::vector<double> quad( n, 0.0 );
+      std::vector<double> row( n );
+
+      // gaussian term, a dimension at a time over all the means
+      for( size_t i = 0; i < dim; ++i ) {
+	std::fill( row.begin(), row.end(), 0.0 );
+	for( size_t j = 0; j < dim; ++j ) {
+	  const double p = fused_precision[ i * dim + j ];
+	  const double m = fused_mean[j];
+	  const double* x = mus.coordinates( j );
+	  for( size_t k = 0; k < n; ++k ) {
+	    row[k] += p * ( x[k] - m );
+	  }
+	}
+	const double m = fused_mean[i];
+	const double* x = mus.coordinates( i );
+	for( size_t k = 0; k < n; ++k ) {
+	  quad[k] += ( x[k] - m ) * row[k];
+	}
+      }
+
+      log_p.resize( n );
+      for( size_t k = 0; k < n; ++k ) {
+	log_p[k] = fused_log_normalizer - 0.5 * quad[k];
+      }
+
+      // negative regions, a region at a time over all the means
+      for( size_t r = 0; r < negative_likelihoods.size(); ++r ) {
+	negative_likelihoods[r]->log_likelihood( mus, row );
+	for( size_t k = 0; k < n; ++k ) {
+	  log_p[k] += row[k];
+	}
+      }
     }
 
     double operator() ( const nd_point_t& mu ) const
     {
-      return (*posterior)(mu);
+      return exp( log_posterior( mu ) );
+    }
+
+    // Description:
+    // The posterior as a product of math functions: the points-only
+    // gaussian times the likelihood of each negative observation.
+    // This is only kept for callers which compose math functions; it
+    // is built on every call and is slower to evaluate than
+    // operator() and log_posterior().
+    boost::shared_ptr<math_function_t<nd_point_t,double> > posterior_function() const
+    {
+      boost::shared_ptr<math_function_t<nd_point_t,double> > posterior
+	= functions::gaussian_pdf( posterior_for_points_only );
+      for( size_t i = 0; i < negative_likelihoods.size(); ++i ) {
+	posterior = boost::shared_ptr<math_function_t<nd_point_t,double> >( negative_likelihoods[i] ) * posterior;
+      }
+      return posterior;
     }
     
   };
@@ -4,7 +4,11 @@
 
 
 #include "marked_grid.hpp"
+#include "point_math.hpp"
+#include "parallel.hpp"
 #include <boost/function.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <mutex>
 
 
 namespace point_process_core {
@@ -22,7 +26,7 @@ namespace point_process_core {
   ( const boost::function< T_Result( const math_core::nd_point_t& ) >& f,
     marked_grid_t<T_Mark>& grid )
   {
-    for( auto cell : grid.all_cells() ) {
+    for( const marked_grid_cell_t& cell : grid.cells() ) {
       math_core::nd_point_t x = math_core::centroid( grid.region( cell ) );
       T_Mark m = f( x );
       grid.set( cell, m );
@@ -31,6 +35,122 @@ namespace point_process_core {
   
   //-------------------------------------------------------------------------
 
+  // Description:
+  // Returns the index-th cell of a range (in its iteration order)
+  inline
+  marked_grid_cell_t nth_cell( const marked_grid_cell_range_t& range,
+			       size_t index )
+  {
+    marked_grid_cell_t cell = range.min_cell();
+    for( long i = (long)cell.n - 1; i >= 0; --i ) {
+      size_t extent = range.max_cell().coordinate[i] - range.min_cell().coordinate[i] + 1;
+      cell.coordinate[i] += index % extent;
+      index /= extent;
+    }
+    return cell;
+  }
+
+  // Description:
+  // Steps a cell to the next cell of a range (last dimension fastest)
+  inline
+  void step_cell( const marked_grid_cell_range_t& range,
+		  marked_grid_cell_t& cell )
+  {
+    for( long i = (long)cell.n - 1; i >= 0; --i ) {
+      if( cell.coordinate[i] < range.max_cell().coordinate[i] ) {
+	cell.coordinate[i] += 1;
+	return;
+      }
+      cell.coordinate[i] = range.min_cell().coordinate[i];
+    }
+  }
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Computes the centers of count consecutive cells of the range,
+  // starting at the first-th cell, into the given point set.
+  // The centers are the same as centroid( grid.region( cell ) ).
+  template<class T_Mark>
+  void grid_cell_centers( const marked_grid_t<T_Mark>& grid,
+			  const marked_grid_cell_range_t& range,
+			  const size_t first,
+			  const size_t count,
+			  soa_point_set_t& centers )
+  {
+    const size_t n = range.min_cell().n;
+    const math_core::nd_point_t origin = grid.origin();
+    const std::vector<double> sizes = grid.cell_sizes();
+    centers = soa_point_set_t( n, count );
+    marked_grid_cell_t cell = nth_cell( range, first );
+    for( size_t k = 0; k < count; ++k ) {
+      for( size_t i = 0; i < n; ++i ) {
+	double start = cell.coordinate[i] * sizes[i] + origin.coordinate[i];
+	double end = start + sizes[i];
+	centers( k, i ) = ( start + end ) / 2;
+      }
+      step_cell( range, cell );
+    }
+  }
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Given a batched function and a grid, evaluates the function at
+  // *every* grid cell center and stores the result as the mark
+  // on the grid.
+  // The cells are split into tiles of tile_size consecutive cells
+  // (in the cells() ordering), which are evaluated in parallel with up
+  // to num_threads threads (0 means the hardware concurrency). For
+  // each tile f( centers, values ) is given the centers of the
+  // tile's cells and must fill values with one result per center.
+  // f is called from several threads at once.
+  // Dense grids are written in place tile by tile, other grids
+  // are written under a lock.
+  template< class T_Mark >
+  void evaluate_function_at_grid_centers
+  ( const boost::function< void( const soa_point_set_t&, std::vector<T_Mark>& ) >& f,
+    marked_grid_t<T_Mark>& grid,
+    const size_t tile_size = 4096,
+    const size_t num_threads = 0 )
+  {
+    const marked_grid_cell_range_t range = grid.cells();
+    const size_t num_cells = range.size();
+    const size_t tile = ( tile_size > 0 ? tile_size : 1 );
+    const size_t num_tiles = ( num_cells + tile - 1 ) / tile;
+
+    // the dense flat arrays follow the cells() ordering
+    const bool in_place = ( grid.dense_size() == num_cells &&
+			    !boost::is_same<T_Mark, bool>::value );
+    std::mutex grid_mutex;
+    parallel_for( num_tiles,
+		  [&]( const size_t t ) {
+		    const size_t first = t * tile;
+		    const size_t count = std::min( tile, num_cells - first );
+		    soa_point_set_t centers;
+		    grid_cell_centers( grid, range, first, count, centers );
+		    std::vector<T_Mark> values;
+		    values.reserve( count );
+		    f( centers, values );
+		    if( values.size() != count ) {
+		      throw std::runtime_error( "batched grid function returned the wrong number of values" );
+		    }
+		    if( in_place ) {
+		      grid.set_dense( first, values );
+		      return;
+		    }
+		    marked_grid_cell_t cell = nth_cell( range, first );
+		    std::lock_guard<std::mutex> lock( grid_mutex );
+		    for( size_t k = 0; k < count; ++k ) {
+		      grid.set( cell, values[k] );
+		      step_cell( range, cell );
+		    }
+		  },
+		  num_threads );
+  }
+
+  //-------------------------------------------------------------------------
+
   // Description:
   // Plot a marked grid suing linear grid-cells axis
   // and the height (y) as teh mark
@@ -4,7 +4,11 @@
 
 
 #include "marked_grid.hpp"
+#include "point_set_batch.hpp"
 #include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <mutex>
 #include <object-search.common/plots.hpp>
 
 
@@ -14,35 +18,71 @@ namespace point_process_core {
   //-------------------------------------------------------------------------
   
 
+  // Description:
+  // The largest number of bins for which histograms use dense
+  // storage by default. Dense storage allocates and scans every bin
+  // of the window, so larger histograms are sparse unless dense
+  // storage is asked for.
+  const size_t max_default_dense_histogram_bins = 4096;
+
   // Description:
   // A histrogram stores a number of bins of a window of space and
   // a count of the number of elements seen within each bin.
   // This class builkds upon the marked grid to easily increment and 
   // decrement bin counts.
+  // The total count is kept up to date as bins change, including
+  // changes through a marked_grid_t reference (the writers of
+  // marked_grid_t are virtual).
   template< class T >
   class histogram_t : public marked_grid_t<T>
   {
   public:
+
+    // Description:
+    // Default constructor which creates an empty invalid histogram
+    histogram_t()
+      : _bins_per_dim( 0 ),
+	_total( T(0) )
+    {}
     
     // Descripotion:
     // Creates a new histogram with a set number of bins per dimension
-    // over the given window
+    // over the given window.
+    // The counts are kept in a flat array unless there would be
+    // more than max_default_dense_histogram_bins bins.
     histogram_t( const nd_aabox_t& window,
 		 const size_t& bins_per_dim )
-      : _bins_per_dim( bins_per_dim )
+      : _bins_per_dim( bins_per_dim ),
+	_total( T(0) )
     {
-      
-      assert( !math_core::undefined(window) );
-      
-      // create the size (resolutions) for each of the dimansion of the
-      // marked grid from the window sizes and num bins
-      std::vector<double> resolutions;
-      for( int i = 0; i < window.n; ++i ) {
-	resolutions.push_back( (window.end.coordinate[i] - window.start.coordinate[i]) / (double)bins_per_dim );
-      }
-      
-      // initialize the marked grid
-      this->_init( window, window.start, resolutions );
+      _init_histogram( window, default_storage( window, bins_per_dim ) );
+    }
+
+    // Descripotion:
+    // Creates a new histogram with a set number of bins per dimension
+    // over the given window, using the given storage for the counts
+    histogram_t( const nd_aabox_t& window,
+		 const size_t& bins_per_dim,
+		 const marked_grid_storage_t storage )
+      : _bins_per_dim( bins_per_dim ),
+	_total( T(0) )
+    {
+      _init_histogram( window, storage );
+    }
+
+    // Description:
+    // Copies a histogram (the lock of the total is not shared)
+    histogram_t( const histogram_t<T>& other )
+      : marked_grid_t<T>( other ),
+	_bins_per_dim( other._bins_per_dim ),
+	_total( other._total )
+    {}
+    histogram_t<T>& operator= ( const histogram_t<T>& other )
+    {
+      marked_grid_t<T>::operator=( other );
+      _bins_per_dim = other._bins_per_dim;
+      _total = other._total;
+      return *this;
     }
 
     // Description:
@@ -55,12 +95,12 @@ namespace point_process_core {
     // Increment the count for a given grid cell
     void increment_bin( const marked_grid_cell_t& cell, const T& inc = T(1) ) 
     {
-      boost::optional<T> mark = this->operator()( cell );
-      if( mark ) {
-	this->set( cell, *mark + inc );
-      } else {
-	this->set( cell, inc );
+      bool created;
+      T& mark = this->_mark_reference( cell, inc, created );
+      if( !created ) {
+	mark += inc;
       }
+      _total += inc;
     }
     
     // Description:
@@ -70,15 +110,26 @@ namespace point_process_core {
       this->increment_bin( this->cell( p ), inc );
     }
 
+    // Description:
+    // increment counts for every point of every point set in the batch
+    void increment_bins( const point_set_batch_t& batch, const T& inc = T(1) )
+    {
+      for( size_t p = 0; p < batch.num_points(); ++p ) {
+	this->increment_bin( this->cell( batch.point( p ) ), inc );
+      }
+    }
+
     // Description:
     // decrement the count for a given grid cell
     void decrement_bin( const marked_grid_cell_t& cell, const T& dec = T(1) ) 
     {
-      boost::optional<T> mark = this->operator()( cell );
-      if( mark ) {
-	this->set( cell, *mark - dec );
+      bool created;
+      T& mark = this->_mark_reference( cell, dec, created );
+      if( created ) {
+	_total += dec;
       } else {
-	this->set( cell, dec );
+	mark -= dec;
+	_total -= dec;
       }
     }
 
@@ -89,15 +140,121 @@ namespace point_process_core {
       this->decrement_bin( this->cell( p ), dec );
     }
 
+    // Description:
+    // Set the count of a bin
+    void set( const marked_grid_cell_t& cell, const T& count )
+    {
+      bool created;
+      T& mark = this->_mark_reference( cell, count, created );
+      if( !created ) {
+	_total -= mark;
+	mark = count;
+      }
+      _total += count;
+    }
+    void set( const math_core::nd_point_t& p, const T& count )
+    {
+      this->set( this->cell( p ), count );
+    }
+
+    // Description:
+    // Remove the count of a bin
+    void clear_mark( const marked_grid_cell_t& cell )
+    {
+      boost::optional<T> mark = this->operator()( cell );
+      if( mark ) {
+	_total -= *mark;
+	marked_grid_t<T>::clear_mark( cell );
+      }
+    }
+    void clear_mark( const math_core::nd_point_t& p )
+    {
+      this->clear_mark( this->cell( p ) );
+    }
+
+    // Description:
+    // Remove all counts
+    void clear()
+    {
+      marked_grid_t<T>::clear();
+      _total = T(0);
+    }
+
+    // Description:
+    // Sets the counts of the dense bins with flat indices
+    // [first, first + counts.size()).
+    // As marked_grid_t::set_dense, distinct ranges may be set from
+    // different threads at once.
+    void set_dense( const size_t first,
+		    const std::vector<T>& counts )
+    {
+      T delta = T(0);
+      for( size_t i = 0; i < counts.size(); ++i ) {
+	if( this->_dense_present[ first + i ] ) {
+	  delta -= this->_dense_marks[ first + i ];
+	}
+	delta += counts[i];
+      }
+      marked_grid_t<T>::set_dense( first, counts );
+      std::lock_guard<std::mutex> lock( _total_mutex );
+      _total += delta;
+    }
+
+    // Description:
+    // Returns true if the other histogram has the same window and bins
+    template< class T_Other >
+    bool has_same_bins( const histogram_t<T_Other>& other ) const
+    {
+      return ( _bins_per_dim == other.bins_per_dimension() &&
+	       this->_cell_sizes == other.cell_sizes() &&
+	       this->_bounds.start.coordinate == other.window().start.coordinate &&
+	       this->_bounds.end.coordinate == other.window().end.coordinate );
+    }
+
+    // Description:
+    // Adds the counts of another histogram with the same bins to
+    // this one, in place
+    void merge( const histogram_t<T>& other )
+    {
+      _combine( other, T(1) );
+    }
+
+    // Description:
+    // Subtracts the counts of another histogram with the same bins
+    // from this one, in place. Bins with no count here are treated
+    // as zero (so they may become negative)
+    void subtract( const histogram_t<T>& other )
+    {
+      _combine( other, T(-1) );
+    }
+
+    // Description:
+    // Multiplies every count by the given factor, in place
+    void scale( const T& factor )
+    {
+      this->transform_marks( [&]( T& mark ) { mark *= factor; } );
+    }
+
+    // Description:
+    // Scales the counts to sum to one, in place.
+    // Does nothing if the total count is zero.
+    // Only histograms with floating point counts can be normalized
+    // (integral counts would all round down to zero).
+    void normalize_in_place()
+    {
+      static_assert( std::is_floating_point<T>::value,
+		     "normalize_in_place needs a histogram with floating point counts" );
+      if( _total != T(0) ) {
+	scale( T(1) / _total );
+	_total = T(1);
+      }
+    }
+
     // Description:
     // Retursn the total count in all bins in this histogram
     T total_count() const
     {
-      T sum = T(0);
-      for( auto cell : this->all_marked_cells() ) {
-	sum += ( *this->operator()( cell ) );
-      }
-      return sum;
+      return _total;
     }
 
     // Description:
@@ -106,11 +263,97 @@ namespace point_process_core {
       return _bins_per_dim;
     }
 
+    // Description:
+    // Returns the default storage for a histogram
+    static marked_grid_storage_t default_storage( const nd_aabox_t& window,
+						  const size_t bins_per_dim )
+    {
+      // a window of n bins also includes the cells at its end
+      double num_bins = 1;
+      for( long i = 0; i < window.n; ++i ) {
+	num_bins *= ( bins_per_dim + 1 );
+      }
+      if( num_bins <= max_default_dense_histogram_bins ) {
+	return MARKED_GRID_DENSE_STORAGE;
+      }
+      return MARKED_GRID_SPARSE_STORAGE;
+    }
+
   protected:
 
     // Description:
     // THe number of bins per dimension
     size_t _bins_per_dim;
+
+    // Description:
+    // The total count over all bins, and a lock for the
+    // concurrent set_dense()
+    T _total;
+    std::mutex _total_mutex;
+
+    // Description:
+    // Recomputes the total count after a transform_marks()
+    void _marks_changed()
+    {
+      _total = T(0);
+      this->for_each_mark( [&]( const marked_grid_cell_t& cell,
+				const T& count ) {
+			     _total += count;
+			   } );
+    }
+
+    // Description:
+    // Adds sign times the counts of the other histogram.
+    // Aligned flat arrays are combined directly, anything
+    // else (sparse or tiled on either side) bin by bin
+    void _combine( const histogram_t<T>& other, const T& sign )
+    {
+      if( !has_same_bins( other ) ) {
+	throw std::runtime_error( "cannot combine histograms with different bins" );
+      }
+      if( this->dense_size() > 0 &&
+	  this->dense_size() == other.dense_size() &&
+	  this->dense_cell( 0 ) == other.dense_cell( 0 ) ) {
+	for( size_t i = 0; i < other._dense_present.size(); ++i ) {
+	  if( other._dense_present[i] ) {
+	    if( this->_dense_present[i] ) {
+	      this->_dense_marks[i] += sign * other._dense_marks[i];
+	    } else {
+	      this->_dense_marks[i] = sign * other._dense_marks[i];
+	      this->_dense_present[i] = 1;
+	    }
+	    _total += sign * other._dense_marks[i];
+	  }
+	}
+	typename marked_grid_t<T>::map_t::const_iterator iter;
+	for( iter = other._map.begin(); iter != other._map.end(); ++iter ) {
+	  this->increment_bin( iter->first, sign * iter->second );
+	}
+      } else {
+	other.for_each_mark( [&]( const marked_grid_cell_t& cell,
+				  const T& count ) {
+			       this->increment_bin( cell, sign * count );
+			     } );
+      }
+    }
+
+    // Description:
+    // Initialize the underlying grid for the window
+    void _init_histogram( const nd_aabox_t& window,
+			  const marked_grid_storage_t storage )
+    {
+      assert( !math_core::undefined(window) );
+      
+      // create the size (resolutions) for each of the dimansion of the
+      // marked grid from the window sizes and num bins
+      std::vector<double> resolutions;
+      for( int i = 0; i < window.n; ++i ) {
+	resolutions.push_back( (window.end.coordinate[i] - window.start.coordinate[i]) / (double)_bins_per_dim );
+      }
+      
+      // initialize the marked grid
+      this->_init( window, window.start, resolutions, storage );
+    }
     
   };
   
@@ -142,23 +385,96 @@ namespace point_process_core {
   histogram_t<T_Result>
   normalize_histogram( const histogram_t<T>& hist )
   {
-    histogram_t<T_Result> norm( hist.window(), hist.bins_per_dimension() );
+    histogram_t<T_Result> norm( hist.window(),
+				hist.bins_per_dimension(),
+				hist.storage() );
 
-    // compute the total sum of counts
-    T_Result sum = T_Result(0.0);
-    for( auto cell : hist.all_marked_cells() ) {
-      sum += ( *hist(cell) );
-    }
+    // the total sum of counts
+    T_Result sum = T_Result( hist.total_count() );
     
     // create normalized histogram
-    for( auto cell : hist.all_marked_cells() ) {
-      norm.set( cell, T_Result( *hist(cell) / sum ) );
-    }
+    hist.for_each_mark( [&]( const marked_grid_cell_t& cell,
+			     const T& count ) {
+			  norm.set( cell, T_Result( count / sum ) );
+			} );
 
     return norm;
   }
 
 
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Returns true if two histograms have the same window and bins
+  // and all their counts are in aligned flat arrays
+  template< typename TP, typename TQ >
+  bool have_aligned_dense_bins( const histogram_t<TP>& p_hist,
+				const histogram_t<TQ>& q_hist )
+  {
+    return ( p_hist.bins_per_dimension() == q_hist.bins_per_dimension() &&
+	     p_hist.cell_sizes() == q_hist.cell_sizes() &&
+	     p_hist.window().start.coordinate == q_hist.window().start.coordinate &&
+	     p_hist.window().end.coordinate == q_hist.window().end.coordinate &&
+	     p_hist.dense_size() > 0 &&
+	     p_hist.dense_size() == q_hist.dense_size() &&
+	     p_hist.sparse_size() == 0 &&
+	     q_hist.sparse_size() == 0 );
+  }
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // The KL divergence of kl_divergenge() for two histograms with
+  // aligned dense bins (see have_aligned_dense_bins).
+  // Works directly on the flat arrays: one pass for the sums and
+  // counts, then one branch-free pass for the divergence terms, with
+  // no intermediate histograms
+  template< typename TP, typename TQ, typename T_Result >
+  T_Result dense_kl_divergence( const histogram_t<TP>& p_hist,
+				const histogram_t<TQ>& q_hist,
+				const T_Result& epsilon )
+  {
+    const size_t n = p_hist.dense_size();
+    const TP* p_counts = p_hist.dense_marks();
+    const TQ* q_counts = q_hist.dense_marks();
+    const unsigned char* p_present = p_hist.dense_presence();
+    const unsigned char* q_present = q_hist.dense_presence();
+
+    // the sums and number of marked bins of each histogram, and the
+    // number of bins marked in either
+    T_Result p_sum = T_Result(0.0);
+    T_Result q_sum = T_Result(0.0);
+    size_t p_count = 0;
+    size_t q_count = 0;
+    size_t union_count = 0;
+    for( size_t i = 0; i < n; ++i ) {
+      p_sum += p_present[i] ? T_Result( p_counts[i] ) : T_Result(0.0);
+      q_sum += q_present[i] ? T_Result( q_counts[i] ) : T_Result(0.0);
+      p_count += p_present[i];
+      q_count += q_present[i];
+      union_count += ( p_present[i] | q_present[i] );
+    }
+
+    // the absolute discounting of kl_divergenge(): missing bins get
+    // epsilon which is taken back evenly from the marked bins
+    T_Result p_subnorm = ( ( union_count - p_count ) * epsilon ) / p_count;
+    T_Result q_subnorm = ( ( union_count - q_count ) * epsilon ) / q_count;
+
+    // bins marked in neither histogram get p = q = 1 so their
+    // term is exactly zero
+    T_Result kl = T_Result(0.0);
+    for( size_t i = 0; i < n; ++i ) {
+      T_Result p = p_present[i] 
+	? T_Result( p_counts[i] / p_sum ) - p_subnorm
+	: ( q_present[i] ? epsilon : T_Result(1.0) );
+      T_Result q = q_present[i]
+	? T_Result( q_counts[i] / q_sum ) - q_subnorm
+	: ( p_present[i] ? epsilon : T_Result(1.0) );
+      kl += p * log( p / q );
+    }
+    return kl;
+  }
+
   //-------------------------------------------------------------------------
   
   
@@ -175,6 +491,11 @@ namespace point_process_core {
 			  const histogram_t<TQ>& q_hist,
 			  const T_Result& epsilon = T_Result(0.00001) )
   {
+    // histograms over the same bins do not need any cell lookups
+    if( have_aligned_dense_bins( p_hist, q_hist ) ) {
+      return dense_kl_divergence( p_hist, q_hist, epsilon );
+    }
+    
     // first, compute "pre" normalized histograms without doing any
     // smoothing of zero values
     histogram_t<T_Result> p_prenorm = normalize_histogram( p_hist );
@@ -263,7 +584,7 @@ namespace point_process_core {
   {
     // turn the counts by cell to double values
     std::vector<double> y_data;
-    for( auto cell : hist.all_cells_ordered() ) {
+    for( const marked_grid_cell_t& cell : hist.cells() ) {
       double count = 0;
       if( hist( cell ) ) {
 	count = *hist(cell);
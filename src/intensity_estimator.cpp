@@ -0,0 +1,156 @@
+
+#include "intensity_estimator.hpp"
+#include <algorithm>
+
+
+namespace point_process_core {
+
+
+  //======================================================================
+
+  incremental_intensity_estimator_t::incremental_intensity_estimator_t
+  ( const boost::shared_ptr<mcmc_point_process_t>& process,
+    const math_core::nd_aabox_t& window,
+    const size_t bins_per_dimension,
+    const size_t num_samples_for_estimate,
+    const size_t num_mcmc_iterations_between_samples,
+    const size_t num_burn_in_iterations,
+    const boost::optional<marked_grid_storage_t>& storage )
+    : _process( process ),
+      _num_mcmc_iterations_between_samples( num_mcmc_iterations_between_samples ),
+      _num_burn_in_iterations( num_burn_in_iterations ),
+      _capacity( num_samples_for_estimate ),
+      _burn_in_pending( false ),
+      _num_stale( 0 ),
+      _counts( storage
+	       ? histogram_t<double>( window, bins_per_dimension, *storage )
+	       : histogram_t<double>( window, bins_per_dimension ) )
+  {}
+
+  //======================================================================
+
+  void incremental_intensity_estimator_t::invalidate( const size_t num_stale )
+  {
+    _num_stale = std::min( _samples.size(), _num_stale + num_stale );
+  }
+
+  //======================================================================
+
+  void incremental_intensity_estimator_t::invalidate_fraction( const double fraction )
+  {
+    invalidate( (size_t)ceil( std::max( 0.0, fraction ) * _samples.size() ) );
+  }
+
+  //======================================================================
+
+  void incremental_intensity_estimator_t::add_observations
+  ( const std::vector<math_core::nd_point_t>& obs,
+    const double stale_fraction )
+  {
+    _process->add_observations( obs );
+    invalidate_fraction( stale_fraction );
+    burn_in_on_next_update();
+  }
+
+  //======================================================================
+
+  void incremental_intensity_estimator_t::add_negative_observation
+  ( const math_core::nd_aabox_t& region,
+    const double stale_fraction )
+  {
+    _process->add_negative_observation( region );
+    invalidate_fraction( stale_fraction );
+    burn_in_on_next_update();
+  }
+
+  //======================================================================
+
+  void incremental_intensity_estimator_t::_evict_oldest()
+  {
+    for( const marked_grid_cell_t& cell : _samples.front() ) {
+      _counts.decrement_bin( cell );
+
+      // keep bins with no points unmarked, like a fresh estimate
+      if( *_counts( cell ) == 0 ) {
+	_counts.clear_mark( cell );
+      }
+    }
+    _samples.pop_front();
+    if( _num_stale > 0 ) {
+      --_num_stale;
+    }
+  }
+
+  //======================================================================
+
+  size_t incremental_intensity_estimator_t::update()
+  {
+    // replace the stale samples and fill any room left
+    size_t num_fresh = _num_stale + ( _capacity - std::min( _capacity, _samples.size() ) );
+    if( num_fresh == 0 ) {
+      return 0;
+    }
+
+    // let the chain move to the posterior of the changed process
+    // before drawing the replacement samples
+    if( _burn_in_pending ) {
+      _process->mcmc( _num_burn_in_iterations );
+      _burn_in_pending = false;
+    }
+
+    point_set_batch_t batch;
+    _process->sample_batch( num_fresh,
+			    batch,
+			    _num_mcmc_iterations_between_samples );
+    for( size_t i = 0; i < batch.size(); ++i ) {
+      std::vector<marked_grid_cell_t> cells;
+      cells.reserve( batch.offsets[i+1] - batch.offsets[i] );
+      for( size_t p = batch.offsets[i]; p < batch.offsets[i+1]; ++p ) {
+	cells.push_back( _counts.cell( batch.point( p ) ) );
+	_counts.increment_bin( cells.back() );
+      }
+      _samples.push_back( cells );
+    }
+
+    // the window slides over the oldest (stale first) samples
+    while( _samples.size() > _capacity ) {
+      _evict_oldest();
+    }
+    _num_stale = 0;
+
+    return num_fresh;
+  }
+
+  //======================================================================
+
+  histogram_t<double> incremental_intensity_estimator_t::intensity_estimate()
+  {
+    update();
+    histogram_t<double> hist = _counts;
+    if( _samples.empty() == false ) {
+      hist.scale( 1.0 / (double)_samples.size() );
+    }
+    return hist;
+  }
+
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+
+
+}
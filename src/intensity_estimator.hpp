@@ -0,0 +1,130 @@
+
+#if !defined( __POINT_PROCESS_CORE_INTENSITY_ESTIMATOR_HPP__ )
+#define __POINT_PROCESS_CORE_INTENSITY_ESTIMATOR_HPP__
+
+#include "point_process.hpp"
+#include <deque>
+
+
+namespace point_process_core {
+
+
+  // Description:
+  // A persistent intensity estimate for a point process.
+  // Keeps a sliding window of the most recent samples from the
+  // process together with their histogram counts. When the process
+  // changes (say, with a new observation) some of the samples are
+  // marked stale, and the next update only draws enough fresh samples
+  // to replace them, evicting the oldest ones, rather than
+  // resampling the whole estimate.
+  // After observations are added through the estimator the next
+  // update first runs a number of burn-in mcmc iterations, so the
+  // replacement samples come from the new posterior rather than
+  // from where the chain was before the observations.
+  class incremental_intensity_estimator_t
+  {
+  public:
+
+    // Description:
+    // Creates an estimator for the process within the given window,
+    // gridded with the given number of bins, which keeps
+    // num_samples_for_estimate samples with the given number of
+    // mcmc iterations between samples, and runs the given number of
+    // burn-in iterations before resampling after new observations.
+    // The counts use the given storage, or the histogram_t default
+    // if none is given.
+    // No samples are drawn until the first update.
+    incremental_intensity_estimator_t
+    ( const boost::shared_ptr<mcmc_point_process_t>& process,
+      const math_core::nd_aabox_t& window,
+      const size_t bins_per_dimension,
+      const size_t num_samples_for_estimate = 1000,
+      const size_t num_mcmc_iterations_between_samples = 1,
+      const size_t num_burn_in_iterations = 100,
+      const boost::optional<marked_grid_storage_t>& storage = boost::none );
+
+    // Description:
+    // Marks the oldest num_stale samples as stale.
+    // This does not burn in the process: callers who change the
+    // process themselves should call burn_in_on_next_update() too.
+    void invalidate( const size_t num_stale );
+
+    // Description:
+    // Runs the burn-in iterations before drawing samples in the
+    // next update
+    void burn_in_on_next_update() { _burn_in_pending = true; }
+
+    // Description:
+    // Marks the given fraction of the samples as stale
+    void invalidate_fraction( const double fraction );
+
+    // Description:
+    // Adds observations to the process and marks the given fraction
+    // of the samples as stale
+    void add_observations( const std::vector<math_core::nd_point_t>& obs,
+			   const double stale_fraction );
+
+    // Description:
+    // Adds a negative observation region to the process and marks
+    // the given fraction of the samples as stale
+    void add_negative_observation( const math_core::nd_aabox_t& region,
+				   const double stale_fraction );
+
+    // Description:
+    // Draws fresh samples to replace the stale ones and to fill
+    // the window, after any pending burn-in.
+    // Returns the number of samples drawn
+    size_t update();
+
+    // Description:
+    // Updates and returns the intensity estimate (the average
+    // number of points per bin over the samples in the window)
+    histogram_t<double> intensity_estimate();
+
+    // Description:
+    // The histogram of the point counts of the samples in the window
+    const histogram_t<double>& counts() const { return _counts; }
+
+    // Description:
+    // The number of samples in the window and how many are stale
+    size_t num_samples() const { return _samples.size(); }
+    size_t num_stale() const { return _num_stale; }
+
+    // Description:
+    // The process being estimated
+    boost::shared_ptr<mcmc_point_process_t> process() const { return _process; }
+
+  protected:
+
+    // Description:
+    // The process, its sampling parameters and the window size
+    boost::shared_ptr<mcmc_point_process_t> _process;
+    size_t _num_mcmc_iterations_between_samples;
+    size_t _num_burn_in_iterations;
+    size_t _capacity;
+
+    // Description:
+    // Set when the process has changed since the last burn-in
+    bool _burn_in_pending;
+
+    // Description:
+    // The cells of the points of each sample, oldest first
+    std::deque<std::vector<marked_grid_cell_t> > _samples;
+
+    // Description:
+    // The number of the oldest samples which are stale
+    size_t _num_stale;
+
+    // Description:
+    // The counts of all the samples in the window
+    histogram_t<double> _counts;
+
+    // Description:
+    // Removes the oldest sample and its counts
+    void _evict_oldest();
+  };
+
+}
+
+#endif
+
@@ -30,31 +30,6 @@ namespace point_process_core {
   }
 
 
-  // Description:
-  // The hash function for cells
-  size_t hash_value( const marked_grid_cell_t& cell ) {
-    // std::cout << "hash(" << cell.n << ", ";
-    // for( size_t i = 0; i < cell.n; ++i ) {
-    //   std::cout << cell.coordinate[i] << " ";
-    // }
-    // std::cout << ")" << std::endl;
-    boost::hash<std::vector<long> > hasher;
-    return hasher( cell.coordinate );
-  }
-
-  // Description:
-  // Eqaulity for cells
-  bool operator== (const marked_grid_cell_t& a,
-		   const marked_grid_cell_t& b )
-  {
-    return a.coordinate == b.coordinate;
-  }
-  bool operator!= (const marked_grid_cell_t& a,
-		   const marked_grid_cell_t& b )
-  {
-    return !(a == b);
-  }
-
   // Description:
   // Less than for cells
   bool operator< (const marked_grid_cell_t& a,
@@ -86,28 +61,25 @@ namespace point_process_core {
 
     // get hte max element
     double max_value = -std::numeric_limits<double>::infinity();
-    std::vector<marked_grid_cell_t> cells = grid.all_cells();
-    for( marked_grid_cell_t cell : cells ) {
-      if( grid(cell) &&
-	  max_value < *grid(cell) ) {
-	max_value = *grid(cell);
-      }
-      if( grid( cell ) ) {
-	//std::cout << "  grid val: " << *grid( cell ) << std::endl;
+    for( const marked_grid_cell_t& cell : grid.cells() ) {
+      boost::optional<double> mark = grid( cell );
+      if( mark &&
+	  max_value < *mark ) {
+	max_value = *mark;
       }
     }
     std::cout << "saving BMP: (" << width << "x" << height << ") max_value = " << max_value << std::endl;
 
     
     // ok, now go thorugh every cell and push it's mark onto hte image
-    cells = grid.all_cells();
-    for( marked_grid_cell_t cell : cells ) {
+    for( const marked_grid_cell_t& cell : grid.cells() ) {
       assert( cell.n == 2 );
       assert( cell.coordinate.size() == cell.n );
       long x = cell.coordinate[0];
       long y = cell.coordinate[1];
-      if( grid( cell ) ) {
-	int v = 55.0 + 200.0 * ( (*grid(cell)) / max_value );
+      boost::optional<double> mark = grid( cell );
+      if( mark ) {
+	int v = 55.0 + 200.0 * ( (*mark) / max_value );
 	image( x, y, 0, 0 ) = v;
 	image( x, y, 0, 1 ) = v;
 	image( x, y, 0, 2 ) = v;
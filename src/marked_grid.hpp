@@ -3,8 +3,13 @@
 #define __POINT_PROCESS_CORE_MARKED_GRID_HPP__
 
 #include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
 #include <map>
+#include <algorithm>
+#include <iterator>
+#include <cassert>
 #include <boost/optional.hpp>
+#include <boost/cstdint.hpp>
 #include <math-core/types.hpp>
 #include <iostream>
 #include <math-core/geom.hpp>
@@ -14,18 +19,358 @@ namespace point_process_core {
 
   using namespace math_core;
 
+  // Description:
+  // The integer coordinate of a marked grid cell.
+  // Behaves like (and converts to) a std::vector<long> but stores up to
+  // max_inline_dimensions coordinates inline, so creating and copying
+  // cells of low dimension never touches the allocator.
+  // Higher dimensional coordinates spill over into a heap vector.
+  class marked_grid_cell_coordinate_t
+  {
+  public:
+
+    typedef long value_type;
+    typedef long* iterator;
+    typedef const long* const_iterator;
+
+    // Description:
+    // The number of dimensions stored without any allocation
+    static const size_t max_inline_dimensions = 4;
+
+    marked_grid_cell_coordinate_t()
+      : _size( 0 )
+    {}
+
+    explicit
+    marked_grid_cell_coordinate_t( const size_t n, const long value = 0 )
+      : _size( 0 )
+    {
+      resize( n, value );
+    }
+
+    marked_grid_cell_coordinate_t( const std::vector<long>& coords )
+      : _size( 0 )
+    {
+      resize( coords.size() );
+      std::copy( coords.begin(), coords.end(), begin() );
+    }
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    long* data() 
+    { return _size <= max_inline_dimensions ? _inline : &_heap[0]; }
+    const long* data() const
+    { return _size <= max_inline_dimensions ? _inline : &_heap[0]; }
+
+    iterator begin() { return data(); }
+    iterator end() { return data() + _size; }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + _size; }
+
+    long& operator[] ( const size_t i ) { return data()[i]; }
+    const long& operator[] ( const size_t i ) const { return data()[i]; }
+
+    // Description:
+    // Resize the coordinate, new entries are set to the given value
+    void resize( const size_t n, const long value = 0 )
+    {
+      if( n <= max_inline_dimensions ) {
+	if( _size > max_inline_dimensions ) {
+	  std::copy( _heap.begin(), _heap.begin() + n, _inline );
+	  std::vector<long>().swap( _heap );
+	} else {
+	  for( size_t i = _size; i < n; ++i ) {
+	    _inline[i] = value;
+	  }
+	}
+      } else {
+	if( _size <= max_inline_dimensions ) {
+	  _heap.assign( _inline, _inline + _size );
+	}
+	_heap.resize( n, value );
+      }
+      _size = n;
+    }
+
+    void push_back( const long value )
+    {
+      resize( _size + 1, value );
+    }
+
+    // Description:
+    // Copies the coordinate into a std::vector<long> (the type
+    // marked_grid_cell_t::coordinate used to be), explicitly or
+    // implicitly
+    std::vector<long> to_vector() const
+    {
+      return std::vector<long>( begin(), end() );
+    }
+    operator std::vector<long> () const
+    {
+      return to_vector();
+    }
+
+    bool operator== ( const marked_grid_cell_coordinate_t& b ) const
+    {
+      return _size == b._size && std::equal( begin(), end(), b.begin() );
+    }
+    bool operator!= ( const marked_grid_cell_coordinate_t& b ) const
+    {
+      return !( *this == b );
+    }
+    bool operator< ( const marked_grid_cell_coordinate_t& b ) const
+    {
+      return std::lexicographical_compare( begin(), end(),
+					   b.begin(), b.end() );
+    }
+
+  protected:
+    size_t _size;
+    long _inline[ max_inline_dimensions ];
+    std::vector<long> _heap;
+  };
+
   // Description:
   // A cell for a marked grid
   struct marked_grid_cell_t
   {
     size_t n;
-    std::vector<long> coordinate;
+    marked_grid_cell_coordinate_t coordinate;
     marked_grid_cell_t() 
       : n(0),
 	coordinate()
     {}
   };
 
+
+  // Description:
+  // An inclusive box of cells [min_cell, max_cell] which can be
+  // iterated over without materializing the cells.
+  // Iteration is odometer style with the last dimension moving
+  // fastest, and the only state is the current cell.
+  class marked_grid_cell_range_t
+  {
+  public:
+
+    // Description:
+    // Forward iterator over the cells of a range.
+    // Iterators refer to their range, so the range must outlive them.
+    class const_iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef marked_grid_cell_t value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const marked_grid_cell_t* pointer;
+      typedef const marked_grid_cell_t& reference;
+
+      const_iterator()
+	: _range( NULL ),
+	  _done( true )
+      {}
+
+      const_iterator( const marked_grid_cell_range_t* range,
+		      const bool done )
+	: _range( range ),
+	  _done( done || range->empty() )
+      {
+	if( !_done ) {
+	  _cell = range->min_cell();
+	}
+      }
+      
+      reference operator* () const { return _cell; }
+      pointer operator-> () const { return &_cell; }
+
+      const_iterator& operator++ ()
+      {
+	const marked_grid_cell_t& min = _range->min_cell();
+	const marked_grid_cell_t& max = _range->max_cell();
+	for( long i = (long)_cell.n - 1; i >= 0; --i ) {
+	  if( _cell.coordinate[i] < max.coordinate[i] ) {
+	    _cell.coordinate[i] += 1;
+	    return *this;
+	  }
+	  _cell.coordinate[i] = min.coordinate[i];
+	}
+	_done = true;
+	return *this;
+      }
+
+      const_iterator operator++ (int)
+      {
+	const_iterator prev = *this;
+	++(*this);
+	return prev;
+      }
+
+      bool operator== ( const const_iterator& b ) const
+      {
+	if( _done || b._done ) {
+	  return _done == b._done;
+	}
+	return _cell.coordinate == b._cell.coordinate;
+      }
+      bool operator!= ( const const_iterator& b ) const
+      {
+	return !( *this == b );
+      }
+
+    protected:
+      const marked_grid_cell_range_t* _range;
+      marked_grid_cell_t _cell;
+      bool _done;
+    };
+    typedef const_iterator iterator;
+
+    // Description:
+    // Creates an empty range
+    marked_grid_cell_range_t()
+    {}
+
+    // Description:
+    // Creates the range of cells between min and max (inclusive)
+    marked_grid_cell_range_t( const marked_grid_cell_t& min,
+			      const marked_grid_cell_t& max )
+      : _min( min ),
+	_max( max )
+    {
+      assert( min.n == max.n );
+    }
+
+    const_iterator begin() const { return const_iterator( this, false ); }
+    const_iterator end() const { return const_iterator( this, true ); }
+
+    const marked_grid_cell_t& min_cell() const { return _min; }
+    const marked_grid_cell_t& max_cell() const { return _max; }
+
+    // Description:
+    // Returns true if there are no cells in this range
+    bool empty() const
+    {
+      if( _min.n == 0 ) {
+	return true;
+      }
+      for( size_t i = 0; i < _min.n; ++i ) {
+	if( _max.coordinate[i] < _min.coordinate[i] ) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    // Description:
+    // Returns the number of cells in this range
+    size_t size() const
+    {
+      if( empty() ) {
+	return 0;
+      }
+      size_t count = 1;
+      for( size_t i = 0; i < _min.n; ++i ) {
+	count *= ( _max.coordinate[i] - _min.coordinate[i] + 1 );
+      }
+      return count;
+    }
+
+    // Description:
+    // Returns true if the cell lies inside this range
+    bool contains( const marked_grid_cell_t& cell ) const
+    {
+      if( cell.n != _min.n || empty() ) {
+	return false;
+      }
+      for( size_t i = 0; i < cell.n; ++i ) {
+	if( cell.coordinate[i] < _min.coordinate[i] ||
+	    cell.coordinate[i] > _max.coordinate[i] ) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+  protected:
+    marked_grid_cell_t _min;
+    marked_grid_cell_t _max;
+  };
+
+
+  // Description:
+  // Packs a cell into a single 64 bit key.
+  // Cells of up to 4 dimensions are packed with 64/n bits per
+  // coordinate. Returns false if the cell has too many dimensions or a
+  // coordinate does not fit into its share of the key.
+  inline
+  bool pack_cell_key( const marked_grid_cell_t& cell,
+		      boost::uint64_t& key )
+  {
+    if( cell.n == 0 ||
+	cell.n > marked_grid_cell_coordinate_t::max_inline_dimensions ) {
+      return false;
+    }
+    const size_t bits = 64 / cell.n;
+    if( bits == 64 ) {
+      key = (boost::uint64_t)cell.coordinate[0];
+      return true;
+    }
+    const long limit = 1L << ( bits - 1 );
+    const boost::uint64_t mask = ( boost::uint64_t(1) << bits ) - 1;
+    key = 0;
+    for( size_t i = 0; i < cell.n; ++i ) {
+      long c = cell.coordinate[i];
+      if( c < -limit || c >= limit ) {
+	return false;
+      }
+      key = ( key << bits ) | ( (boost::uint64_t)c & mask );
+    }
+    return true;
+  }
+
+  // Description:
+  // Mixes the bits of a 64 bit key (the splitmix64 finalizer)
+  inline
+  boost::uint64_t mix_key( boost::uint64_t key )
+  {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+  }
+
+
+  // Description:
+  // The storage used for the marks of a marked grid.
+  // Sparse grids keep a hash map from cell to mark.
+  // Dense grids keep a flat array of marks (and a presence flag)
+  // for every cell of the window and only use the hash map for
+  // cells outside of the window.
+  // Tiled grids keep a hash map from tiles of neighbouring cells to
+  // small dense blocks, so clustered marks share cache lines and
+  // empty space costs nothing.
+  enum marked_grid_storage_t {
+    MARKED_GRID_SPARSE_STORAGE,
+    MARKED_GRID_DENSE_STORAGE,
+    MARKED_GRID_TILED_STORAGE
+  };
+
+  // Description:
+  // The number of cells along each dimension of a tile for tiled
+  // storage, keeping tiles at a few hundred cells
+  // (8x8, 8x8x8, 4x4x4x4, ...)
+  inline
+  size_t marked_grid_tile_edge( const size_t dimension )
+  {
+    if( dimension <= 3 ) {
+      return 8;
+    }
+    if( dimension <= 5 ) {
+      return 4;
+    }
+    return 2;
+  }
   
   
   // Description:
@@ -42,16 +387,21 @@ namespace point_process_core {
     // Description:
     // Default constructor which creates an empty invalid grid
     marked_grid_t()
+      : _storage( MARKED_GRID_SPARSE_STORAGE ),
+	_tile_edge( 0 ),
+	_tile_cells( 0 )
     {}
 
     // Description:
     // Creates a new marked grid with given resolution and
     // with given window
     marked_grid_t( const math_core::nd_aabox_t& window,
-		   const double resolution )
+		   const double resolution,
+		   const marked_grid_storage_t storage = MARKED_GRID_SPARSE_STORAGE )
     {
       _init( window, window.start,
-	     std::vector<double>( window.start.n, resolution ) );
+	     std::vector<double>( window.start.n, resolution ),
+	     storage );
     }
     
     // Description:
@@ -59,11 +409,13 @@ namespace point_process_core {
     // Where the origin cell is at the given point
     marked_grid_t( const math_core::nd_aabox_t& window,
 		   const math_core::nd_point_t& origin,
-		   const double resolution )
+		   const double resolution,
+		   const marked_grid_storage_t storage = MARKED_GRID_SPARSE_STORAGE )
     {
       _init( window,
 	     origin,
-	     std::vector<double>( origin.n, resolution ) );
+	     std::vector<double>( origin.n, resolution ),
+	     storage );
     }
     
 
@@ -73,13 +425,14 @@ namespace point_process_core {
     // are variable between doimensions
     marked_grid_t( const math_core::nd_aabox_t& window,
 		   const math_core::nd_point_t& origin,
-		   const std::vector<double>& resolutions )
+		   const std::vector<double>& resolutions,
+		   const marked_grid_storage_t storage = MARKED_GRID_SPARSE_STORAGE )
       : _bounds( window ),
 	_origin( origin ),
 	_cell_sizes( resolutions ),
 	_map()
     {
-      _init( window, origin, resolutions );
+      _init( window, origin, resolutions, storage );
     }
 
     // Description:
@@ -97,7 +450,8 @@ namespace point_process_core {
     {
       return marked_grid_t<T_New_Mark>( _bounds,
 					_origin,
-					_cell_sizes );
+					_cell_sizes,
+					_storage );
     }
 
 
@@ -105,6 +459,21 @@ namespace point_process_core {
     // Access a given grid cell
     boost::optional<T_Mark> operator() ( const marked_grid_cell_t& cell ) const
     {
+      size_t index;
+      if( _dense_index( cell, index ) ) {
+	if( _dense_present[ index ] ) {
+	  return boost::optional<T_Mark>( _dense_marks[ index ] );
+	}
+	return boost::optional<T_Mark>();
+      }
+      if( _storage == MARKED_GRID_TILED_STORAGE ) {
+	size_t slot;
+	if( _tile_slot( cell, slot ) && _tile_present[ slot ] ) {
+	  return boost::optional<T_Mark>( _tile_marks[ slot ] );
+	}
+	return boost::optional<T_Mark>();
+      }
+
       typename map_t::const_iterator fiter
 	= _map.find( cell );
       
@@ -141,10 +510,29 @@ namespace point_process_core {
     // }
 
     // Description:
-    // Set a particular mark
+    // Set a particular mark.
+    // The writers of marks are virtual so that derived grids which
+    // keep state about their marks (histogram_t's total) see every
+    // write, even through a marked_grid_t reference.
+    virtual
     void set( const marked_grid_cell_t& cell,
 	      const T_Mark& mark )
     {
+      size_t index;
+      if( _dense_index( cell, index ) ) {
+	_dense_marks[ index ] = mark;
+	_dense_present[ index ] = 1;
+	return;
+      }
+      if( _storage == MARKED_GRID_TILED_STORAGE ) {
+	size_t slot = _tile_slot_for_write( cell );
+	if( !_tile_present[ slot ] ) {
+	  _tile_present[ slot ] = 1;
+	  ++_tile_counts[ slot / _tile_cells ];
+	}
+	_tile_marks[ slot ] = mark;
+	return;
+      }
       _map[ cell ] = mark;
     }
     void set( const math_core::nd_point_t& point,
@@ -155,8 +543,24 @@ namespace point_process_core {
 
     // Description:
     // Remove a mark
+    virtual
     void clear_mark( const marked_grid_cell_t& cell ) 
     {
+      size_t index;
+      if( _dense_index( cell, index ) ) {
+	_dense_present[ index ] = 0;
+	_dense_marks[ index ] = T_Mark();
+	return;
+      }
+      if( _storage == MARKED_GRID_TILED_STORAGE ) {
+	size_t slot;
+	if( _tile_slot( cell, slot ) && _tile_present[ slot ] ) {
+	  _tile_present[ slot ] = 0;
+	  _tile_marks[ slot ] = T_Mark();
+	  --_tile_counts[ slot / _tile_cells ];
+	}
+	return;
+      }
       _map.erase( cell );
     }
     void clear_mark( const math_core::nd_point_t& point )
@@ -165,21 +569,23 @@ namespace point_process_core {
     }
     
 
+    // Description:
+    // Returns the range of all possible cells in this grid.
+    // The cells are generated lazily while iterating, in the
+    // same canonical ordering as all_cells()
+    marked_grid_cell_range_t cells() const
+    {
+      return marked_grid_cell_range_t( this->cell( _bounds.start ),
+				       this->cell( _bounds.end ) );
+    }
+
     // Description:
     // Returns a vector with all possible cells in this grid
-    // Note: Be Carefull, this could be HUGE!
+    // Note: Be Carefull, this could be HUGE! Prefer iterating cells()
     std::vector<marked_grid_cell_t> all_cells() const
     {
-      std::vector<marked_grid_cell_t> cells;
-      marked_grid_cell_t min_cell = this->cell( _bounds.start );
-      marked_grid_cell_t max_cell = this->cell( _bounds.end );
-      marked_grid_cell_t c = min_cell;
-      while( is_cell_in_lower_iteration( c, max_cell ) ) {
-	cells.push_back( c );
-	c = cell_next_higher_iteration( c, min_cell, max_cell );
-      }
-      cells.push_back( max_cell );
-      return cells;
+      marked_grid_cell_range_t range = cells();
+      return std::vector<marked_grid_cell_t>( range.begin(), range.end() );
     }
 
     // Description:
@@ -195,6 +601,18 @@ namespace point_process_core {
     std::vector<marked_grid_cell_t> all_marked_cells() const
     {
       std::vector<marked_grid_cell_t> cells;
+      for( size_t index = 0; index < _dense_present.size(); ++index ) {
+	if( _dense_present[ index ] ) {
+	  cells.push_back( _dense_cell( index ) );
+	}
+      }
+      for( size_t slot = 0; slot < _tile_present.size(); ++slot ) {
+	if( _tile_counts[ slot / _tile_cells ] == 0 ) {
+	  slot += _tile_cells - 1;
+	} else if( _tile_present[ slot ] ) {
+	  cells.push_back( _tile_cell( slot ) );
+	}
+      }
       typename map_t::const_iterator iter;
       for( iter = _map.begin(); iter != _map.end(); ++iter ) {
 	cells.push_back( iter->first );
@@ -202,11 +620,78 @@ namespace point_process_core {
       return cells;
     }
 
+    // Description:
+    // Calls f( cell, mark ) for every marked cell, walking the
+    // storage directly
+    template<class F>
+    void for_each_mark( F f ) const
+    {
+      for( size_t index = 0; index < _dense_present.size(); ++index ) {
+	if( _dense_present[ index ] ) {
+	  f( _dense_cell( index ), _dense_marks[ index ] );
+	}
+      }
+      for( size_t slot = 0; slot < _tile_present.size(); ++slot ) {
+	if( _tile_counts[ slot / _tile_cells ] == 0 ) {
+	  slot += _tile_cells - 1;
+	} else if( _tile_present[ slot ] ) {
+	  f( _tile_cell( slot ), _tile_marks[ slot ] );
+	}
+      }
+      typename map_t::const_iterator iter;
+      for( iter = _map.begin(); iter != _map.end(); ++iter ) {
+	f( iter->first, iter->second );
+      }
+    }
+
+    // Description:
+    // Calls f( mark ) with a reference to every stored mark so the
+    // marks can be changed in place (then calls _marks_changed())
+    template<class F>
+    void transform_marks( F f )
+    {
+      for( size_t index = 0; index < _dense_present.size(); ++index ) {
+	if( _dense_present[ index ] ) {
+	  f( _dense_marks[ index ] );
+	}
+      }
+      for( size_t slot = 0; slot < _tile_present.size(); ++slot ) {
+	if( _tile_present[ slot ] ) {
+	  f( _tile_marks[ slot ] );
+	}
+      }
+      typename map_t::iterator iter;
+      for( iter = _map.begin(); iter != _map.end(); ++iter ) {
+	f( iter->second );
+      }
+      _marks_changed();
+    }
+
+    // Description:
+    // Returns the number of marked cells
+    size_t num_marked_cells() const
+    {
+      size_t count = _map.size();
+      for( size_t index = 0; index < _dense_present.size(); ++index ) {
+	if( _dense_present[ index ] ) {
+	  ++count;
+	}
+      }
+      for( size_t tile = 0; tile < _tile_counts.size(); ++tile ) {
+	count += _tile_counts[ tile ];
+      }
+      return count;
+    }
+
     // Description:
     // Clear all marks from this grid
+    virtual
     void clear()
     {
       _map.clear();
+      std::fill( _dense_marks.begin(), _dense_marks.end(), T_Mark() );
+      std::fill( _dense_present.begin(), _dense_present.end(), 0 );
+      _clear_tiles();
     }
 
     // Description:
@@ -239,12 +724,20 @@ namespace point_process_core {
     marked_grid_cell_t cell( const math_core::nd_point_t& point ) const
     {
       assert( _origin.n == point.n );
+      return this->cell( point.coordinate.data() );
+    }
+
+    // Description:
+    // Returns the cell for a point given as a raw array of coordinates
+    // (one per dimension of this grid)
+    marked_grid_cell_t cell( const double* coordinate ) const
+    {
       marked_grid_cell_t c;
       c.n = _origin.n;
       c.coordinate.resize( c.n );
       
       for( size_t i = 0; i < c.n; ++i ) {
-	double x = point.coordinate[i];
+	double x = coordinate[i];
 	c.coordinate[i] = floor( (x - _origin.coordinate[i]) / _cell_sizes[i] );
       }
       return c;
@@ -262,8 +755,23 @@ namespace point_process_core {
 	     _bounds.end.coordinate == b._bounds.end.coordinate ) )
 	return false;
       
+      // grids with the same flat layout can compare storage directly
+      // (tiles may have been created in a different order)
+      if( _storage == b._storage &&
+	  _storage != MARKED_GRID_TILED_STORAGE ) {
+	return ( _dense_present == b._dense_present &&
+		 _dense_marks == b._dense_marks &&
+		 _map == b._map );
+      }
 
-      return _map == b._map;
+      // otherwise compare the marks cell by cell
+      if( num_marked_cells() != b.num_marked_cells() )
+	return false;
+      for( auto cell : all_marked_cells() ) {
+	if( b( cell ) != this->operator()( cell ) )
+	  return false;
+      }
+      return true;
     }
 
 
@@ -274,12 +782,115 @@ namespace point_process_core {
       return _cell_sizes;
     }
 
+    // Description:
+    // Returns the origin of the grid cells
+    math_core::nd_point_t origin() const
+    {
+      return _origin;
+    }
+
     // Description:
     // Returns the bounds for this grid
     nd_aabox_t window() const
     {
       return _bounds;
     }
+
+    // Description:
+    // Returns the storage used for the marks
+    marked_grid_storage_t storage() const
+    {
+      return _storage;
+    }
+
+    // Description:
+    // The dense layout of the grid: the number of cells in the flat
+    // arrays (0 unless the grid is dense), the box of cells they cover,
+    // the flat index of a cell (false if the cell is not in the
+    // flat arrays) and the cell of a flat index.
+    size_t dense_size() const
+    {
+      return _dense_present.size();
+    }
+    marked_grid_cell_range_t dense_cells() const
+    {
+      if( _dense_present.empty() ) {
+	return marked_grid_cell_range_t();
+      }
+      marked_grid_cell_t max_cell = _dense_min_cell;
+      for( size_t i = 0; i < max_cell.n; ++i ) {
+	max_cell.coordinate[i] += _dense_extents[i] - 1;
+      }
+      return marked_grid_cell_range_t( _dense_min_cell, max_cell );
+    }
+    bool dense_index( const marked_grid_cell_t& cell, size_t& index ) const
+    {
+      return _dense_index( cell, index );
+    }
+    marked_grid_cell_t dense_cell( const size_t index ) const
+    {
+      return _dense_cell( index );
+    }
+
+    // Description:
+    // Direct access to the flat arrays of marks and presence flags
+    // (dense_size() entries each) of a dense grid.
+    // dense_marks() is not available for bool marks (which are kept
+    // in a std::vector<bool>), use dense_mark() for those.
+    const T_Mark* dense_marks() const
+    {
+      return _dense_marks.data();
+    }
+    T_Mark dense_mark( const size_t index ) const
+    {
+      return _dense_marks[ index ];
+    }
+    const unsigned char* dense_presence() const
+    {
+      return _dense_present.data();
+    }
+
+    // Description:
+    // Sets the marks of the dense cells with flat indices
+    // [first, first + marks.size()).
+    // Distinct ranges may be set from different threads at once
+    // (except for bool marks, which are packed into bits)
+    virtual
+    void set_dense( const size_t first,
+		    const std::vector<T_Mark>& marks )
+    {
+      assert( first + marks.size() <= _dense_present.size() );
+      std::copy( marks.begin(), marks.end(), _dense_marks.begin() + first );
+      std::fill( _dense_present.begin() + first,
+		 _dense_present.begin() + first + marks.size(),
+		 1 );
+    }
+
+    // Description:
+    // The number of marks kept in the hash map (all marks of a
+    // sparse grid, and those outside of the window for a dense grid)
+    // and the hash map itself
+    size_t sparse_size() const
+    {
+      return _map.size();
+    }
+    const map_t& sparse_marks() const
+    {
+      return _map;
+    }
+
+    // Description:
+    // The tiling of a tiled grid: the number of cells along each
+    // dimension of a tile and the number of tiles holding marks
+    // (or having held marks since the last clear)
+    size_t tile_edge() const
+    {
+      return _tile_edge;
+    }
+    size_t num_tiles() const
+    {
+      return _tile_counts.size();
+    }
     
   protected:
 
@@ -298,18 +909,75 @@ namespace point_process_core {
     
     // Description:
     // The mapping between cells and marks
+    // (for dense grids, only the cells outside of the window)
     map_t _map;
 
+    // Description:
+    // The storage used for the marks
+    marked_grid_storage_t _storage;
+
+    // Description:
+    // The dense layout: the lowest cell of the window, the number of
+    // cells along each dimension and the stride of each dimension
+    // in the flat arrays. The last dimension is contiguous so that
+    // flat indices follow the all_cells() ordering.
+    marked_grid_cell_t _dense_min_cell;
+    std::vector<size_t> _dense_extents;
+    std::vector<size_t> _dense_strides;
+
+    // Description:
+    // The dense marks and presence flags for the cells of the window.
+    // Presence is kept as bytes (not std::vector<bool>) so that
+    // distinct cells can be written independently.
+    std::vector<T_Mark> _dense_marks;
+    std::vector<unsigned char> _dense_present;
+
+    // Description:
+    // The tiled layout: the number of cells along each dimension of a
+    // tile and in a tile, the block index of every tile with a block,
+    // and the tile of every block. The blocks are pooled in flat
+    // arrays of marks and presence flags (_tile_cells per block,
+    // the last dimension contiguous) with a count of marks per block.
+    size_t _tile_edge;
+    size_t _tile_cells;
+    boost::unordered_map<marked_grid_cell_t, size_t> _tiles;
+    std::vector<marked_grid_cell_t> _tile_keys;
+    std::vector<T_Mark> _tile_marks;
+    std::vector<unsigned char> _tile_present;
+    std::vector<size_t> _tile_counts;
+
+    // Description:
+    // Called after the marks were changed in bulk (transform_marks)
+    virtual
+    void _marks_changed()
+    {}
+
     // Description:
     // init this objest
     void _init( const math_core::nd_aabox_t& window,
 		const math_core::nd_point_t& origin,
-		const std::vector<double>& resolutions )
+		const std::vector<double>& resolutions,
+		const marked_grid_storage_t storage = MARKED_GRID_SPARSE_STORAGE )
     {
       _bounds = window;
       _origin = origin;
       _cell_sizes = resolutions;
       _map = map_t();
+      _storage = storage;
+      _dense_min_cell = marked_grid_cell_t();
+      _dense_extents.clear();
+      _dense_strides.clear();
+      _dense_marks.clear();
+      _dense_present.clear();
+      _tile_edge = marked_grid_tile_edge( origin.n );
+      _tile_cells = 1;
+      for( long i = 0; i < origin.n; ++i ) {
+	_tile_cells *= _tile_edge;
+      }
+      _clear_tiles();
+      if( _storage == MARKED_GRID_DENSE_STORAGE ) {
+	_init_dense();
+      }
       
       // debug
       //std::cout << "    mk created!" << std::endl;
@@ -317,63 +985,172 @@ namespace point_process_core {
     }
 
     // Description:
-    // Returns whetehr the cell is is a lower iteration 
-    // that another (in terms of iterating over a window of cells)
-    bool is_cell_in_lower_iteration( const marked_grid_cell_t& a,
-				     const marked_grid_cell_t& b ) const
+    // Returns a reference to the mark of a cell with a single lookup.
+    // If the cell has no mark it is first marked with the given
+    // initial mark and created is set to true.
+    T_Mark& _mark_reference( const marked_grid_cell_t& cell,
+			     const T_Mark& initial,
+			     bool& created )
     {
-      assert( a.n == b.n );
-      for( size_t i = 0; i < a.n; ++i ) {
-	if( a.coordinate[i] < b.coordinate[i] )
-	  return true;
+      size_t index;
+      if( _dense_index( cell, index ) ) {
+	created = !_dense_present[ index ];
+	if( created ) {
+	  _dense_marks[ index ] = initial;
+	  _dense_present[ index ] = 1;
+	}
+	return _dense_marks[ index ];
       }
-      return false;
+      if( _storage == MARKED_GRID_TILED_STORAGE ) {
+	size_t slot = _tile_slot_for_write( cell );
+	created = !_tile_present[ slot ];
+	if( created ) {
+	  _tile_marks[ slot ] = initial;
+	  _tile_present[ slot ] = 1;
+	  ++_tile_counts[ slot / _tile_cells ];
+	}
+	return _tile_marks[ slot ];
+      }
+      std::pair<typename map_t::iterator, bool> res
+	= _map.insert( typename map_t::value_type( cell, initial ) );
+      created = res.second;
+      return res.first->second;
+    }
+
+    // Description:
+    // Lays out the flat arrays for the cells of the window
+    void _init_dense()
+    {
+      _dense_min_cell = this->cell( _bounds.start );
+      marked_grid_cell_t max_cell = this->cell( _bounds.end );
+      size_t n = _dense_min_cell.n;
+      _dense_extents.resize( n );
+      _dense_strides.resize( n );
+      size_t size = 1;
+      for( long i = (long)n - 1; i >= 0; --i ) {
+	long extent = max_cell.coordinate[i] - _dense_min_cell.coordinate[i] + 1;
+	_dense_extents[i] = ( extent > 0 ? (size_t)extent : 0 );
+	_dense_strides[i] = size;
+	size *= _dense_extents[i];
+      }
+      if( n == 0 ) {
+	size = 0;
+      }
+      _dense_marks.assign( size, T_Mark() );
+      _dense_present.assign( size, 0 );
     }
 
-    // Descriptiopn:
-    // Returns the next cell in the iteration 
-    // given a point in the iteration and the maximum cell
-    marked_grid_cell_t
-    cell_next_higher_iteration( const marked_grid_cell_t& c,
-				const marked_grid_cell_t& min,
-				const marked_grid_cell_t& max ) const
-    {
-      return cell_next_higher_iteration( c, min, max, c.n - 1 );
-    }
-
-    // Descriptiopn:
-    // Returns the next cell in the iteration 
-    // given a point in the iteration and the maximum cell
-    marked_grid_cell_t
-    cell_next_higher_iteration( const marked_grid_cell_t& c,
-				const marked_grid_cell_t& min,
-				const marked_grid_cell_t& max,
-				const size_t index ) const
-    {
-      assert( c.n == max.n );
-      marked_grid_cell_t next = c;
-      if( next.coordinate[index] + 1 >
-	  max.coordinate[index] ) {
-	
-	// we are done with iteration if index == 0 and we cannot add 1
-	if( index == 0 ) {
-	  return max;
+    // Description:
+    // Computes the flat index of a cell for dense storage.
+    // Returns false if the grid is not dense or the cell lies
+    // outside of the window.
+    bool _dense_index( const marked_grid_cell_t& cell,
+		       size_t& index ) const
+    {
+      if( _dense_present.empty() || cell.n != _dense_min_cell.n ) {
+	return false;
+      }
+      index = 0;
+      for( size_t i = 0; i < cell.n; ++i ) {
+	long offset = cell.coordinate[i] - _dense_min_cell.coordinate[i];
+	if( offset < 0 || (size_t)offset >= _dense_extents[i] ) {
+	  return false;
 	}
+	index += offset * _dense_strides[i];
+      }
+      return true;
+    }
 
-	// ok, we need to carry over into hte next index
-	// so we clamp down on our index variuable and 
-	// try to increase the previous index
-	next.coordinate[index] = min.coordinate[index];
-	return cell_next_higher_iteration( next,
-					   min,
-					   max,
-					   index - 1 );
-      } else {
-	next.coordinate[index] += 1;
-	return next;
+    // Description:
+    // Returns the cell for a flat dense index
+    marked_grid_cell_t _dense_cell( size_t index ) const
+    {
+      marked_grid_cell_t c = _dense_min_cell;
+      for( size_t i = 0; i < c.n; ++i ) {
+	c.coordinate[i] += index / _dense_strides[i];
+	index %= _dense_strides[i];
+      }
+      return c;
+    }
+
+    // Description:
+    // Splits a cell into its tile and the offset of the cell
+    // within the tile
+    void _tile_of( const marked_grid_cell_t& cell,
+		   marked_grid_cell_t& tile,
+		   size_t& offset ) const
+    {
+      const long edge = (long)_tile_edge;
+      tile = cell;
+      offset = 0;
+      for( size_t i = 0; i < cell.n; ++i ) {
+	long c = cell.coordinate[i];
+	long t = ( c >= 0 ? c / edge : -( ( edge - 1 - c ) / edge ) );
+	tile.coordinate[i] = t;
+	offset = offset * edge + ( c - t * edge );
+      }
+    }
+
+    // Description:
+    // Finds the slot of a cell in the tile blocks.
+    // Returns false if the cell's tile has no block
+    bool _tile_slot( const marked_grid_cell_t& cell,
+		     size_t& slot ) const
+    {
+      marked_grid_cell_t tile;
+      size_t offset;
+      _tile_of( cell, tile, offset );
+      boost::unordered_map<marked_grid_cell_t, size_t>::const_iterator fiter
+	= _tiles.find( tile );
+      if( fiter == _tiles.end() ) {
+	return false;
+      }
+      slot = fiter->second * _tile_cells + offset;
+      return true;
+    }
+
+    // Description:
+    // Finds the slot of a cell in the tile blocks, adding an empty
+    // block for the cell's tile if it has none
+    size_t _tile_slot_for_write( const marked_grid_cell_t& cell )
+    {
+      marked_grid_cell_t tile;
+      size_t offset;
+      _tile_of( cell, tile, offset );
+      std::pair<boost::unordered_map<marked_grid_cell_t, size_t>::iterator, bool> res
+	= _tiles.insert( std::make_pair( tile, _tile_keys.size() ) );
+      if( res.second ) {
+	_tile_keys.push_back( tile );
+	_tile_marks.resize( _tile_marks.size() + _tile_cells, T_Mark() );
+	_tile_present.resize( _tile_present.size() + _tile_cells, 0 );
+	_tile_counts.push_back( 0 );
+      }
+      return res.first->second * _tile_cells + offset;
+    }
+
+    // Description:
+    // Returns the cell for a slot of the tile blocks
+    marked_grid_cell_t _tile_cell( const size_t slot ) const
+    {
+      marked_grid_cell_t c = _tile_keys[ slot / _tile_cells ];
+      size_t offset = slot % _tile_cells;
+      for( long i = (long)c.n - 1; i >= 0; --i ) {
+	c.coordinate[i] = c.coordinate[i] * (long)_tile_edge + (long)( offset % _tile_edge );
+	offset /= _tile_edge;
       }
+      return c;
+    }
+
+    // Description:
+    // Drops all of the tile blocks
+    void _clear_tiles()
+    {
+      _tiles.clear();
+      _tile_keys.clear();
+      _tile_marks.clear();
+      _tile_present.clear();
+      _tile_counts.clear();
     }
-				     
 
   };
 
@@ -388,17 +1165,39 @@ namespace point_process_core {
   //====================================================================
   
   // Description:
-  // The hash function for cells
-  size_t hash_value( const marked_grid_cell_t& cell );
+  // The hash function for cells.
+  // Cells which pack into a single key are hashed with an integer mix,
+  // otherwise the coordinates are mixed in one at a time.
+  inline
+  size_t hash_value( const marked_grid_cell_t& cell ) 
+  {
+    boost::uint64_t key;
+    if( pack_cell_key( cell, key ) ) {
+      return (size_t)mix_key( key );
+    }
+    boost::uint64_t h = cell.n;
+    for( size_t i = 0; i < cell.coordinate.size(); ++i ) {
+      h = mix_key( h ^ (boost::uint64_t)cell.coordinate[i] );
+    }
+    return (size_t)h;
+  }
 
   //====================================================================
   
   // Description:
   // Eqaulity for cells
+  inline
   bool operator== (const marked_grid_cell_t& a,
-		   const marked_grid_cell_t& b );
+		   const marked_grid_cell_t& b )
+  {
+    return a.coordinate == b.coordinate;
+  }
+  inline
   bool operator!= (const marked_grid_cell_t& a,
-		   const marked_grid_cell_t& b );
+		   const marked_grid_cell_t& b )
+  {
+    return !(a == b);
+  }
 
   // Description:
   // Less than for cells
@@ -408,6 +1207,63 @@ namespace point_process_core {
   //====================================================================
   
 
+  // Description:
+  // Returns the range of cells of the grid which lie fully inside
+  // the given window.
+  // The range is computed directly from the origin and cell sizes,
+  // so this is O(dimension) rather than a test of every cell.
+  template<class T>
+  marked_grid_cell_range_t
+  cell_range_fully_inside_window( const marked_grid_t<T>& grid,
+				  const math_core::nd_aabox_t& window )
+  {
+    marked_grid_cell_range_t all = grid.cells();
+    if( all.empty() ||
+	window.start.coordinate.size() < all.min_cell().n ||
+	window.end.coordinate.size() < all.min_cell().n ) {
+      return marked_grid_cell_range_t();
+    }
+    marked_grid_cell_t min_cell = all.min_cell();
+    marked_grid_cell_t max_cell = all.max_cell();
+    const math_core::nd_point_t origin = grid.origin();
+    const std::vector<double> sizes = grid.cell_sizes();
+    for( size_t i = 0; i < min_cell.n; ++i ) {
+      const double o = origin.coordinate[i];
+      const double s = sizes[i];
+      const double a = window.start.coordinate[i];
+      const double b = window.end.coordinate[i];
+
+      // the first cell starting at or after a and the last cell
+      // ending at or before b, clamped to the grid's cells
+      double lo_guess = ceil( ( a - o ) / s );
+      double hi_guess = floor( ( b - o ) / s ) - 1;
+      long lo = (long)std::max( (double)min_cell.coordinate[i] - 1,
+				std::min( (double)max_cell.coordinate[i] + 1, lo_guess ) );
+      long hi = (long)std::max( (double)min_cell.coordinate[i] - 1,
+				std::min( (double)max_cell.coordinate[i] + 1, hi_guess ) );
+
+      // settle rounding at the boundaries with the same arithmetic
+      // as region()
+      while( lo > min_cell.coordinate[i] && ( lo - 1 ) * s + o >= a ) {
+	--lo;
+      }
+      while( lo <= max_cell.coordinate[i] && lo * s + o < a ) {
+	++lo;
+      }
+      while( hi < max_cell.coordinate[i] && ( ( hi + 1 ) * s + o ) + s <= b ) {
+	++hi;
+      }
+      while( hi >= min_cell.coordinate[i] && ( hi * s + o ) + s > b ) {
+	--hi;
+      }
+      min_cell.coordinate[i] = std::max( min_cell.coordinate[i], lo );
+      max_cell.coordinate[i] = std::min( max_cell.coordinate[i], hi );
+    }
+    return marked_grid_cell_range_t( min_cell, max_cell );
+  }
+
+  //====================================================================
+
   // Description:
   // Returns the cells which are inside of the given window within
   // the marked grid.
@@ -416,21 +1272,82 @@ namespace point_process_core {
   cells_fully_inside_window( const marked_grid_t<T>& grid,
 			     const math_core::nd_aabox_t& window )
   {
-    std::vector< marked_grid_cell_t > res;
-    std::vector< marked_grid_cell_t > all_cells = grid.all_cells();
-    std::vector< marked_grid_cell_t >::const_iterator iter;
-    for( iter = all_cells.begin();
-	 iter != all_cells.end();
-	 ++iter ) {
-      if( is_fully_inside( grid.region( *iter ), window ) ) {
-	res.push_back( *iter );
+    marked_grid_cell_range_t range = cell_range_fully_inside_window( grid, window );
+    return std::vector<marked_grid_cell_t>( range.begin(), range.end() );
+  }
+
+  //====================================================================
+
+  // Description:
+  // Calls f( cell, mark ) for every marked cell of the grid which
+  // lies fully inside the given window (in no particular order).
+  // Small windows look up each of their cells, large windows scan
+  // the stored marks, whichever touches fewer cells.
+  template<class T, class F>
+  void for_each_mark_in_window( const marked_grid_t<T>& grid,
+				const math_core::nd_aabox_t& window,
+				F f )
+  {
+    marked_grid_cell_range_t range = cell_range_fully_inside_window( grid, window );
+    if( range.empty() ) {
+      return;
+    }
+    if( grid.storage() == MARKED_GRID_DENSE_STORAGE ||
+	range.size() <= grid.num_marked_cells() ) {
+      for( const marked_grid_cell_t& cell : range ) {
+	boost::optional<T> mark = grid( cell );
+	if( mark ) {
+	  f( cell, *mark );
+	}
       }
+    } else {
+      grid.for_each_mark( [&]( const marked_grid_cell_t& cell,
+			       const T& mark ) {
+			    if( range.contains( cell ) ) {
+			      f( cell, mark );
+			    }
+			  } );
     }
+  }
+
+  //====================================================================
+
+  // Description:
+  // Returns the marked cells which are fully inside of the given window
+  template<class T>
+  std::vector<marked_grid_cell_t>
+  marked_cells_in_window( const marked_grid_t<T>& grid,
+			  const math_core::nd_aabox_t& window )
+  {
+    std::vector<marked_grid_cell_t> res;
+    for_each_mark_in_window( grid, window,
+			     [&res]( const marked_grid_cell_t& cell,
+				     const T& mark ) {
+			       res.push_back( cell );
+			     } );
     return res;
   }
 
   //====================================================================
 
+  // Description:
+  // Returns the sum of the marks of the cells which are fully inside
+  // of the given window
+  template<class T>
+  T sum_in_window( const marked_grid_t<T>& grid,
+		   const math_core::nd_aabox_t& window )
+  {
+    T sum = T(0);
+    for_each_mark_in_window( grid, window,
+			     [&sum]( const marked_grid_cell_t& cell,
+				     const T& mark ) {
+			       sum += mark;
+			     } );
+    return sum;
+  }
+
+  //====================================================================
+
   // Description:
   // Returns the smallest window which includes all the given cells
   template<class T>
@@ -482,7 +1399,7 @@ namespace point_process_core {
     
     // ok, jsut calculate the 0-1 sum loss ( L1 )
     double dist = 0.0;
-    for( auto cell : a.all_cells() ) {
+    for( const marked_grid_cell_t& cell : a.cells() ) {
       if( a( cell ) != b( cell ) ) {
 	dist += 1.0;
       }
@@ -491,6 +1408,28 @@ namespace point_process_core {
     return dist;
   }
   
+  //====================================================================
+
+  // Description:
+  // Returns a 64 bit fingerprint of the marks of a grid.
+  // The fingerprint does not depend on the storage or iteration order,
+  // so equal grids always have equal fingerprints (but different
+  // grids may collide).
+  template< class T >
+  boost::uint64_t marked_grid_fingerprint( const marked_grid_t<T>& grid )
+  {
+    boost::hash<T> mark_hasher;
+    boost::uint64_t sum = 0;
+    size_t count = 0;
+    grid.for_each_mark( [&]( const marked_grid_cell_t& cell,
+			     const T& mark ) {
+			  sum += mix_key( hash_value( cell ) ^
+					  mix_key( mark_hasher( mark ) ) );
+			  ++count;
+			} );
+    return mix_key( sum ^ mix_key( count ) );
+  }
+  
   //====================================================================
   
   // Description:
@@ -0,0 +1,198 @@
+
+#include "marked_grid_io.hpp"
+#include <ostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace point_process_core {
+
+  //====================================================================
+
+  static const char marked_grid_file_magic[8] = { 'P', 'P', 'C', 'G', 'R', 'I', 'D', 0 };
+
+  //====================================================================
+
+  // Description:
+  // Rounds a size up to a multiple of 8 bytes
+  static size_t padded_size( const size_t size )
+  {
+    return ( size + 7 ) & ~(size_t)7;
+  }
+
+  //====================================================================
+
+  marked_grid_file_layout_t::marked_grid_file_layout_t
+  ( const marked_grid_file_header_t& header )
+  {
+    const size_t n = header.dimension;
+    geometry = padded_size( sizeof(marked_grid_file_header_t) );
+    dense_box = geometry + 4 * padded_size( n * sizeof(double) );
+    if( header.dense_size > 0 ) {
+      dense_presence = dense_box + padded_size( 2 * n * sizeof(long) );
+      dense_marks = dense_presence + padded_size( header.dense_size );
+      sparse = dense_marks + padded_size( header.dense_size * header.mark_size );
+    } else {
+      dense_presence = dense_marks = sparse = dense_box;
+    }
+    sparse_record_size = n * sizeof(long) + padded_size( header.mark_size );
+    end = sparse + header.sparse_size * sparse_record_size;
+  }
+
+  //====================================================================
+
+  marked_grid_file_header_t
+  marked_grid_file_header( const marked_grid_file_kind_t kind,
+			   const marked_grid_storage_t storage,
+			   const marked_grid_mark_type_t mark_type,
+			   const size_t mark_size,
+			   const size_t dimension,
+			   const size_t bins_per_dimension,
+			   const size_t dense_size,
+			   const size_t sparse_size )
+  {
+    marked_grid_file_header_t header;
+    std::memset( &header, 0, sizeof(header) );
+    std::memcpy( header.magic, marked_grid_file_magic, sizeof(header.magic) );
+    header.version = marked_grid_file_version;
+    header.kind = kind;
+    header.storage = storage;
+    header.mark_type = mark_type;
+    header.mark_size = mark_size;
+    header.dimension = dimension;
+    header.bins_per_dimension = bins_per_dimension;
+    header.dense_size = dense_size;
+    header.sparse_size = sparse_size;
+    return header;
+  }
+
+  //====================================================================
+
+  void check_marked_grid_file_header( const marked_grid_file_header_t& header,
+				      const marked_grid_mark_type_t mark_type,
+				      const size_t mark_size )
+  {
+    if( std::memcmp( header.magic, marked_grid_file_magic, sizeof(header.magic) ) != 0 ) {
+      throw std::runtime_error( "not a marked grid file" );
+    }
+    if( header.version != marked_grid_file_version ) {
+      throw std::runtime_error( "unsupported marked grid file version" );
+    }
+    if( header.mark_type != (boost::uint32_t)mark_type ||
+	header.mark_size != mark_size ) {
+      throw std::runtime_error( "marked grid file has a different mark type" );
+    }
+  }
+
+  //====================================================================
+
+  void write_zeros( std::ostream& os, const size_t size )
+  {
+    static const char zeros[8] = { 0 };
+    for( size_t i = 0; i < size; i += sizeof(zeros) ) {
+      os.write( zeros, std::min( sizeof(zeros), size - i ) );
+    }
+  }
+
+  //====================================================================
+
+  void write_padded( std::ostream& os,
+		     const void* data,
+		     const size_t size )
+  {
+    os.write( (const char*)data, size );
+    write_zeros( os, padded_size( size ) - size );
+    if( !os ) {
+      throw std::runtime_error( "failed to write marked grid" );
+    }
+  }
+
+  //====================================================================
+
+  mapped_file_t::mapped_file_t( const std::string& filename )
+    : _data( NULL ),
+      _size( 0 ),
+      _writable( false )
+  {
+    int fd = open( filename.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+      throw std::runtime_error( "cannot open file " + filename );
+    }
+    _map( fd, filename );
+  }
+
+  //====================================================================
+
+  mapped_file_t::mapped_file_t( const std::string& filename,
+				const size_t size )
+    : _data( NULL ),
+      _size( 0 ),
+      _writable( true )
+  {
+    int fd = open( filename.c_str(), O_RDWR | ( size > 0 ? O_CREAT : 0 ), 0644 );
+    if( fd < 0 ) {
+      throw std::runtime_error( "cannot open file " + filename );
+    }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 ||
+	( (size_t)st.st_size < size && ftruncate( fd, size ) != 0 ) ) {
+      close( fd );
+      throw std::runtime_error( "cannot resize file " + filename );
+    }
+    _map( fd, filename );
+  }
+
+  //====================================================================
+
+  void mapped_file_t::_map( const int fd, const std::string& filename )
+  {
+    struct stat st;
+    if( fstat( fd, &st ) != 0 ) {
+      close( fd );
+      throw std::runtime_error( "cannot stat file " + filename );
+    }
+    _size = st.st_size;
+    if( _size > 0 ) {
+      int prot = _writable ? ( PROT_READ | PROT_WRITE ) : PROT_READ;
+      void* addr = mmap( NULL, _size, prot, MAP_SHARED, fd, 0 );
+      if( addr == MAP_FAILED ) {
+	close( fd );
+	throw std::runtime_error( "cannot map file " + filename );
+      }
+      _data = (unsigned char*)addr;
+    }
+    close( fd );
+  }
+
+  //====================================================================
+
+  void mapped_file_t::sync()
+  {
+    if( _data && _writable ) {
+      msync( _data, _size, MS_SYNC );
+    }
+  }
+
+  //====================================================================
+
+  mapped_file_t::~mapped_file_t()
+  {
+    if( _data ) {
+      munmap( _data, _size );
+    }
+  }
+
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+
+}
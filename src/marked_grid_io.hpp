@@ -0,0 +1,599 @@
+
+#if !defined( __POINT_PROCESS_CORE_MARKED_GRID_IO_HPP__ )
+#define __POINT_PROCESS_CORE_MARKED_GRID_IO_HPP__
+
+#include "marked_grid.hpp"
+#include "histogram.hpp"
+#include <boost/type_traits/is_pod.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <boost/type_traits/is_integral.hpp>
+#include <boost/type_traits/is_signed.hpp>
+#include <boost/type_traits/is_floating_point.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <iosfwd>
+#include <cstring>
+#include <fstream>
+
+
+namespace point_process_core {
+
+
+  // Description:
+  // A compact binary format for marked grids and histograms.
+  //
+  // The file is a fixed header followed by the grid geometry
+  // (window, origin and cell sizes), the dense payload (the box of
+  // cells, the presence flags and the flat array of marks) and the
+  // sparse payload (a sorted array of cell coordinates and marks).
+  // Every section starts on an 8 byte boundary so that a memory
+  // mapped file can be read in place.
+  // Marks are written as raw bytes in the native byte order, so only
+  // plain old data marks are supported (bool marks are written as
+  // one byte each). The header records the kind and size of the
+  // mark type so a file is only read back with a compatible type.
+
+  const boost::uint32_t marked_grid_file_version = 2;
+
+  // Description:
+  // The kind of object held in a marked grid file
+  enum marked_grid_file_kind_t {
+    MARKED_GRID_FILE_GRID = 0,
+    MARKED_GRID_FILE_HISTOGRAM = 1
+  };
+
+  // Description:
+  // The kind of mark type held in a marked grid file.
+  // Together with the mark size this tells apart, say, a double
+  // grid from a long one.
+  enum marked_grid_mark_type_t {
+    MARKED_GRID_MARK_OTHER = 0,
+    MARKED_GRID_MARK_BOOL = 1,
+    MARKED_GRID_MARK_SIGNED_INTEGER = 2,
+    MARKED_GRID_MARK_UNSIGNED_INTEGER = 3,
+    MARKED_GRID_MARK_FLOATING_POINT = 4
+  };
+
+  // Description:
+  // Returns the kind of the mark type T_Mark
+  template<typename T_Mark>
+  marked_grid_mark_type_t marked_grid_mark_type()
+  {
+    if( boost::is_same<T_Mark, bool>::value ) {
+      return MARKED_GRID_MARK_BOOL;
+    }
+    if( boost::is_floating_point<T_Mark>::value ) {
+      return MARKED_GRID_MARK_FLOATING_POINT;
+    }
+    if( boost::is_integral<T_Mark>::value ) {
+      return ( boost::is_signed<T_Mark>::value 
+	       ? MARKED_GRID_MARK_SIGNED_INTEGER
+	       : MARKED_GRID_MARK_UNSIGNED_INTEGER );
+    }
+    return MARKED_GRID_MARK_OTHER;
+  }
+
+  // Description:
+  // The fixed header of a marked grid file
+  struct marked_grid_file_header_t
+  {
+    char magic[8];
+    boost::uint32_t version;
+    boost::uint32_t kind;
+    boost::uint32_t storage;
+    boost::uint32_t mark_type;
+    boost::uint32_t mark_size;
+    boost::uint32_t reserved;
+    boost::uint64_t dimension;
+    boost::uint64_t bins_per_dimension;
+    boost::uint64_t dense_size;
+    boost::uint64_t sparse_size;
+  };
+
+  // Description:
+  // The byte offsets of the sections of a marked grid file
+  // given its header
+  struct marked_grid_file_layout_t
+  {
+    size_t geometry;
+    size_t dense_box;
+    size_t dense_presence;
+    size_t dense_marks;
+    size_t sparse;
+    size_t sparse_record_size;
+    size_t end;
+
+    marked_grid_file_layout_t( const marked_grid_file_header_t& header );
+  };
+
+  // Description:
+  // Fills in a header with the magic and version set
+  marked_grid_file_header_t
+  marked_grid_file_header( const marked_grid_file_kind_t kind,
+			   const marked_grid_storage_t storage,
+			   const marked_grid_mark_type_t mark_type,
+			   const size_t mark_size,
+			   const size_t dimension,
+			   const size_t bins_per_dimension,
+			   const size_t dense_size,
+			   const size_t sparse_size );
+
+  // Description:
+  // Checks the magic, version and mark type and size of a header.
+  // Throws std::runtime_error if the header cannot be read.
+  void check_marked_grid_file_header( const marked_grid_file_header_t& header,
+				      const marked_grid_mark_type_t mark_type,
+				      const size_t mark_size );
+
+  // Description:
+  // Writes the given bytes to the stream, then pads it with zeros
+  // up to the next 8 byte boundary.
+  // Throws std::runtime_error if the stream fails.
+  void write_padded( std::ostream& os,
+		     const void* data,
+		     const size_t size );
+
+  // Description:
+  // Writes the given number of zero bytes to the stream
+  void write_zeros( std::ostream& os, const size_t size );
+
+  // Description:
+  // Orders cells by their coordinates, which is the order of the
+  // sparse payload
+  inline
+  bool coordinate_less( const long* a, const long* b, const size_t n )
+  {
+    return std::lexicographical_compare( a, a + n, b, b + n );
+  }
+
+  //====================================================================
+
+  // Description:
+  // A memory mapping of a whole file.
+  // Throws std::runtime_error if the file cannot be mapped.
+  class mapped_file_t
+  {
+  public:
+
+    // Description:
+    // Maps the given file read only
+    mapped_file_t( const std::string& filename );
+
+    // Description:
+    // Maps the given file for reading and writing, growing it to
+    // at least the given size (grown space reads as zeros and takes
+    // no disk space until written). A missing file is created
+    // unless the size is 0
+    mapped_file_t( const std::string& filename, const size_t size );
+
+    ~mapped_file_t();
+
+    const unsigned char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+    // Description:
+    // The mapped bytes of a writable mapping
+    unsigned char* mutable_data() { assert( _writable ); return _data; }
+    bool writable() const { return _writable; }
+
+    // Description:
+    // Writes the modified pages back to the file
+    void sync();
+
+  protected:
+    unsigned char* _data;
+    size_t _size;
+    bool _writable;
+
+    // Description:
+    // Maps an open file descriptor, closing it
+    void _map( const int fd, const std::string& filename );
+
+  private:
+    mapped_file_t( const mapped_file_t& );
+    mapped_file_t& operator= ( const mapped_file_t& );
+  };
+
+  //====================================================================
+
+  namespace detail {
+
+    // Description:
+    // Writes the flat array of marks of a dense grid
+    template<typename T_Mark>
+    void write_dense_marks( std::ostream& os,
+			    const marked_grid_t<T_Mark>& grid )
+    {
+      write_padded( os, grid.dense_marks(), grid.dense_size() * sizeof(T_Mark) );
+    }
+
+    // Description:
+    // bool marks live in a std::vector<bool>, which has no flat
+    // array, so they are written one byte per mark
+    inline
+    void write_dense_marks( std::ostream& os,
+			    const marked_grid_t<bool>& grid )
+    {
+      std::vector<unsigned char> marks( grid.dense_size() );
+      for( size_t index = 0; index < marks.size(); ++index ) {
+	marks[ index ] = grid.dense_mark( index ) ? 1 : 0;
+      }
+      write_padded( os, marks.data(), marks.size() );
+    }
+
+    // Description:
+    // Streams a grid (the base of a histogram or a plain grid)
+    // to the output
+    template<typename T_Mark>
+    void write_marked_grid( std::ostream& os,
+			    const marked_grid_t<T_Mark>& grid,
+			    const marked_grid_file_kind_t kind,
+			    const size_t bins_per_dimension )
+    {
+      BOOST_STATIC_ASSERT( boost::is_pod<T_Mark>::value );
+
+      const size_t n = grid.window().n;
+      marked_grid_file_header_t header
+	= marked_grid_file_header( kind,
+				   grid.storage(),
+				   marked_grid_mark_type<T_Mark>(),
+				   sizeof(T_Mark),
+				   n,
+				   bins_per_dimension,
+				   grid.dense_size(),
+				   ( grid.storage() == MARKED_GRID_TILED_STORAGE
+				     ? grid.num_marked_cells()
+				     : grid.sparse_size() ) );
+      write_padded( os, &header, sizeof(header) );
+
+      // geometry
+      std::vector<double> cell_sizes = grid.cell_sizes();
+      cell_sizes.resize( n, 0.0 );
+      write_padded( os, grid.window().start.coordinate.data(), n * sizeof(double) );
+      write_padded( os, grid.window().end.coordinate.data(), n * sizeof(double) );
+      write_padded( os, grid.origin().coordinate.data(), n * sizeof(double) );
+      write_padded( os, cell_sizes.data(), n * sizeof(double) );
+
+      // dense payload, straight from the flat arrays
+      if( grid.dense_size() > 0 ) {
+	std::vector<long> box( 2 * n );
+	marked_grid_cell_t first = grid.dense_cell( 0 );
+	marked_grid_cell_t last = grid.dense_cell( grid.dense_size() - 1 );
+	for( size_t i = 0; i < n; ++i ) {
+	  box[i] = first.coordinate[i];
+	  box[n + i] = last.coordinate[i];
+	}
+	write_padded( os, box.data(), box.size() * sizeof(long) );
+	write_padded( os, grid.dense_presence(), grid.dense_size() );
+	write_dense_marks( os, grid );
+      }
+
+      // sparse payload, sorted by cell for lookups in a mapped file
+      // (the hash map, or all the marks of a tiled grid)
+      std::vector<std::pair<marked_grid_cell_t, T_Mark> > entries;
+      if( grid.storage() == MARKED_GRID_TILED_STORAGE ) {
+	entries.reserve( grid.num_marked_cells() );
+	grid.for_each_mark( [&entries]( const marked_grid_cell_t& cell,
+					const T_Mark& mark ) {
+			      entries.push_back( std::make_pair( cell, mark ) );
+			    } );
+      } else {
+	entries.assign( grid.sparse_marks().begin(), grid.sparse_marks().end() );
+      }
+      std::sort( entries.begin(), entries.end(),
+		 [n]( const std::pair<marked_grid_cell_t, T_Mark>& a,
+		      const std::pair<marked_grid_cell_t, T_Mark>& b ) {
+		   return coordinate_less( a.first.coordinate.data(),
+					   b.first.coordinate.data(),
+					   n );
+		 } );
+      for( size_t i = 0; i < entries.size(); ++i ) {
+	os.write( (const char*)entries[i].first.coordinate.data(),
+		  n * sizeof(long) );
+	write_padded( os, &entries[i].second, sizeof(T_Mark) );
+      }
+      if( !os ) {
+	throw std::runtime_error( "failed to write marked grid" );
+      }
+    }
+  }
+
+  //====================================================================
+
+  // Description:
+  // A marked grid file read in place from a memory mapping.
+  // Marks are looked up directly in the mapped file (dense cells by
+  // index, sparse cells by binary search) without copying the
+  // payload, and load_grid()/load_histogram() copy the file into
+  // an in-memory grid.
+  template<typename T_Mark>
+  class mapped_marked_grid_t
+  {
+  public:
+
+    BOOST_STATIC_ASSERT( boost::is_pod<T_Mark>::value );
+
+    // Description:
+    // Maps the given file.
+    // Throws std::runtime_error if the file is not a valid marked
+    // grid file for this mark type.
+    mapped_marked_grid_t( const std::string& filename )
+      : _file( new mapped_file_t( filename ) ),
+	_header(),
+	_layout( _read_header() )
+    {
+      if( _file->size() < _layout.end ) {
+	throw std::runtime_error( "truncated marked grid file" );
+      }
+      const size_t n = dimension();
+      const double* geometry = (const double*)( _file->data() + _layout.geometry );
+      _window = math_core::aabox( _read_point( geometry, n ),
+				  _read_point( geometry + n, n ) );
+      _origin = _read_point( geometry + 2 * n, n );
+      _cell_sizes.assign( geometry + 3 * n, geometry + 4 * n );
+      _dense_strides.assign( n, 0 );
+      size_t stride = 1;
+      for( long i = (long)n - 1; i >= 0 && dense_size() > 0; --i ) {
+	_dense_strides[i] = stride;
+	stride *= _dense_max()[i] - _dense_min()[i] + 1;
+      }
+    }
+
+    // Description:
+    // The header fields
+    size_t dimension() const { return _header.dimension; }
+    marked_grid_file_kind_t kind() const
+    { return (marked_grid_file_kind_t)_header.kind; }
+    marked_grid_storage_t storage() const
+    { return (marked_grid_storage_t)_header.storage; }
+    size_t bins_per_dimension() const { return _header.bins_per_dimension; }
+    size_t dense_size() const { return _header.dense_size; }
+    size_t sparse_size() const { return _header.sparse_size; }
+
+    // Description:
+    // The grid geometry
+    math_core::nd_aabox_t window() const { return _window; }
+    math_core::nd_point_t origin() const { return _origin; }
+    std::vector<double> cell_sizes() const { return _cell_sizes; }
+
+    // Description:
+    // The flat arrays of a dense grid, in place
+    const unsigned char* dense_presence() const
+    {
+      return _file->data() + _layout.dense_presence;
+    }
+    const T_Mark* dense_marks() const
+    {
+      return (const T_Mark*)( _file->data() + _layout.dense_marks );
+    }
+
+    // Description:
+    // Returns a pointer to the mark of the given cell in the mapped
+    // file, or null if the cell is not marked
+    const T_Mark* operator() ( const marked_grid_cell_t& cell ) const
+    {
+      if( cell.n != dimension() ) {
+	return NULL;
+      }
+
+      // dense cells by flat index
+      if( dense_size() > 0 ) {
+	size_t index = 0;
+	bool inside = true;
+	for( size_t i = 0; i < cell.n; ++i ) {
+	  if( cell.coordinate[i] < _dense_min()[i] ||
+	      cell.coordinate[i] > _dense_max()[i] ) {
+	    inside = false;
+	    break;
+	  }
+	  index += ( cell.coordinate[i] - _dense_min()[i] ) * _dense_strides[i];
+	}
+	if( inside ) {
+	  return dense_presence()[ index ] ? &dense_marks()[ index ] : NULL;
+	}
+      }
+
+      // sparse cells by binary search
+      size_t lo = 0;
+      size_t hi = sparse_size();
+      while( lo < hi ) {
+	size_t mid = lo + ( hi - lo ) / 2;
+	const long* c = _sparse_cell( mid );
+	if( coordinate_less( c, cell.coordinate.data(), cell.n ) ) {
+	  lo = mid + 1;
+	} else {
+	  hi = mid;
+	}
+      }
+      if( lo < sparse_size() &&
+	  std::equal( cell.coordinate.data(),
+		      cell.coordinate.data() + cell.n,
+		      _sparse_cell( lo ) ) ) {
+	return _sparse_mark( lo );
+      }
+      return NULL;
+    }
+
+    // Description:
+    // Calls f( cell, mark ) for every marked cell of the file
+    template<typename F>
+    void for_each_mark( F f ) const
+    {
+      const size_t n = dimension();
+      if( dense_size() > 0 ) {
+	marked_grid_cell_t cell;
+	cell.n = n;
+	cell.coordinate.resize( n );
+	std::copy( _dense_min(), _dense_min() + n, cell.coordinate.begin() );
+	for( size_t index = 0; index < dense_size(); ++index ) {
+	  if( dense_presence()[ index ] ) {
+	    f( (const marked_grid_cell_t&)cell, dense_marks()[ index ] );
+	  }
+
+	  // step the cell, last dimension fastest
+	  for( long i = (long)n - 1; i >= 0; --i ) {
+	    if( ++cell.coordinate[i] <= _dense_max()[i] ) {
+	      break;
+	    }
+	    cell.coordinate[i] = _dense_min()[i];
+	  }
+	}
+      }
+      for( size_t i = 0; i < sparse_size(); ++i ) {
+	marked_grid_cell_t cell;
+	cell.n = n;
+	cell.coordinate.resize( n );
+	std::copy( _sparse_cell( i ), _sparse_cell( i ) + n, cell.coordinate.begin() );
+	f( (const marked_grid_cell_t&)cell, *_sparse_mark( i ) );
+      }
+    }
+
+    // Description:
+    // Copies the file into an in-memory grid with the same storage
+    marked_grid_t<T_Mark> load_grid() const
+    {
+      marked_grid_t<T_Mark> grid( _window, _origin, _cell_sizes, storage() );
+      for_each_mark( [&grid]( const marked_grid_cell_t& cell,
+			      const T_Mark& mark ) {
+		       grid.set( cell, mark );
+		     } );
+      return grid;
+    }
+
+    // Description:
+    // Copies the file into an in-memory histogram with the same
+    // storage.
+    // Throws std::runtime_error if the file does not hold a histogram.
+    histogram_t<T_Mark> load_histogram() const
+    {
+      if( kind() != MARKED_GRID_FILE_HISTOGRAM ) {
+	throw std::runtime_error( "marked grid file does not hold a histogram" );
+      }
+      histogram_t<T_Mark> hist( _window, bins_per_dimension(), storage() );
+      for_each_mark( [&hist]( const marked_grid_cell_t& cell,
+			      const T_Mark& mark ) {
+		       hist.set( cell, mark );
+		     } );
+      return hist;
+    }
+
+  protected:
+
+    // Description:
+    // The mapping (shared between copies) and its header and layout
+    boost::shared_ptr<mapped_file_t> _file;
+    marked_grid_file_header_t _header;
+    marked_grid_file_layout_t _layout;
+
+    // Description:
+    // The geometry of the grid and the strides of the dense box
+    math_core::nd_aabox_t _window;
+    math_core::nd_point_t _origin;
+    std::vector<double> _cell_sizes;
+    std::vector<size_t> _dense_strides;
+
+    // Description:
+    // Reads and checks the header, returning the layout
+    marked_grid_file_layout_t _read_header()
+    {
+      if( _file->size() < sizeof(_header) ) {
+	throw std::runtime_error( "truncated marked grid file" );
+      }
+      std::memcpy( &_header, _file->data(), sizeof(_header) );
+      check_marked_grid_file_header( _header,
+				     marked_grid_mark_type<T_Mark>(),
+				     sizeof(T_Mark) );
+      return marked_grid_file_layout_t( _header );
+    }
+
+    // Description:
+    // Copies a point out of the geometry section
+    static math_core::nd_point_t _read_point( const double* x, const size_t n )
+    {
+      return math_core::point( std::vector<double>( x, x + n ) );
+    }
+
+    // Description:
+    // The lowest and highest cells of the dense box
+    const long* _dense_min() const
+    {
+      return (const long*)( _file->data() + _layout.dense_box );
+    }
+    const long* _dense_max() const
+    {
+      return _dense_min() + dimension();
+    }
+
+    // Description:
+    // The cell and mark of the i-th sparse record
+    const long* _sparse_cell( const size_t i ) const
+    {
+      return (const long*)( _file->data() + _layout.sparse + i * _layout.sparse_record_size );
+    }
+    const T_Mark* _sparse_mark( const size_t i ) const
+    {
+      return (const T_Mark*)( _sparse_cell( i ) + dimension() );
+    }
+  };
+
+  //====================================================================
+
+  // Description:
+  // Writes a marked grid to a stream / file in the binary format.
+  // Throws std::runtime_error on failure
+  template<typename T_Mark>
+  void write_marked_grid( std::ostream& os,
+			  const marked_grid_t<T_Mark>& grid )
+  {
+    detail::write_marked_grid( os, grid, MARKED_GRID_FILE_GRID, 0 );
+  }
+  template<typename T_Mark>
+  void save_marked_grid( const std::string& filename,
+			 const marked_grid_t<T_Mark>& grid )
+  {
+    std::ofstream fout( filename.c_str(), std::ios::binary );
+    write_marked_grid( fout, grid );
+  }
+
+  // Description:
+  // Writes a histogram to a stream / file in the binary format.
+  // Throws std::runtime_error on failure
+  template<typename T>
+  void write_histogram( std::ostream& os,
+			const histogram_t<T>& hist )
+  {
+    detail::write_marked_grid( os, hist, MARKED_GRID_FILE_HISTOGRAM,
+			       hist.bins_per_dimension() );
+  }
+  template<typename T>
+  void save_histogram( const std::string& filename,
+		       const histogram_t<T>& hist )
+  {
+    std::ofstream fout( filename.c_str(), std::ios::binary );
+    write_histogram( fout, hist );
+  }
+
+  //====================================================================
+
+  // Description:
+  // Reads a marked grid / histogram saved with save_marked_grid /
+  // save_histogram.
+  // Throws std::runtime_error if the file cannot be read.
+  template<typename T_Mark>
+  marked_grid_t<T_Mark> load_marked_grid( const std::string& filename )
+  {
+    return mapped_marked_grid_t<T_Mark>( filename ).load_grid();
+  }
+  template<typename T>
+  histogram_t<T> load_histogram( const std::string& filename )
+  {
+    return mapped_marked_grid_t<T>( filename ).load_histogram();
+  }
+
+  //====================================================================
+
+}
+
+#endif
+
@@ -0,0 +1,290 @@
+
+#include "mcmc_chains.hpp"
+#include "parallel.hpp"
+#include <limits>
+#include <cmath>
+#include <stdexcept>
+
+
+namespace point_process_core {
+
+
+  //======================================================================
+
+  // Description:
+  // The default diagnostic statistic: the number of points
+  static double num_points_statistic( const std::vector<nd_point_t>& sample )
+  {
+    return (double)sample.size();
+  }
+
+  //======================================================================
+
+  // Description:
+  // The per-chain means and variances of traces truncated to n samples
+  // Returns the number of samples used
+  static size_t chain_moments( const std::vector<std::vector<double> >& traces,
+			       std::vector<double>& means,
+			       std::vector<double>& variances )
+  {
+    size_t n = std::numeric_limits<size_t>::max();
+    for( size_t j = 0; j < traces.size(); ++j ) {
+      n = std::min( n, traces[j].size() );
+    }
+    if( traces.empty() || n < 2 ) {
+      return 0;
+    }
+    means.assign( traces.size(), 0.0 );
+    variances.assign( traces.size(), 0.0 );
+    for( size_t j = 0; j < traces.size(); ++j ) {
+      for( size_t i = 0; i < n; ++i ) {
+	means[j] += traces[j][i];
+      }
+      means[j] /= n;
+      for( size_t i = 0; i < n; ++i ) {
+	double d = traces[j][i] - means[j];
+	variances[j] += d * d;
+      }
+      variances[j] /= ( n - 1 );
+    }
+    return n;
+  }
+
+  //======================================================================
+
+  // Description:
+  // The within chain variance W and the pooled variance estimate
+  static void pooled_variances( const std::vector<double>& means,
+				const std::vector<double>& variances,
+				const size_t n,
+				double& within,
+				double& pooled )
+  {
+    size_t m = means.size();
+    double grand_mean = 0;
+    within = 0;
+    for( size_t j = 0; j < m; ++j ) {
+      grand_mean += means[j];
+      within += variances[j];
+    }
+    grand_mean /= m;
+    within /= m;
+    double between_over_n = 0;
+    if( m > 1 ) {
+      for( size_t j = 0; j < m; ++j ) {
+	between_over_n += ( means[j] - grand_mean ) * ( means[j] - grand_mean );
+      }
+      between_over_n /= ( m - 1 );
+    }
+    pooled = ( n - 1.0 ) / n * within + between_over_n;
+  }
+
+  //======================================================================
+
+  double gelman_rubin_rhat( const std::vector<std::vector<double> >& traces )
+  {
+    std::vector<double> means, variances;
+    size_t n = chain_moments( traces, means, variances );
+    if( n == 0 ) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    double within, pooled;
+    pooled_variances( means, variances, n, within, pooled );
+    if( within <= 0 ) {
+      return pooled <= 0 ? 1.0 : std::numeric_limits<double>::infinity();
+    }
+    return sqrt( pooled / within );
+  }
+
+  //======================================================================
+
+  double effective_sample_size( const std::vector<std::vector<double> >& traces )
+  {
+    std::vector<double> means, variances;
+    size_t n = chain_moments( traces, means, variances );
+    if( n == 0 ) {
+      return 0;
+    }
+    size_t m = traces.size();
+    double within, pooled;
+    pooled_variances( means, variances, n, within, pooled );
+    if( pooled <= 0 ) {
+      return (double)( m * n );
+    }
+
+    // autocorrelation at lag t from the variogram
+    auto rho = [&]( const size_t t ) {
+      double variogram = 0;
+      for( size_t j = 0; j < m; ++j ) {
+	for( size_t i = t; i < n; ++i ) {
+	  double d = traces[j][i] - traces[j][i - t];
+	  variogram += d * d;
+	}
+      }
+      variogram /= ( m * ( n - t ) );
+      return 1.0 - variogram / ( 2.0 * pooled );
+    };
+
+    // sum autocorrelations in pairs until a pair sum is negative
+    double rho_sum = 0;
+    for( size_t t = 1; t + 1 < n; t += 2 ) {
+      double pair = rho( t ) + rho( t + 1 );
+      if( pair < 0 ) {
+	break;
+      }
+      rho_sum += pair;
+    }
+
+    return ( m * n ) / ( 1.0 + 2.0 * rho_sum );
+  }
+
+  //======================================================================
+
+  std::vector<std::vector<nd_point_t> >
+  mcmc_chains_result_t::pooled_samples() const
+  {
+    std::vector<std::vector<nd_point_t> > pooled;
+    for( size_t j = 0; j < samples.size(); ++j ) {
+      pooled.insert( pooled.end(), samples[j].begin(), samples[j].end() );
+    }
+    return pooled;
+  }
+
+  //======================================================================
+
+  mcmc_chains_result_t
+  run_mcmc_chains( const mcmc_point_process_t& process,
+		   const mcmc_chains_parameters_t& params,
+		   const sample_statistic_t& statistic )
+  {
+    sample_statistic_t stat = statistic;
+    if( !stat ) {
+      stat = &num_points_statistic;
+    }
+
+    // clone and reseed the chains up front (cloning need not be
+    // thread safe). Clones which cannot be reseeded would all draw
+    // the same random stream, so several of them are refused.
+    mcmc_chains_result_t result;
+    for( size_t k = 0; k < params.num_chains; ++k ) {
+      boost::shared_ptr<mcmc_point_process_t> chain = process.clone();
+      if( !chain->seed_rng( chain_seed( params.seed, k ) ) &&
+	  params.num_chains > 1 ) {
+	throw std::runtime_error( "cannot run several mcmc chains of a process which does not support seed_rng" );
+      }
+      result.chains.push_back( chain );
+    }
+    result.samples.resize( params.num_chains );
+    result.traces.resize( params.num_chains );
+
+    // run each chain on its own, writing only to its own slots
+    parallel_for( params.num_chains,
+		  [&]( const size_t k ) {
+		    boost::shared_ptr<mcmc_point_process_t> chain = result.chains[k];
+		    chain->mcmc( params.num_burn_in_iterations );
+		    result.samples[k].reserve( params.num_samples_per_chain );
+		    result.traces[k].reserve( params.num_samples_per_chain );
+		    for( size_t i = 0; i < params.num_samples_per_chain; ++i ) {
+		      std::vector<nd_point_t> sample = chain->sample();
+		      result.traces[k].push_back( stat( sample ) );
+		      result.samples[k].push_back( sample );
+		      chain->mcmc( params.num_mcmc_iterations_between_samples );
+		    }
+		  },
+		  params.num_threads );
+
+    // cross chain diagnostics
+    result.rhat = gelman_rubin_rhat( result.traces );
+    result.effective_sample_size = effective_sample_size( result.traces );
+
+    return result;
+  }
+
+  //======================================================================
+
+  histogram_t<double>
+  parallel_intensity_estimate( const mcmc_point_process_t& process,
+			       const math_core::nd_aabox_t& window,
+			       const size_t bins_per_dimension,
+			       const size_t num_samples_for_estimate,
+			       const size_t num_mcmc_iterations_between_samples,
+			       const size_t num_chains,
+			       const unsigned long seed,
+			       const size_t num_threads,
+			       const boost::optional<marked_grid_storage_t>& storage )
+  {
+    histogram_t<double> hist = storage
+      ? histogram_t<double>( window, bins_per_dimension, *storage )
+      : histogram_t<double>( window, bins_per_dimension );
+    if( num_chains == 0 || num_samples_for_estimate == 0 ) {
+      return hist;
+    }
+
+    // clone and reseed the chains, with one histogram per chain.
+    // Clones which cannot be reseeded would all draw the same random
+    // stream, so fall back to a single serial chain for those
+    std::vector<boost::shared_ptr<mcmc_point_process_t> > chains;
+    std::vector<histogram_t<double> > chain_hists;
+    for( size_t k = 0; k < num_chains; ++k ) {
+      boost::shared_ptr<mcmc_point_process_t> chain = process.clone();
+      if( !chain->seed_rng( chain_seed( seed, k ) ) && num_chains > 1 ) {
+	return process.clone()->intensity_estimate( window,
+						    bins_per_dimension,
+						    num_samples_for_estimate,
+						    num_mcmc_iterations_between_samples,
+						    false,
+						    storage );
+      }
+      chains.push_back( chain );
+      chain_hists.push_back( hist );
+    }
+
+    // fill the per-chain histograms concurrently
+    parallel_for( num_chains,
+		  [&]( const size_t k ) {
+		    size_t num_samples = num_samples_for_estimate / num_chains;
+		    if( k < num_samples_for_estimate % num_chains ) {
+		      ++num_samples;
+		    }
+		    for( size_t i = 0; i < num_samples; ++i ) {
+		      std::vector<nd_point_t> sample = chains[k]->sample();
+		      for( const nd_point_t& p : sample ) {
+			chain_hists[k].increment_bin( p );
+		      }
+		      chains[k]->mcmc( num_mcmc_iterations_between_samples );
+		    }
+		  },
+		  num_threads );
+
+    // reduce the histograms in chain order
+    for( size_t k = 0; k < num_chains; ++k ) {
+      hist.merge( chain_hists[k] );
+    }
+
+    // normalize the counts by the numbr of samples to get
+    // average intensity
+    hist.scale( 1.0 / (double)num_samples_for_estimate );
+    return hist;
+  }
+
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+  //======================================================================
+
+
+}
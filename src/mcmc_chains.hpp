@@ -0,0 +1,143 @@
+
+#if !defined( __POINT_PROCESS_CORE_MCMC_CHAINS_HPP__ )
+#define __POINT_PROCESS_CORE_MCMC_CHAINS_HPP__
+
+#include "point_process.hpp"
+#include <boost/function.hpp>
+
+
+namespace point_process_core {
+
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Parameters for running several independent mcmc chains
+  struct mcmc_chains_parameters_t
+  {
+    size_t num_chains;
+    size_t num_threads;
+    size_t num_burn_in_iterations;
+    size_t num_samples_per_chain;
+    size_t num_mcmc_iterations_between_samples;
+    unsigned long seed;
+
+    mcmc_chains_parameters_t()
+      : num_chains( 4 ),
+	num_threads( 0 ),
+	num_burn_in_iterations( 0 ),
+	num_samples_per_chain( 100 ),
+	num_mcmc_iterations_between_samples( 1 ),
+	seed( 0 )
+    {}
+  };
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // A scalar statistic of a point set sample, used to diagnose
+  // convergence of the chains
+  typedef boost::function< double( const std::vector<math_core::nd_point_t>& ) > sample_statistic_t;
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // The chains, samples and cross-chain diagnostics from
+  // running several mcmc chains
+  struct mcmc_chains_result_t
+  {
+    // Description:
+    // The chains (clones of the original process) in their final state
+    std::vector<boost::shared_ptr<mcmc_point_process_t> > chains;
+
+    // Description:
+    // The samples drawn from each chain
+    std::vector<std::vector<std::vector<math_core::nd_point_t> > > samples;
+
+    // Description:
+    // The statistic of each sample of each chain
+    std::vector<std::vector<double> > traces;
+
+    // Description:
+    // The potential scale reduction factor (R-hat) and the
+    // effective sample size of the statistic over all the chains
+    double rhat;
+    double effective_sample_size;
+
+    // Description:
+    // Returns the samples of all the chains, in chain order
+    std::vector<std::vector<math_core::nd_point_t> > pooled_samples() const;
+  };
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Returns the seed for the given chain derived from a base seed
+  inline
+  unsigned long chain_seed( const unsigned long seed, const size_t chain )
+  {
+    return (unsigned long)mix_key( seed + 0x9e3779b97f4a7c15ULL * ( chain + 1 ) );
+  }
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Clones the process into params.num_chains independent chains,
+  // reseeds each one and runs them concurrently on a thread pool.
+  // Each chain is burned in and then sampled num_samples_per_chain times.
+  // Throws std::runtime_error if there are several chains and the
+  // process does not support seed_rng.
+  // The statistic used for the diagnostics defaults to the number
+  // of points in each sample.
+  // The original process is not changed.
+  mcmc_chains_result_t
+  run_mcmc_chains( const mcmc_point_process_t& process,
+		   const mcmc_chains_parameters_t& params,
+		   const sample_statistic_t& statistic = sample_statistic_t() );
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Computes an estimate for the intensity function of the process
+  // like mcmc_point_process_t::intensity_estimate, but splits the
+  // samples between num_chains cloned chains which run concurrently.
+  // Each chain fills its own histogram and the histograms are summed
+  // in chain order, so the result only depends on the seed and the
+  // number of chains (not on the number of threads or scheduling).
+  // If the process does not support seed_rng this falls back to a
+  // single serial chain on a clone of the process.
+  // The histogram uses the given storage, or the histogram_t default
+  // if none is given.
+  // The original process is not changed.
+  histogram_t<double>
+  parallel_intensity_estimate( const mcmc_point_process_t& process,
+			       const math_core::nd_aabox_t& window,
+			       const size_t bins_per_dimension,
+			       const size_t num_samples_for_estimate = 1000,
+			       const size_t num_mcmc_iterations_between_samples = 1,
+			       const size_t num_chains = 4,
+			       const unsigned long seed = 0,
+			       const size_t num_threads = 0,
+			       const boost::optional<marked_grid_storage_t>& storage = boost::none );
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // The Gelman-Rubin potential scale reduction factor (R-hat) for a set
+  // of chain traces. Values close to 1 indicate the chains have mixed.
+  // Chains are truncated to the shortest one.
+  double gelman_rubin_rhat( const std::vector<std::vector<double> >& traces );
+
+  // Description:
+  // The multi-chain effective sample size of a set of chain traces,
+  // using the autocorrelations truncated at the first negative pair
+  // (Geyer's initial positive sequence).
+  // Chains are truncated to the shortest one.
+  double effective_sample_size( const std::vector<std::vector<double> >& traces );
+
+  //-------------------------------------------------------------------------
+
+}
+
+#endif
+
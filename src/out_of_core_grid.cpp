@@ -0,0 +1,100 @@
+
+#include "out_of_core_grid.hpp"
+#include <stdexcept>
+
+
+namespace point_process_core {
+
+  //====================================================================
+
+  static const char out_of_core_grid_file_magic[8] = { 'P', 'P', 'C', 'T', 'I', 'L', 'E', 0 };
+  static const boost::uint32_t out_of_core_grid_file_version = 3;
+
+  // Description:
+  // The page size the tiles are aligned to
+  static const size_t out_of_core_grid_page_size = 4096;
+
+  //====================================================================
+
+  // Description:
+  // Rounds a size up to a multiple of the given alignment
+  static size_t aligned_size( const size_t size, const size_t alignment )
+  {
+    return ( ( size + alignment - 1 ) / alignment ) * alignment;
+  }
+
+  //====================================================================
+
+  out_of_core_grid_file_layout_t::out_of_core_grid_file_layout_t
+  ( const out_of_core_grid_file_header_t& header )
+  {
+    const size_t n = header.dimension;
+    geometry = aligned_size( sizeof(out_of_core_grid_file_header_t), 8 );
+    tile_box = geometry + 4 * n * sizeof(double);
+    tile_counts = tile_box + n * ( sizeof(long) + sizeof(boost::uint64_t) );
+
+    // every tile starts on a page boundary and takes whole pages, so
+    // paging a tile in never touches its neighbours' pages
+    tiles = aligned_size( tile_counts + header.num_tiles * sizeof(boost::uint64_t),
+			  out_of_core_grid_page_size );
+    tile_presence_size = aligned_size( header.cells_per_tile, 8 );
+    tile_size = aligned_size( tile_presence_size
+			      + aligned_size( header.cells_per_tile * header.mark_size, 8 ),
+			      out_of_core_grid_page_size );
+    end = tiles + header.num_tiles * tile_size;
+  }
+
+  //====================================================================
+
+  out_of_core_grid_file_header_t
+  out_of_core_grid_file_header( const marked_grid_mark_type_t mark_type,
+				const size_t mark_size,
+				const size_t dimension,
+				const size_t tile_edge,
+				const size_t num_tiles )
+  {
+    if( tile_edge == 0 ) {
+      throw std::runtime_error( "out-of-core grid tiles must have at least one cell" );
+    }
+    out_of_core_grid_file_header_t header;
+    std::memset( &header, 0, sizeof(header) );
+    std::memcpy( header.magic, out_of_core_grid_file_magic, sizeof(header.magic) );
+    header.version = out_of_core_grid_file_version;
+    header.mark_type = mark_type;
+    header.mark_size = mark_size;
+    header.dimension = dimension;
+    header.tile_edge = tile_edge;
+    header.num_tiles = num_tiles;
+    header.cells_per_tile = 1;
+    for( size_t i = 0; i < dimension; ++i ) {
+      header.cells_per_tile *= tile_edge;
+    }
+    return header;
+  }
+
+  //====================================================================
+
+  void check_out_of_core_grid_file_header( const out_of_core_grid_file_header_t& header,
+					   const marked_grid_mark_type_t mark_type,
+					   const size_t mark_size )
+  {
+    if( std::memcmp( header.magic, out_of_core_grid_file_magic, sizeof(header.magic) ) != 0 ) {
+      throw std::runtime_error( "not an out-of-core grid file" );
+    }
+    if( header.version != out_of_core_grid_file_version ) {
+      throw std::runtime_error( "unsupported out-of-core grid file version" );
+    }
+    if( header.mark_type != (boost::uint32_t)mark_type ||
+	header.mark_size != mark_size ) {
+      throw std::runtime_error( "out-of-core grid file has a different mark type" );
+    }
+  }
+
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+  //====================================================================
+
+}
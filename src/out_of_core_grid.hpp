@@ -0,0 +1,450 @@
+
+#if !defined( __POINT_PROCESS_CORE_OUT_OF_CORE_GRID_HPP__ )
+#define __POINT_PROCESS_CORE_OUT_OF_CORE_GRID_HPP__
+
+#include "marked_grid.hpp"
+#include "marked_grid_io.hpp"
+#include <cstdio>
+#include <stdexcept>
+
+
+namespace point_process_core {
+
+
+  // Description:
+  // The fixed header of an out-of-core grid file.
+  //
+  // The file holds the header, the grid geometry (window, origin and
+  // cell sizes), the box of cells covered by the tiles (lowest cell
+  // and number of tiles along each dimension), the number of marks in
+  // each tile and then the tiles themselves, each a block of presence
+  // flags followed by a block of marks for tile_edge^dimension cells.
+  struct out_of_core_grid_file_header_t
+  {
+    char magic[8];
+    boost::uint32_t version;
+    boost::uint32_t mark_type;
+    boost::uint32_t mark_size;
+    boost::uint32_t reserved;
+    boost::uint64_t dimension;
+    boost::uint64_t tile_edge;
+    boost::uint64_t num_tiles;
+    boost::uint64_t cells_per_tile;
+  };
+
+  // Description:
+  // The byte offsets of the sections of an out-of-core grid file
+  struct out_of_core_grid_file_layout_t
+  {
+    size_t geometry;
+    size_t tile_box;
+    size_t tile_counts;
+    size_t tiles;
+    size_t tile_presence_size;
+    size_t tile_size;
+    size_t end;
+
+    out_of_core_grid_file_layout_t( const out_of_core_grid_file_header_t& header );
+  };
+
+  // Description:
+  // Fills in / checks the header of an out-of-core grid file.
+  // The check throws std::runtime_error if the file cannot be read.
+  out_of_core_grid_file_header_t
+  out_of_core_grid_file_header( const marked_grid_mark_type_t mark_type,
+				const size_t mark_size,
+				const size_t dimension,
+				const size_t tile_edge,
+				const size_t num_tiles );
+  void check_out_of_core_grid_file_header( const out_of_core_grid_file_header_t& header,
+					   const marked_grid_mark_type_t mark_type,
+					   const size_t mark_size );
+
+  // Description:
+  // How an existing out-of-core grid file is opened
+  enum out_of_core_grid_mode_t {
+    OUT_OF_CORE_GRID_READ_WRITE = 0,
+    OUT_OF_CORE_GRID_READ_ONLY = 1
+  };
+
+  //====================================================================
+
+  // Description:
+  // A marked grid whose window is kept in a memory mapped file
+  // rather than in memory.
+  // The window is cut into tiles of tile_edge cells along each
+  // dimension, stored contiguously in the file, so the operating
+  // system pages in only the tiles which are used and tiles which
+  // were never written take no disk space (the file is sparse).
+  // A count of marks per tile lets scans skip empty tiles without
+  // touching them.
+  // Only cells covered by the tiles (the window, rounded up to whole
+  // tiles) can be marked, since every mark is kept in the file:
+  // setting a mark outside of them throws std::out_of_range.
+  // Marks must be plain old data.
+  template<typename T_Mark>
+  class out_of_core_marked_grid_t
+  {
+  public:
+
+    BOOST_STATIC_ASSERT( boost::is_pod<T_Mark>::value );
+
+    // Description:
+    // Creates a new grid file (replacing any existing one) with the
+    // given window, origin cell point and per-dimension resolutions.
+    // Throws std::runtime_error if the file cannot be created.
+    out_of_core_marked_grid_t( const std::string& filename,
+			       const math_core::nd_aabox_t& window,
+			       const math_core::nd_point_t& origin,
+			       const std::vector<double>& resolutions,
+			       const size_t tile_edge = 8 )
+      : _geometry( window, origin, resolutions ),
+	_header(),
+	_layout( _header )
+    {
+      marked_grid_cell_t min_cell = _geometry.cell( window.start );
+      marked_grid_cell_t max_cell = _geometry.cell( window.end );
+      const size_t n = min_cell.n;
+      std::vector<boost::uint64_t> tile_extents( n );
+      size_t num_tiles = ( n > 0 ? 1 : 0 );
+      for( size_t i = 0; i < n; ++i ) {
+	long extent = max_cell.coordinate[i] - min_cell.coordinate[i] + 1;
+	tile_extents[i] = ( extent > 0 ? ( extent + tile_edge - 1 ) / tile_edge : 0 );
+	num_tiles *= tile_extents[i];
+      }
+      _header = out_of_core_grid_file_header( marked_grid_mark_type<T_Mark>(),
+					      sizeof(T_Mark),
+					      n,
+					      tile_edge,
+					      num_tiles );
+      _layout = out_of_core_grid_file_layout_t( _header );
+
+      // start from an empty file so all tiles read as unmarked
+      std::remove( filename.c_str() );
+      _file.reset( new mapped_file_t( filename, _layout.end ) );
+      unsigned char* data = _file->mutable_data();
+      std::memcpy( data, &_header, sizeof(_header) );
+      double* geometry = (double*)( data + _layout.geometry );
+      std::copy( window.start.coordinate.begin(), window.start.coordinate.begin() + n, geometry );
+      std::copy( window.end.coordinate.begin(), window.end.coordinate.begin() + n, geometry + n );
+      std::copy( origin.coordinate.begin(), origin.coordinate.begin() + n, geometry + 2 * n );
+      std::copy( resolutions.begin(), resolutions.begin() + n, geometry + 3 * n );
+      std::copy( min_cell.coordinate.begin(), min_cell.coordinate.end(),
+		 (long*)( data + _layout.tile_box ) );
+      std::copy( tile_extents.begin(), tile_extents.end(),
+		 (boost::uint64_t*)( data + _layout.tile_box + n * sizeof(long) ) );
+      _init_tiles();
+    }
+
+    // Description:
+    // Opens an existing grid file for reading and writing, or read
+    // only (in which case changing a mark throws std::runtime_error).
+    // Throws std::runtime_error if the file is not a grid file for
+    // this mark type.
+    explicit out_of_core_marked_grid_t( const std::string& filename,
+					const out_of_core_grid_mode_t mode = OUT_OF_CORE_GRID_READ_WRITE )
+      : _header(),
+	_layout( _header )
+    {
+      if( mode == OUT_OF_CORE_GRID_READ_ONLY ) {
+	_file.reset( new mapped_file_t( filename ) );
+      } else {
+	_file.reset( new mapped_file_t( filename, 0 ) );
+      }
+      if( _file->size() < sizeof(_header) ) {
+	throw std::runtime_error( "truncated out-of-core grid file" );
+      }
+      std::memcpy( &_header, _file->data(), sizeof(_header) );
+      check_out_of_core_grid_file_header( _header,
+					  marked_grid_mark_type<T_Mark>(),
+					  sizeof(T_Mark) );
+      _layout = out_of_core_grid_file_layout_t( _header );
+      if( _file->size() < _layout.end ) {
+	throw std::runtime_error( "truncated out-of-core grid file" );
+      }
+      const size_t n = _header.dimension;
+      const double* geometry = (const double*)( _file->data() + _layout.geometry );
+      std::vector<double> start( geometry, geometry + n );
+      std::vector<double> end( geometry + n, geometry + 2 * n );
+      std::vector<double> origin( geometry + 2 * n, geometry + 3 * n );
+      std::vector<double> resolutions( geometry + 3 * n, geometry + 4 * n );
+      _geometry = marked_grid_t<T_Mark>( math_core::aabox( math_core::point( start ),
+							   math_core::point( end ) ),
+					 math_core::point( origin ),
+					 resolutions );
+      _init_tiles();
+    }
+
+    // Description:
+    // Returns the mark at a particular cell (or point)
+    boost::optional<T_Mark> operator() ( const marked_grid_cell_t& cell ) const
+    {
+      size_t tile, offset;
+      if( _locate( cell, tile, offset ) ) {
+	if( _tile_presence( tile )[ offset ] ) {
+	  return boost::optional<T_Mark>( _tile_marks( tile )[ offset ] );
+	}
+      }
+      return boost::optional<T_Mark>();
+    }
+    boost::optional<T_Mark> operator() ( const math_core::nd_point_t& point ) const
+    {
+      return (*this)( cell( point ) );
+    }
+
+    // Description:
+    // Sets the mark at a particular cell (or point).
+    // Throws std::out_of_range if the cell is not covered by the
+    // tiles, and std::runtime_error if the file is read only.
+    void set( const marked_grid_cell_t& cell,
+	      const T_Mark& mark )
+    {
+      _check_writable();
+      size_t tile, offset;
+      if( !_locate( cell, tile, offset ) ) {
+	throw std::out_of_range( "cell outside of the out-of-core grid window" );
+      }
+      unsigned char& present = _tile_presence( tile )[ offset ];
+      if( !present ) {
+	present = 1;
+	++_tile_counts[ tile ];
+      }
+      _tile_marks( tile )[ offset ] = mark;
+    }
+    void set( const math_core::nd_point_t& point,
+	      const T_Mark& mark )
+    {
+      set( cell( point ), mark );
+    }
+
+    // Description:
+    // Clears the mark at a particular cell (or point).
+    // Throws std::runtime_error if the file is read only
+    void clear_mark( const marked_grid_cell_t& cell )
+    {
+      _check_writable();
+      size_t tile, offset;
+      if( _locate( cell, tile, offset ) ) {
+	unsigned char& present = _tile_presence( tile )[ offset ];
+	if( present ) {
+	  present = 0;
+	  --_tile_counts[ tile ];
+	}
+      }
+    }
+    void clear_mark( const math_core::nd_point_t& point )
+    {
+      clear_mark( cell( point ) );
+    }
+
+    // Description:
+    // Iterates over all the cells of the window, marked or not
+    marked_grid_cell_range_t cells() const
+    {
+      return _geometry.cells();
+    }
+
+    // Description:
+    // Calls f( cell, mark ) for every marked cell, visiting only
+    // the tiles which hold marks
+    template<typename F>
+    void for_each_mark( F f ) const
+    {
+      const size_t n = _header.dimension;
+      for( size_t tile = 0; tile < _header.num_tiles; ++tile ) {
+	if( _tile_counts[ tile ] == 0 ) {
+	  continue;
+	}
+	const unsigned char* presence = _tile_presence( tile );
+	const T_Mark* marks = _tile_marks( tile );
+	marked_grid_cell_t base = _tile_base( tile );
+	for( size_t offset = 0; offset < _header.cells_per_tile; ++offset ) {
+	  if( presence[ offset ] ) {
+	    marked_grid_cell_t c = base;
+	    size_t rest = offset;
+	    for( long i = (long)n - 1; i >= 0; --i ) {
+	      c.coordinate[i] += rest % _header.tile_edge;
+	      rest /= _header.tile_edge;
+	    }
+	    f( (const marked_grid_cell_t&)c, marks[ offset ] );
+	  }
+	}
+      }
+    }
+
+    // Description:
+    // Returns all of the cells which have been marked
+    std::vector<marked_grid_cell_t> all_marked_cells() const
+    {
+      std::vector<marked_grid_cell_t> res;
+      res.reserve( num_marked_cells() );
+      for_each_mark( [&res]( const marked_grid_cell_t& c, const T_Mark& ) {
+		       res.push_back( c );
+		     } );
+      return res;
+    }
+
+    // Description:
+    // Returns the number of marked cells
+    size_t num_marked_cells() const
+    {
+      size_t count = 0;
+      for( size_t tile = 0; tile < _header.num_tiles; ++tile ) {
+	count += _tile_counts[ tile ];
+      }
+      return count;
+    }
+
+    // Description:
+    // Copies the marks into an in-memory marked grid with the given
+    // storage
+    marked_grid_t<T_Mark>
+    load_grid( const marked_grid_storage_t storage = MARKED_GRID_SPARSE_STORAGE ) const
+    {
+      marked_grid_t<T_Mark> grid( window(), origin(), cell_sizes(), storage );
+      for_each_mark( [&grid]( const marked_grid_cell_t& c, const T_Mark& mark ) {
+		       grid.set( c, mark );
+		     } );
+      return grid;
+    }
+
+    // Description:
+    // Writes the modified tiles back to the file
+    void sync()
+    {
+      _file->sync();
+    }
+
+    // Description:
+    // Returns true if the file was opened read only
+    bool read_only() const { return !_file->writable(); }
+
+    // Description:
+    // The grid geometry, as for marked_grid_t
+    math_core::nd_aabox_t region( const marked_grid_cell_t& cell ) const
+    {
+      return _geometry.region( cell );
+    }
+    marked_grid_cell_t cell( const math_core::nd_point_t& point ) const
+    {
+      return _geometry.cell( point );
+    }
+    std::vector<double> cell_sizes() const
+    {
+      return _geometry.cell_sizes();
+    }
+    math_core::nd_point_t origin() const
+    {
+      return _geometry.origin();
+    }
+    math_core::nd_aabox_t window() const
+    {
+      return _geometry.window();
+    }
+
+    // Description:
+    // The tiling of the file
+    size_t tile_edge() const { return _header.tile_edge; }
+    size_t num_tiles() const { return _header.num_tiles; }
+
+  protected:
+
+    // Description:
+    // The mapped file and its header and layout
+    boost::shared_ptr<mapped_file_t> _file;
+
+    // Description:
+    // An empty sparse grid giving the geometry (cells and regions)
+    marked_grid_t<T_Mark> _geometry;
+
+    out_of_core_grid_file_header_t _header;
+    out_of_core_grid_file_layout_t _layout;
+
+    // Description:
+    // The lowest cell covered by the tiles, the number of tiles along
+    // each dimension and the number of marks in each tile (in the file)
+    marked_grid_cell_t _tile_min_cell;
+    std::vector<size_t> _tile_extents;
+    boost::uint64_t* _tile_counts;
+
+    // Description:
+    // Reads the tile box out of the mapped file
+    void _init_tiles()
+    {
+      const size_t n = _header.dimension;
+      const unsigned char* data = _file->data();
+      const long* min_cell = (const long*)( data + _layout.tile_box );
+      const boost::uint64_t* extents
+	= (const boost::uint64_t*)( data + _layout.tile_box + n * sizeof(long) );
+      _tile_min_cell = marked_grid_cell_t();
+      _tile_min_cell.n = n;
+      _tile_min_cell.coordinate.resize( n );
+      std::copy( min_cell, min_cell + n, _tile_min_cell.coordinate.begin() );
+      _tile_extents.assign( extents, extents + n );
+      _tile_counts = (boost::uint64_t*)( _file->data() + _layout.tile_counts );
+    }
+
+    // Description:
+    // Throws std::runtime_error if the file is read only
+    void _check_writable() const
+    {
+      if( read_only() ) {
+	throw std::runtime_error( "out-of-core grid file is read only" );
+      }
+    }
+
+    // Description:
+    // Finds the tile and offset within the tile of a cell.
+    // Returns false if the cell is not covered by the tiles
+    bool _locate( const marked_grid_cell_t& cell,
+		  size_t& tile,
+		  size_t& offset ) const
+    {
+      if( _header.num_tiles == 0 || cell.n != _tile_min_cell.n ) {
+	return false;
+      }
+      const long edge = _header.tile_edge;
+      tile = 0;
+      offset = 0;
+      for( size_t i = 0; i < cell.n; ++i ) {
+	long c = cell.coordinate[i] - _tile_min_cell.coordinate[i];
+	if( c < 0 || (size_t)( c / edge ) >= _tile_extents[i] ) {
+	  return false;
+	}
+	tile = tile * _tile_extents[i] + c / edge;
+	offset = offset * edge + c % edge;
+      }
+      return true;
+    }
+
+    // Description:
+    // The lowest cell of a tile
+    marked_grid_cell_t _tile_base( size_t tile ) const
+    {
+      marked_grid_cell_t c = _tile_min_cell;
+      for( long i = (long)c.n - 1; i >= 0; --i ) {
+	c.coordinate[i] += ( tile % _tile_extents[i] ) * _header.tile_edge;
+	tile /= _tile_extents[i];
+      }
+      return c;
+    }
+
+    // Description:
+    // The presence flags and marks of a tile in the mapped file
+    // (only written through when the file is writable)
+    unsigned char* _tile_presence( const size_t tile ) const
+    {
+      return (unsigned char*)_file->data() + _layout.tiles + tile * _layout.tile_size;
+    }
+    T_Mark* _tile_marks( const size_t tile ) const
+    {
+      return (T_Mark*)( _tile_presence( tile ) + _layout.tile_presence_size );
+    }
+  };
+
+  //====================================================================
+
+}
+
+#endif
+
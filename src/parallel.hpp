@@ -0,0 +1,88 @@
+
+#if !defined( __POINT_PROCESS_CORE_PARALLEL_HPP__ )
+#define __POINT_PROCESS_CORE_PARALLEL_HPP__
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <vector>
+#include <cstddef>
+
+namespace point_process_core {
+
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Returns the number of threads to use when num_threads is 0
+  // (the hardware concurrency, or 1 if that is unknown)
+  inline
+  size_t default_num_threads( const size_t num_threads = 0 )
+  {
+    if( num_threads > 0 ) {
+      return num_threads;
+    }
+    size_t hw = std::thread::hardware_concurrency();
+    return hw > 0 ? hw : 1;
+  }
+
+  //-------------------------------------------------------------------------
+
+  // Description:
+  // Calls f( i ) for every i in [0, n) using a pool of up to
+  // num_threads threads (0 means the hardware concurrency).
+  // Indices are handed out one at a time so uneven work is balanced.
+  // The first exception thrown by f is rethrown once all the
+  // threads have finished.
+  template<class F>
+  void parallel_for( const size_t n, F f, const size_t num_threads = 0 )
+  {
+    size_t threads = default_num_threads( num_threads );
+    if( threads > n ) {
+      threads = n;
+    }
+
+    // no need for any threads
+    if( threads <= 1 ) {
+      for( size_t i = 0; i < n; ++i ) {
+	f( i );
+      }
+      return;
+    }
+
+    std::atomic<size_t> next( 0 );
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&]() {
+      try {
+	for( size_t i = next++; i < n; i = next++ ) {
+	  f( i );
+	}
+      } catch( ... ) {
+	std::lock_guard<std::mutex> lock( error_mutex );
+	if( !error ) {
+	  error = std::current_exception();
+	}
+	next = n;
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for( size_t t = 0; t < threads; ++t ) {
+      pool.push_back( std::thread( worker ) );
+    }
+    for( size_t t = 0; t < pool.size(); ++t ) {
+      pool[t].join();
+    }
+    if( error ) {
+      std::rethrow_exception( error );
+    }
+  }
+
+  //-------------------------------------------------------------------------
+
+}
+
+#endif
+
@@ -1,23 +1,158 @@
 
 #include "point_math.hpp"
 #include <math-core/geom.hpp>
+#include <math-core/matrix.hpp>
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
 
 
 namespace point_process_core {
 
 
+  //=======================================================================
+
+  // Description:
+  // Sums a contiguous array with independent partial sums so the
+  // compiler can keep several lanes in flight
+  static double sum_of( const double* x, const size_t n )
+  {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for( ; i + 4 <= n; i += 4 ) {
+      s0 += x[i];
+      s1 += x[i+1];
+      s2 += x[i+2];
+      s3 += x[i+3];
+    }
+    for( ; i < n; ++i ) {
+      s0 += x[i];
+    }
+    return ( s0 + s1 ) + ( s2 + s3 );
+  }
+
+  //=======================================================================
+
+  // Description:
+  // Sums ( x - mx ) * ( y - my ) over two contiguous arrays
+  static double sum_of_products( const double* x, const double mx,
+				 const double* y, const double my,
+				 const size_t n )
+  {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for( ; i + 4 <= n; i += 4 ) {
+      s0 += ( x[i] - mx ) * ( y[i] - my );
+      s1 += ( x[i+1] - mx ) * ( y[i+1] - my );
+      s2 += ( x[i+2] - mx ) * ( y[i+2] - my );
+      s3 += ( x[i+3] - mx ) * ( y[i+3] - my );
+    }
+    for( ; i < n; ++i ) {
+      s0 += ( x[i] - mx ) * ( y[i] - my );
+    }
+    return ( s0 + s1 ) + ( s2 + s3 );
+  }
+
+  //=======================================================================
+
+  soa_point_set_t::soa_point_set_t( const std::vector<nd_point_t>& points )
+  {
+    if( points.empty() ) {
+      return;
+    }
+    _coordinates.resize( points[0].n );
+    reserve( points.size() );
+    for( size_t i = 0; i < points.size(); ++i ) {
+      push_back( points[i] );
+    }
+  }
+
+  //=======================================================================
+
+  nd_point_t soa_point_set_t::point( const size_t i ) const
+  {
+    nd_point_t p;
+    p.n = dimension();
+    p.coordinate.resize( p.n );
+    for( size_t dim = 0; dim < dimension(); ++dim ) {
+      p.coordinate[dim] = _coordinates[dim][i];
+    }
+    return p;
+  }
+
+  //=======================================================================
+
+  void soa_point_set_t::push_back( const nd_point_t& p )
+  {
+    if( _coordinates.empty() ) {
+      _coordinates.resize( p.n );
+    }
+    assert( (size_t)p.n == dimension() );
+    for( size_t dim = 0; dim < dimension(); ++dim ) {
+      _coordinates[dim].push_back( p.coordinate[dim] );
+    }
+  }
+
+  //=======================================================================
+
+  void soa_point_set_t::resize( const size_t size )
+  {
+    for( size_t dim = 0; dim < dimension(); ++dim ) {
+      _coordinates[dim].resize( size, 0.0 );
+    }
+  }
+
+  void soa_point_set_t::reserve( const size_t size )
+  {
+    for( size_t dim = 0; dim < dimension(); ++dim ) {
+      _coordinates[dim].reserve( size );
+    }
+  }
+
+  void soa_point_set_t::clear()
+  {
+    for( size_t dim = 0; dim < dimension(); ++dim ) {
+      _coordinates[dim].clear();
+    }
+  }
+
   //=======================================================================
 
   nd_point_t mean( const std::vector<nd_point_t>& points ) 
+  {
+    return mean( point_vector_view_t( points ) );
+  }
+
+  nd_point_t mean( const soa_point_set_t& points )
   {
     nd_point_t m;
-    m.n = points[0].n;
+    m.n = points.dimension();
     m.coordinate = std::vector<double>( m.n );
+    if( points.empty() ) {
+      return m;
+    }
+    
+    // just take average along each coordinate
+    for( size_t dim = 0; (long)dim < m.n; ++dim ) {
+      m.coordinate[dim] = sum_of( points.coordinates( dim ), points.size() ) / points.size();
+    }
+    
+    return m;
+  }
+
+  nd_point_t mean( const point_vector_view_t& points )
+  {
+    nd_point_t m;
+    m.n = points.dimension();
+    m.coordinate = std::vector<double>( m.n );
+    if( points.empty() ) {
+      return m;
+    }
     
     // just take average along each coordinate
     for( size_t i = 0; i < points.size(); ++i ) {
       for( size_t dim = 0; (long)dim < m.n; ++dim ) {
-	m.coordinate[dim] += points[i].coordinate[dim];
+	m.coordinate[dim] += points( i, dim );
       }
     }
     for( size_t dim = 0; (long)dim < m.n; ++dim ) {
@@ -31,15 +166,289 @@ namespace point_process_core {
 
   double variance( const std::vector<nd_point_t>& points )
   {
+    return variance( point_vector_view_t( points ) );
+  }
+
+  double variance( const soa_point_set_t& points )
+  {
+    if( points.empty() ) {
+      return 0.0;
+    }
+    nd_point_t mean_p = mean( points );
+    double sum = 0.0;
+    for( size_t dim = 0; dim < points.dimension(); ++dim ) {
+      const double* x = points.coordinates( dim );
+      sum += sum_of_products( x, mean_p.coordinate[dim],
+			      x, mean_p.coordinate[dim],
+			      points.size() );
+    }
+    return sum / points.size();
+  }
+
+  double variance( const point_vector_view_t& points )
+  {
+    if( points.empty() ) {
+      return 0.0;
+    }
     nd_point_t mean_p = mean( points );
     double sum = 0.0;
     for( size_t i = 0; i < points.size(); ++i ) {
-      double diff = magnitude( points[i] - mean_p );
-      sum += (diff * diff);
+      for( size_t dim = 0; dim < points.dimension(); ++dim ) {
+	double diff = points( i, dim ) - mean_p.coordinate[dim];
+	sum += (diff * diff);
+      }
     }
     return sum / points.size();
   }
 
+  //=======================================================================
+
+  dense_matrix_t covariance( const std::vector<nd_point_t>& points )
+  {
+    return covariance( point_vector_view_t( points ) );
+  }
+
+  dense_matrix_t covariance( const soa_point_set_t& points )
+  {
+    size_t dim = points.dimension();
+    Eigen::MatrixXd cov = Eigen::MatrixXd::Zero( dim, dim );
+    if( points.empty() ) {
+      return to_dense_mat( cov );
+    }
+    nd_point_t m = mean( points );
+    for( size_t a = 0; a < dim; ++a ) {
+      for( size_t b = a; b < dim; ++b ) {
+	cov(a,b) = sum_of_products( points.coordinates( a ), m.coordinate[a],
+				    points.coordinates( b ), m.coordinate[b],
+				    points.size() ) / points.size();
+	cov(b,a) = cov(a,b);
+      }
+    }
+    return to_dense_mat( cov );
+  }
+
+  dense_matrix_t covariance( const point_vector_view_t& points )
+  {
+    size_t dim = points.dimension();
+    Eigen::MatrixXd cov = Eigen::MatrixXd::Zero( dim, dim );
+    if( points.empty() ) {
+      return to_dense_mat( cov );
+    }
+    nd_point_t m = mean( points );
+    for( size_t i = 0; i < points.size(); ++i ) {
+      for( size_t a = 0; a < dim; ++a ) {
+	double da = points( i, a ) - m.coordinate[a];
+	for( size_t b = a; b < dim; ++b ) {
+	  cov(a,b) += da * ( points( i, b ) - m.coordinate[b] );
+	}
+      }
+    }
+    for( size_t a = 0; a < dim; ++a ) {
+      for( size_t b = a; b < dim; ++b ) {
+	cov(a,b) /= points.size();
+	cov(b,a) = cov(a,b);
+      }
+    }
+    return to_dense_mat( cov );
+  }
+
+  //=======================================================================
+
+  point_statistics_t::point_statistics_t( const size_t dimension,
+					  const bool track_covariance )
+    : _count( 0 ),
+      _track_covariance( track_covariance )
+  {
+    _init( dimension );
+  }
+
+  void point_statistics_t::_init( const size_t dimension )
+  {
+    _mean.assign( dimension, 0.0 );
+    _m2.assign( dimension, 0.0 );
+    _comoment.assign( _track_covariance ? dimension * dimension : 0, 0.0 );
+    _deviation.resize( dimension );
+  }
+
+  void point_statistics_t::add( const nd_point_t& p )
+  {
+    if( _count == 0 && dimension() == 0 ) {
+      _init( p.n );
+    }
+    assert( (long)dimension() == p.n );
+    const size_t dim = dimension();
+    ++_count;
+
+    // deviations from the old and the new mean
+    std::vector<double>& before = _deviation;
+    for( size_t a = 0; a < dim; ++a ) {
+      before[a] = p.coordinate[a] - _mean[a];
+      _mean[a] += before[a] / _count;
+      _m2[a] += before[a] * ( p.coordinate[a] - _mean[a] );
+    }
+    if( _track_covariance ) {
+      for( size_t a = 0; a < dim; ++a ) {
+	for( size_t b = 0; b < dim; ++b ) {
+	  _comoment[ a * dim + b ] += before[a] * ( p.coordinate[b] - _mean[b] );
+	}
+      }
+    }
+  }
+
+  void point_statistics_t::remove( const nd_point_t& p )
+  {
+    assert( _count > 0 );
+    assert( (long)dimension() == p.n );
+    if( _count == 1 ) {
+      _count = 0;
+      _init( dimension() );
+      return;
+    }
+    const size_t dim = dimension();
+
+    // undo add(): the same deviations from the mean without the point
+    // and the mean with it
+    std::vector<double>& after = _deviation;
+    for( size_t a = 0; a < dim; ++a ) {
+      after[a] = p.coordinate[a] - _mean[a];
+      _mean[a] = ( _count * _mean[a] - p.coordinate[a] ) / ( _count - 1 );
+      _m2[a] -= ( p.coordinate[a] - _mean[a] ) * after[a];
+    }
+    if( _track_covariance ) {
+      for( size_t a = 0; a < dim; ++a ) {
+	for( size_t b = 0; b < dim; ++b ) {
+	  _comoment[ a * dim + b ] -= ( p.coordinate[a] - _mean[a] ) * after[b];
+	}
+      }
+    }
+    --_count;
+  }
+
+  void point_statistics_t::merge( const point_statistics_t& other )
+  {
+    if( other._count == 0 ) {
+      return;
+    }
+    assert( other._track_covariance || !_track_covariance );
+    if( _count == 0 ) {
+      assert( dimension() == 0 || dimension() == other.dimension() );
+      _init( other.dimension() );
+      _count = other._count;
+      _mean = other._mean;
+      _m2 = other._m2;
+      if( _track_covariance ) {
+	_comoment = other._comoment;
+      }
+      return;
+    }
+    assert( dimension() == other.dimension() );
+    const size_t dim = dimension();
+    const double n_a = _count;
+    const double n_b = other._count;
+    const double n = n_a + n_b;
+    std::vector<double>& delta = _deviation;
+    for( size_t a = 0; a < dim; ++a ) {
+      delta[a] = other._mean[a] - _mean[a];
+      _mean[a] += delta[a] * n_b / n;
+      _m2[a] += other._m2[a] + delta[a] * delta[a] * n_a * n_b / n;
+    }
+    if( _track_covariance ) {
+      for( size_t a = 0; a < dim; ++a ) {
+	for( size_t b = 0; b < dim; ++b ) {
+	  _comoment[ a * dim + b ] += other._comoment[ a * dim + b ]
+	    + delta[a] * delta[b] * n_a * n_b / n;
+	}
+      }
+    }
+    _count += other._count;
+  }
+
+  void point_statistics_t::clear()
+  {
+    _count = 0;
+    _init( dimension() );
+  }
+
+  nd_point_t point_statistics_t::mean() const
+  {
+    nd_point_t m;
+    m.n = dimension();
+    m.coordinate = _mean;
+    return m;
+  }
+
+  double point_statistics_t::variance() const
+  {
+    if( _count == 0 ) {
+      return 0.0;
+    }
+    double sum = 0.0;
+    for( size_t a = 0; a < dimension(); ++a ) {
+      sum += _m2[a];
+    }
+    return sum / _count;
+  }
+
+  dense_matrix_t point_statistics_t::covariance() const
+  {
+    if( !_track_covariance ) {
+      throw std::runtime_error( "point statistics do not track the covariance" );
+    }
+    const size_t dim = dimension();
+    Eigen::MatrixXd cov = Eigen::MatrixXd::Zero( dim, dim );
+    if( _count > 0 ) {
+      for( size_t a = 0; a < dim; ++a ) {
+	for( size_t b = 0; b < dim; ++b ) {
+	  cov(a,b) = _comoment[ a * dim + b ] / _count;
+	}
+      }
+    }
+    return to_dense_mat( cov );
+  }
+
+  //=======================================================================
+
+  nd_aabox_t bounding_box( const soa_point_set_t& points )
+  {
+    if( points.empty() ) {
+      return nd_aabox_t();
+    }
+    nd_point_t low = points.point( 0 );
+    nd_point_t high = low;
+    for( size_t dim = 0; dim < points.dimension(); ++dim ) {
+      const double* x = points.coordinates( dim );
+      double lo = x[0], hi = x[0];
+      for( size_t i = 1; i < points.size(); ++i ) {
+	lo = std::min( lo, x[i] );
+	hi = std::max( hi, x[i] );
+      }
+      low.coordinate[dim] = lo;
+      high.coordinate[dim] = hi;
+    }
+    return aabox( low, high );
+  }
+
+  nd_aabox_t bounding_box( const point_vector_view_t& points )
+  {
+    if( points.empty() ) {
+      return nd_aabox_t();
+    }
+    nd_point_t low;
+    low.n = points.dimension();
+    low.coordinate.resize( low.n );
+    for( size_t dim = 0; dim < points.dimension(); ++dim ) {
+      low.coordinate[dim] = points( 0, dim );
+    }
+    nd_point_t high = low;
+    for( size_t i = 1; i < points.size(); ++i ) {
+      for( size_t dim = 0; dim < points.dimension(); ++dim ) {
+	low.coordinate[dim] = std::min( low.coordinate[dim], points( i, dim ) );
+	high.coordinate[dim] = std::max( high.coordinate[dim], points( i, dim ) );
+      }
+    }
+    return aabox( low, high );
+  }
+
   //=======================================================================
   //=======================================================================
   //=======================================================================
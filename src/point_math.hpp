@@ -11,15 +11,191 @@ namespace point_process_core {
   using namespace math_core;
   using namespace probability_core;
 
+
+  // Description:
+  // A set of points stored as a structure of arrays: the
+  // coordinates of each dimension are kept in their own contiguous
+  // array, so kernels over a dimension are tight loops over memory.
+  class soa_point_set_t
+  {
+  public:
+
+    // Description:
+    // Creates an empty point set of dimension zero
+    soa_point_set_t()
+    {}
+
+    // Description:
+    // Creates a point set of the given dimension with size points
+    // (all at the origin)
+    soa_point_set_t( const size_t dimension, const size_t size = 0 )
+      : _coordinates( dimension, std::vector<double>( size, 0.0 ) )
+    {}
+
+    // Description:
+    // Creates a point set with a copy of the given points
+    explicit
+    soa_point_set_t( const std::vector<nd_point_t>& points );
+
+    size_t dimension() const { return _coordinates.size(); }
+    size_t size() const 
+    { return _coordinates.empty() ? 0 : _coordinates[0].size(); }
+    bool empty() const { return size() == 0; }
+
+    // Description:
+    // The contiguous coordinates along the given dimension
+    double* coordinates( const size_t dim ) 
+    { return _coordinates[dim].data(); }
+    const double* coordinates( const size_t dim ) const
+    { return _coordinates[dim].data(); }
+
+    // Description:
+    // The given coordinate of point i
+    double& operator() ( const size_t i, const size_t dim )
+    { return _coordinates[dim][i]; }
+    double operator() ( const size_t i, const size_t dim ) const
+    { return _coordinates[dim][i]; }
+
+    // Description:
+    // Returns point i
+    nd_point_t point( const size_t i ) const;
+
+    // Description:
+    // Adds a point (of the same dimension) to the set.
+    // The first point added to an empty set of dimension zero sets
+    // the dimension.
+    void push_back( const nd_point_t& p );
+
+    // Description:
+    // Changes the number of points (new ones are at the origin)
+    void resize( const size_t size );
+    void reserve( const size_t size );
+    void clear();
+
+  protected:
+
+    // Description:
+    // The coordinates, one array per dimension
+    std::vector<std::vector<double> > _coordinates;
+  };
+
+
+  // Description:
+  // A zero-copy view of a std::vector<nd_point_t> with the same
+  // accessors as soa_point_set_t, so the point set kernels can run
+  // directly over existing point vectors.
+  // The viewed vector must outlive the view.
+  class point_vector_view_t
+  {
+  public:
+    point_vector_view_t( const std::vector<nd_point_t>& points )
+      : _points( &points )
+    {}
+    size_t dimension() const 
+    { return _points->empty() ? 0 : (*_points)[0].n; }
+    size_t size() const { return _points->size(); }
+    bool empty() const { return _points->empty(); }
+    double operator() ( const size_t i, const size_t dim ) const
+    { return (*_points)[i].coordinate[dim]; }
+  protected:
+    const std::vector<nd_point_t>* _points;
+  };
+
+
+  // Description:
+  // Streaming statistics of a set of points: the count, mean and
+  // sums of squared deviations (Welford's updates), from which
+  // the mean, variance() and covariance() of the points follow.
+  // Points can be added and removed one at a time in O(d), and
+  // accumulators of disjoint sets merge exactly (Chan's update), so
+  // partial accumulators can be built in parallel.
+  // The full covariance costs O(d^2) per update and is only kept
+  // when asked for at construction.
+  class point_statistics_t
+  {
+  public:
+
+    // Description:
+    // Creates an empty accumulator for points of the given dimension
+    // (0 takes the dimension of the first point added)
+    point_statistics_t( const size_t dimension = 0,
+			const bool track_covariance = false );
+
+    // Description:
+    // Adds / removes a point.
+    // Removing a point which was not added gives meaningless results.
+    void add( const nd_point_t& p );
+    void remove( const nd_point_t& p );
+
+    // Description:
+    // Adds all of the points of another accumulator (which must
+    // track the covariance if this one does)
+    void merge( const point_statistics_t& other );
+
+    // Description:
+    // Removes all of the points
+    void clear();
+
+    size_t count() const { return _count; }
+    size_t dimension() const { return _mean.size(); }
+    bool tracks_covariance() const { return _track_covariance; }
+
+    // Description:
+    // The mean, variance and (population) covariance of the points,
+    // as mean(), variance() and covariance() of the point set.
+    // covariance() throws std::runtime_error if the covariance is
+    // not tracked.
+    nd_point_t mean() const;
+    double variance() const;
+    dense_matrix_t covariance() const;
+
+  protected:
+
+    // Description:
+    // The number of points, their mean and the sums of squared
+    // deviations from the mean per dimension (and per pair of
+    // dimensions, row major, when tracking the covariance)
+    size_t _count;
+    std::vector<double> _mean;
+    std::vector<double> _m2;
+    std::vector<double> _comoment;
+    bool _track_covariance;
+
+    // Description:
+    // Scratch space for the deviations from the mean of an update
+    std::vector<double> _deviation;
+
+    // Description:
+    // Sets the dimension
+    void _init( const size_t dimension );
+  };
+
+
   // Derwscription:
   // Take the mean of a set of points.
   // Uses eucledian distance
   nd_point_t mean( const std::vector<nd_point_t>& points );
+  nd_point_t mean( const soa_point_set_t& points );
+  nd_point_t mean( const point_vector_view_t& points );
   
   // Description:
   // Returns the variance of a set of points.
   // Uses eucledian distances
   double variance( const std::vector<nd_point_t>& points );
+  double variance( const soa_point_set_t& points );
+  double variance( const point_vector_view_t& points );
+
+  // Description:
+  // Returns the (population) covariance matrix of a set of points.
+  // The trace of the covariance is the variance().
+  dense_matrix_t covariance( const std::vector<nd_point_t>& points );
+  dense_matrix_t covariance( const soa_point_set_t& points );
+  dense_matrix_t covariance( const point_vector_view_t& points );
+
+  // Description:
+  // Returns the smallest box containing all the points
+  nd_aabox_t bounding_box( const soa_point_set_t& points );
+  nd_aabox_t bounding_box( const point_vector_view_t& points );
 
 
 }
@@ -7,7 +7,10 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <iostream>
 #include "histogram.hpp"
+#include "point_set_batch.hpp"
 #include <boost/any.hpp>
+#include <boost/optional.hpp>
+#include <algorithm>
 
 namespace point_process_core {
 
@@ -42,6 +45,22 @@ namespace point_process_core {
     virtual
     std::vector<math_core::nd_point_t>
     sample() const = 0;
+
+    // Description:
+    // Appends n point set samples from this process to the batch.
+    // The default just calls sample() n times and ignores
+    // num_mcmc_iterations_between_samples (a plain process has no
+    // state to move on); processes which have a state move it on
+    // between samples.
+    virtual
+    void sample_batch( const size_t n,
+		       point_set_batch_t& batch,
+		       const size_t num_mcmc_iterations_between_samples = 1 )
+    {
+      for( size_t i = 0; i < n; ++i ) {
+	batch.append( this->sample() );
+      }
+    }
     
     // Description:
     // Update with a new set of observations
@@ -116,6 +135,20 @@ namespace point_process_core {
     void trace_mcmc_off( ) = 0;
 
 
+    // Description:
+    // Reseeds the random state of this process and returns true, or
+    // returns false if the process cannot be reseeded (the default).
+    // Parallel chains call this on each clone so that the chains
+    // draw independent random streams, and refuse to run several
+    // chains of a process which returns false.
+    // Only processes whose random state belongs to the instance (not
+    // a generator shared between clones) should override this.
+    virtual
+    bool seed_rng( const unsigned long seed )
+    {
+      return false;
+    }
+
     // Description:
     // Runs a single step of MCMC sampling
     virtual
@@ -133,6 +166,31 @@ namespace point_process_core {
     }
     
 
+    // Description:
+    // Appends n samples to the batch, running the given number of
+    // mcmc iterations after each sample. Each sample is taken with
+    // sample_and_step() followed by mcmc() for the remaining
+    // iterations (or with sample() alone for zero iterations), so with
+    // one iteration this is exactly n calls to sample_and_step().
+    // Derived processes can specialise this to write samples straight
+    // into the batch.
+    virtual
+    void sample_batch( const size_t n,
+		       point_set_batch_t& batch,
+		       const size_t num_mcmc_iterations_between_samples = 1 )
+    {
+      for( size_t i = 0; i < n; ++i ) {
+	if( num_mcmc_iterations_between_samples == 0 ) {
+	  batch.append( this->sample() );
+	  continue;
+	}
+	batch.append( this->sample_and_step() );
+	if( num_mcmc_iterations_between_samples > 1 ) {
+	  this->mcmc( num_mcmc_iterations_between_samples - 1 );
+	}
+      }
+    }
+
     // Descripton:
     // Runs mcmc a number of iterations
     virtual
@@ -153,32 +211,37 @@ namespace point_process_core {
     // Optionally, you can specify the number of mcmc steps between samples
     // as well as the number of samples to use to compute the expected number
     // of points per grid region.
+    // Samples are drawn with sample_batch() either way; with tick set
+    // they are drawn one at a time and the progress is printed.
+    // The histogram uses the given storage, or the histogram_t
+    // default for the number of bins if none is given.
     virtual
     histogram_t<double>
     intensity_estimate( const math_core::nd_aabox_t& window,
 			const size_t bins_per_dimension,
 			const size_t num_samples_for_estimate = 1000,
 			const size_t num_mcmc_iterations_between_samples = 1,
-			const bool tick = false )
+			const bool tick = false,
+			const boost::optional<marked_grid_storage_t>& storage = boost::none )
     {
-      histogram_t<double> hist( window, bins_per_dimension );
-      for(size_t sample_i = 0; sample_i < num_samples_for_estimate; ++sample_i){
-	std::vector<math_core::nd_point_t> sample = this->sample();
-	for( math_core::nd_point_t p : sample ) {
-	  hist.increment_bin( p );
-	}
-	this->mcmc( num_mcmc_iterations_between_samples, tick );
+      histogram_t<double> hist = storage
+	? histogram_t<double>( window, bins_per_dimension, *storage )
+	: histogram_t<double>( window, bins_per_dimension );
+      point_set_batch_t batch;
+      const size_t batch_size = tick ? 1 : 64;
+      for(size_t sample_i = 0; sample_i < num_samples_for_estimate; sample_i += batch_size){
+	batch.clear();
+	this->sample_batch( std::min( batch_size, num_samples_for_estimate - sample_i ),
+			    batch,
+			    num_mcmc_iterations_between_samples );
+	hist.increment_bins( batch );
 	if( tick ) {
 	  std::cout << "[" << sample_i << "/" << num_samples_for_estimate << "]" << std::endl;
 	}
       }
       // normalize the counts by the numbr of samples to get
       // average intensity
-      for( auto cell : hist.all_cells() ) {
-	if( hist(cell) ) {
-	  hist.set( cell, *hist(cell) / (double)num_samples_for_estimate );
-	}
-      }
+      hist.scale( 1.0 / (double)num_samples_for_estimate );
       return hist;
     }
 
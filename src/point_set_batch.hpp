@@ -0,0 +1,84 @@
+
+#if !defined( __POINT_PROCESS_CORE_POINT_SET_BATCH_HPP__ )
+#define __POINT_PROCESS_CORE_POINT_SET_BATCH_HPP__
+
+#include <math-core/types.hpp>
+#include <vector>
+#include <cassert>
+
+namespace point_process_core {
+
+  // Description:
+  // A batch of point sets stored in one flat buffer.
+  // The coordinates of all the points of all the point sets are
+  // stored contiguously, point after point, and point set i is made
+  // of points [ offsets[i], offsets[i+1] ).
+  // Clearing a batch keeps its capacity so a batch can be refilled
+  // without allocating.
+  struct point_set_batch_t
+  {
+    size_t dimension;
+    std::vector<double> coordinates;
+    std::vector<size_t> offsets;
+
+    point_set_batch_t()
+      : dimension( 0 ),
+	offsets( 1, 0 )
+    {}
+
+    // Description:
+    // Returns the number of point sets in this batch
+    size_t size() const { return offsets.size() - 1; }
+
+    // Description:
+    // Returns the total number of points in this batch
+    size_t num_points() const { return offsets.back(); }
+
+    // Description:
+    // Returns the coordinates of the given point (out of all points)
+    const double* point( const size_t p ) const 
+    { return &coordinates[ p * dimension ]; }
+
+    // Description:
+    // Removes all point sets (but keeps the memory)
+    void clear()
+    {
+      coordinates.clear();
+      offsets.resize( 1 );
+    }
+
+    // Description:
+    // Appends a point set to this batch
+    void append( const std::vector<math_core::nd_point_t>& points )
+    {
+      if( dimension == 0 && points.empty() == false ) {
+	dimension = points[0].n;
+      }
+      for( size_t i = 0; i < points.size(); ++i ) {
+	assert( (size_t)points[i].n == dimension );
+	coordinates.insert( coordinates.end(),
+			    points[i].coordinate.begin(),
+			    points[i].coordinate.end() );
+      }
+      offsets.push_back( offsets.back() + points.size() );
+    }
+
+    // Description:
+    // Returns point set i as a vector of points
+    std::vector<math_core::nd_point_t> point_set( const size_t i ) const
+    {
+      std::vector<math_core::nd_point_t> points;
+      for( size_t p = offsets[i]; p < offsets[i+1]; ++p ) {
+	math_core::nd_point_t x;
+	x.n = dimension;
+	x.coordinate.assign( point( p ), point( p ) + dimension );
+	points.push_back( x );
+      }
+      return points;
+    }
+  };
+
+}
+
+#endif
+
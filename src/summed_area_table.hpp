@@ -0,0 +1,269 @@
+
+#if !defined( __POINT_PROCESS_CORE_SUMMED_AREA_TABLE_HPP__ )
+#define __POINT_PROCESS_CORE_SUMMED_AREA_TABLE_HPP__
+
+#include "histogram.hpp"
+#include <vector>
+#include <utility>
+
+
+namespace point_process_core {
+
+
+  // Description:
+  // A summed-area table (n-dimensional prefix sums) of the counts
+  // of a histogram over the cells of its window.
+  // The sum of any box of cells is answered from the 2^d corners of
+  // the box. Changes to single bins are kept as pending deltas
+  // which queries add in, and are folded into the table once there
+  // are more than the rebuild threshold of them.
+  // Counts of cells outside of the histogram window are ignored.
+  template<typename T>
+  class summed_area_table_t
+  {
+  public:
+
+    // Description:
+    // Builds the table for the given histogram
+    summed_area_table_t( const histogram_t<T>& hist,
+			 const size_t rebuild_threshold = 64 )
+      : _layout( hist.window(), hist.origin(), hist.cell_sizes() ),
+	_cells( hist.cells() ),
+	_rebuild_threshold( rebuild_threshold )
+    {
+      _init_layout();
+      if( _prefix.empty() ) {
+	return;
+      }
+      hist.for_each_mark( [this]( const marked_grid_cell_t& cell,
+				  const T& count ) {
+			    if( _cells.contains( cell ) ) {
+			      _prefix[ _padded_index( cell, 1 ) ] += count;
+			    }
+			  } );
+      _accumulate( _prefix );
+    }
+
+    // Description:
+    // The sum of the counts of the cells in the given range
+    // (clamped to the histogram window)
+    T sum( const marked_grid_cell_range_t& range ) const
+    {
+      marked_grid_cell_t lo, hi;
+      if( !_clamp( range, lo, hi ) ) {
+	return T(0);
+      }
+
+      // inclusion-exclusion over the corners of the box
+      const size_t n = lo.n;
+      T total = T(0);
+      for( size_t corner = 0; corner < ( (size_t)1 << n ); ++corner ) {
+	size_t index = 0;
+	size_t num_low = 0;
+	for( size_t i = 0; i < n; ++i ) {
+	  long c;
+	  if( corner & ( (size_t)1 << i ) ) {
+	    c = hi.coordinate[i] - _cells.min_cell().coordinate[i] + 1;
+	  } else {
+	    c = lo.coordinate[i] - _cells.min_cell().coordinate[i];
+	    ++num_low;
+	  }
+	  index += c * _strides[i];
+	}
+	if( num_low % 2 == 0 ) {
+	  total += _prefix[ index ];
+	} else {
+	  total -= _prefix[ index ];
+	}
+      }
+
+      // plus the changes not yet folded into the table
+      marked_grid_cell_range_t box( lo, hi );
+      for( size_t i = 0; i < _pending.size(); ++i ) {
+	if( box.contains( _pending[i].first ) ) {
+	  total += _pending[i].second;
+	}
+      }
+      return total;
+    }
+
+    // Description:
+    // The sum of the counts of the cells fully inside the window
+    T sum( const math_core::nd_aabox_t& window ) const
+    {
+      return sum( cell_range_fully_inside_window( _layout, window ) );
+    }
+
+    // Description:
+    // The sum of all of the counts (in the histogram window)
+    T total() const
+    {
+      return sum( _cells );
+    }
+
+    // Description:
+    // The count of a single cell
+    T value( const marked_grid_cell_t& cell ) const
+    {
+      return sum( marked_grid_cell_range_t( cell, cell ) );
+    }
+
+    // Description:
+    // Adds to the count of a cell (as histogram_t::increment_bin)
+    void add( const marked_grid_cell_t& cell, const T& delta )
+    {
+      if( !_cells.contains( cell ) ) {
+	return;
+      }
+      _pending.push_back( std::make_pair( cell, delta ) );
+      if( _pending.size() > _rebuild_threshold ) {
+	rebuild();
+      }
+    }
+    void add( const math_core::nd_point_t& point, const T& delta )
+    {
+      add( _layout.cell( point ), delta );
+    }
+
+    // Description:
+    // Sets the count of a cell (as histogram_t::set)
+    void set( const marked_grid_cell_t& cell, const T& count )
+    {
+      add( cell, count - value( cell ) );
+    }
+
+    // Description:
+    // Folds the pending changes into the table
+    void rebuild()
+    {
+      if( _pending.empty() ) {
+	return;
+      }
+      std::vector<T> deltas( _prefix.size(), T(0) );
+      for( size_t i = 0; i < _pending.size(); ++i ) {
+	deltas[ _padded_index( _pending[i].first, 1 ) ] += _pending[i].second;
+      }
+      _pending.clear();
+      _accumulate( deltas );
+      for( size_t i = 0; i < _prefix.size(); ++i ) {
+	_prefix[i] += deltas[i];
+      }
+    }
+
+    // Description:
+    // The number of changes not yet folded into the table
+    size_t num_pending() const
+    {
+      return _pending.size();
+    }
+
+    // Description:
+    // The cells covered by the table
+    const marked_grid_cell_range_t& cells() const
+    {
+      return _cells;
+    }
+
+  protected:
+
+    // Description:
+    // An empty grid with the geometry of the histogram
+    marked_grid_t<char> _layout;
+
+    // Description:
+    // The cells of the histogram window
+    marked_grid_cell_range_t _cells;
+
+    // Description:
+    // The prefix sums over a box padded with one leading layer of
+    // zeros along each dimension (so entry c+1 holds the sum of the
+    // cells up to c) and the strides of the box, last dimension
+    // contiguous
+    std::vector<T> _prefix;
+    std::vector<size_t> _strides;
+
+    // Description:
+    // Changes not yet folded into the prefix sums
+    std::vector<std::pair<marked_grid_cell_t, T> > _pending;
+    size_t _rebuild_threshold;
+
+    // Description:
+    // Lays out the padded box
+    void _init_layout()
+    {
+      if( _cells.empty() ) {
+	return;
+      }
+      const size_t n = _cells.min_cell().n;
+      _strides.resize( n );
+      size_t size = 1;
+      for( long i = (long)n - 1; i >= 0; --i ) {
+	_strides[i] = size;
+	size *= _cells.max_cell().coordinate[i] - _cells.min_cell().coordinate[i] + 2;
+      }
+      _prefix.assign( size, T(0) );
+    }
+
+    // Description:
+    // The index in the padded box of a cell, shifted by the given
+    // amount along every dimension
+    size_t _padded_index( const marked_grid_cell_t& cell,
+			  const long shift ) const
+    {
+      size_t index = 0;
+      for( size_t i = 0; i < cell.n; ++i ) {
+	index += ( cell.coordinate[i] - _cells.min_cell().coordinate[i] + shift ) * _strides[i];
+      }
+      return index;
+    }
+
+    // Description:
+    // Turns per-cell values in the padded box into prefix sums with
+    // a running sum along each dimension in turn
+    void _accumulate( std::vector<T>& values ) const
+    {
+      const size_t n = _strides.size();
+      for( size_t d = 0; d < n; ++d ) {
+	const size_t stride = _strides[d];
+	const size_t extent = ( d == 0 ? values.size() : _strides[d-1] ) / stride;
+	const size_t block = stride * extent;
+	for( size_t base = 0; base < values.size(); base += block ) {
+	  for( size_t k = 1; k < extent; ++k ) {
+	    T* row = &values[ base + k * stride ];
+	    const T* prev = row - stride;
+	    for( size_t j = 0; j < stride; ++j ) {
+	      row[j] += prev[j];
+	    }
+	  }
+	}
+      }
+    }
+
+    // Description:
+    // Clamps a range to the cells of the table.
+    // Returns false if nothing is left
+    bool _clamp( const marked_grid_cell_range_t& range,
+		 marked_grid_cell_t& lo,
+		 marked_grid_cell_t& hi ) const
+    {
+      if( range.empty() || _prefix.empty() ||
+	  range.min_cell().n != _cells.min_cell().n ) {
+	return false;
+      }
+      lo = range.min_cell();
+      hi = range.max_cell();
+      for( size_t i = 0; i < lo.n; ++i ) {
+	lo.coordinate[i] = std::max( lo.coordinate[i], _cells.min_cell().coordinate[i] );
+	hi.coordinate[i] = std::min( hi.coordinate[i], _cells.max_cell().coordinate[i] );
+	if( hi.coordinate[i] < lo.coordinate[i] ) {
+	  return false;
+	}
+      }
+      return true;
+    }
+  };
+
+}
+
+#endif
+
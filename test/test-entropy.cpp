@@ -0,0 +1,121 @@
+
+#define BOOST_TEST_MODULE entropy
+#include <boost/test/included/unit_test.hpp>
+
+#include <point-process-core/entropy.hpp>
+#include <math-core/geom.hpp>
+#include <cmath>
+
+using namespace math_core;
+using namespace point_process_core;
+
+
+BOOST_AUTO_TEST_SUITE( test_suite_entropy )
+
+
+// a fixture with a few distinct grids over [0,10] with unit cells,
+// grid k having a single point in cell k
+struct fixture_distinct_grids
+{
+  fixture_distinct_grids()
+  {
+    window.n = 1;
+    window.start = point( 0.0 );
+    window.end = point( 10.0 );
+    for( int k = 0; k < 4; ++k ) {
+      std::vector<nd_point_t> points( 1, point( k + 0.5 ) );
+      grids.push_back( point_set_count_grid( points, window, 1.0 ) );
+    }
+  }
+  nd_aabox_t window;
+  std::vector<marked_grid_t<size_t> > grids;
+};
+
+
+BOOST_FIXTURE_TEST_CASE( entropy_chain_standard_error, fixture_distinct_grids )
+{
+  // the same counts of two grids, seen in alternation or in long runs
+  online_entropy_estimator_t alternating( window, 1.0 );
+  online_entropy_estimator_t sticky( window, 1.0 );
+  for( size_t i = 0; i < 400; ++i ) {
+    alternating.add_grid( grids[ i % 4 == 0 ? 0 : 1 ] );
+    sticky.add_grid( grids[ ( i / 20 ) % 4 == 0 ? 0 : 1 ] );
+  }
+  BOOST_CHECK_CLOSE( alternating.plugin_entropy(), sticky.plugin_entropy(), 1e-8 );
+  BOOST_CHECK_CLOSE( alternating.standard_error(), sticky.standard_error(), 1e-8 );
+  BOOST_CHECK( alternating.standard_error() > 0 );
+
+  // the runs are strongly correlated, the alternation is not
+  BOOST_CHECK( sticky.effective_sample_size() < 100 );
+  BOOST_CHECK( sticky.chain_standard_error() > 2 * sticky.standard_error() );
+  BOOST_CHECK_CLOSE( alternating.chain_standard_error(),
+		     alternating.standard_error(), 1e-8 );
+
+  // so the runs need a looser target precision to converge
+  entropy_estimator_parameters_t params;
+  params.target_precision = 0.05;
+  params.confidence_z = 1.0;
+  BOOST_CHECK( alternating.converged( params ) );
+  BOOST_CHECK( !sticky.converged( params ) );
+}
+
+BOOST_FIXTURE_TEST_CASE( entropy_online_matches_table, fixture_distinct_grids )
+{
+  online_entropy_estimator_t estimator( window, 1.0 );
+  grid_signature_table_t table;
+  for( size_t i = 0; i < 30; ++i ) {
+    estimator.add_grid( grids[ ( i * i ) % 4 ] );
+    table.add( grids[ ( i * i ) % 4 ] );
+    BOOST_CHECK_EQUAL( table.last_added_index(), ( i * i ) % 4 == 0 ? 0 : 1 );
+  }
+  BOOST_CHECK_EQUAL( estimator.num_distinct(), 2 );
+  BOOST_CHECK_CLOSE( estimator.plugin_entropy(), table.entropy(), 1e-8 );
+}
+
+
+BOOST_FIXTURE_TEST_CASE( entropy_fingerprint_table, fixture_distinct_grids )
+{
+  // equal grids have equal fingerprints whatever their storage
+  marked_grid_t<size_t> dense( window, 1.0, MARKED_GRID_DENSE_STORAGE );
+  dense.set( point( 2.5 ), 1 );
+  BOOST_CHECK( dense == grids[2] );
+  BOOST_CHECK_EQUAL( marked_grid_fingerprint( dense ),
+		     marked_grid_fingerprint( grids[2] ) );
+  BOOST_CHECK( marked_grid_fingerprint( grids[0] ) != marked_grid_fingerprint( grids[1] ) );
+
+  // counts are kept per distinct grid
+  grid_signature_table_t table;
+  BOOST_CHECK_EQUAL( table.add( grids[0] ), 1 );
+  BOOST_CHECK_EQUAL( table.add( grids[1], 2 ), 2 );
+  BOOST_CHECK_EQUAL( table.add( dense ), 1 );
+  BOOST_CHECK_EQUAL( table.add( grids[2] ), 2 );
+  BOOST_CHECK_EQUAL( table.num_samples(), 5 );
+  BOOST_CHECK_EQUAL( table.num_distinct(), 3 );
+  BOOST_CHECK_CLOSE( table.entropy(),
+		     -( 0.2 * log( 0.2 ) + 0.8 * log( 0.4 ) ), 1e-8 );
+
+  // grids whose fingerprints collide are still told apart
+  grid_signature_table_t colliding;
+  colliding.add( grids[0], 42, 1 );
+  colliding.add( grids[1], 42, 1 );
+  BOOST_CHECK_EQUAL( colliding.add( grids[0], 42, 1 ), 2 );
+  BOOST_CHECK_EQUAL( colliding.num_distinct(), 2 );
+
+  // merging and the concurrent table give the same counts
+  grid_signature_table_t merged;
+  merged.merge( table );
+  merged.merge( table );
+  BOOST_CHECK_EQUAL( merged.num_samples(), 10 );
+  BOOST_CHECK_EQUAL( merged.num_distinct(), 3 );
+  BOOST_CHECK_CLOSE( merged.entropy(), table.entropy(), 1e-8 );
+  concurrent_grid_signature_table_t concurrent( 2 );
+  concurrent.add( grids[0] );
+  concurrent.add( grids[1], 2 );
+  concurrent.add( grids[2], 2 );
+  BOOST_CHECK_EQUAL( concurrent.num_samples(), 5 );
+  BOOST_CHECK_CLOSE( concurrent.entropy(), table.entropy(), 1e-8 );
+  BOOST_CHECK_EQUAL( concurrent.merged().num_distinct(), 3 );
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,202 @@
+
+#define BOOST_TEST_MODULE gaussian_point_process_utils
+#include <boost/test/included/unit_test.hpp>
+
+#include <point-process-core/gaussian_point_process_utils.hpp>
+#include <math-core/matrix.hpp>
+#include <math-core/geom.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+using namespace math_core;
+using namespace probability_core;
+using namespace point_process_core;
+
+
+BOOST_AUTO_TEST_SUITE( test_suite_gaussian_point_process_utils )
+
+
+// a fixture with a 2D cluster: a few points, two negative regions,
+// a correlated likelihood covariance and a grid of means to
+// evaluate the posterior at
+struct fixture_cluster
+{
+  fixture_cluster()
+  {
+    points.push_back( point( 0.2, 0.3 ) );
+    points.push_back( point( 0.5, -0.1 ) );
+    points.push_back( point( 0.1, 0.1 ) );
+    negative_observations.push_back( aabox( point( -1.0, -1.0 ), point( 0.0, 0.0 ) ) );
+    negative_observations.push_back( aabox( point( 0.5, 0.5 ), point( 1.5, 2.0 ) ) );
+    Eigen::MatrixXd cov( 2, 2 );
+    cov << 0.3, 0.05, 0.05, 0.2;
+    covariance = to_dense_mat( cov );
+    prior.dimension = 2;
+    prior.means = std::vector<double>( 2, 0.0 );
+    prior.covariance = to_dense_mat( Eigen::MatrixXd::Identity( 2, 2 ) );
+    num_distribution.lambda = 3.0;
+    mus = soa_point_set_t( 2 );
+    for( int i = 0; i < 11; ++i ) {
+      for( int j = 0; j < 9; ++j ) {
+	mus.push_back( point( -2.0 + 0.4 * i, -1.5 + 0.4 * j ) );
+      }
+    }
+  }
+  std::vector<nd_point_t> points;
+  std::vector<nd_aabox_t> negative_observations;
+  dense_matrix_t covariance;
+  gaussian_distribution_t prior;
+  poisson_distribution_t num_distribution;
+  soa_point_set_t mus;
+};
+
+
+BOOST_AUTO_TEST_CASE( gaussian_utils_fast_erfc_accuracy )
+{
+  // the fractional error stays below 1.2e-7 in both tails
+  double max_error = 0;
+  for( int i = -1000; i <= 1000; ++i ) {
+    const double x = 0.009 * i;
+    const double expected = gsl_sf_erfc( x );
+    max_error = std::max( max_error,
+			  std::fabs( fast_erfc( x ) - expected ) / expected );
+  }
+  BOOST_CHECK( max_error < 1.2e-7 );
+  BOOST_CHECK_CLOSE( fast_erfc( 0.0 ), 1.0, 1.2e-5 );
+  BOOST_CHECK_CLOSE( fast_erfc( -0.5 ) + fast_erfc( 0.5 ), 2.0, 1e-12 );
+}
+
+BOOST_FIXTURE_TEST_CASE( gaussian_utils_batched_negative_likelihood, fixture_cluster )
+{
+  // the batched likelihood (fast_erfc) agrees with the single
+  // point one (gsl_sf_erfc) to the accuracy of fast_erfc
+  negative_observation_likelihood_for_mean_t lik( negative_observations[1],
+						  covariance,
+						  num_distribution.lambda );
+  std::vector<double> log_lik;
+  lik.log_likelihood( mus, log_lik );
+  BOOST_REQUIRE_EQUAL( log_lik.size(), mus.size() );
+  for( size_t k = 0; k < mus.size(); ++k ) {
+    BOOST_CHECK_SMALL( log_lik[k] - lik.log_likelihood( mus.point( k ) ), 1e-6 );
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE( gaussian_utils_conjugate_posterior, fixture_cluster )
+{
+  Eigen::MatrixXd prior_cov( 2, 2 );
+  prior_cov << 1.0, 0.1, 0.1, 2.0;
+  prior.means[0] = 0.5;
+  prior.means[1] = -1.0;
+  prior.covariance = to_dense_mat( prior_cov );
+  gaussian_mean_conjugate_posterior_t conjugate( covariance, prior );
+
+  // the textbook posterior with explicit inverses, for every count
+  Eigen::MatrixXd precision = to_eigen_mat( covariance ).inverse();
+  Eigen::MatrixXd prior_precision = prior_cov.inverse();
+  Eigen::VectorXd sum = Eigen::VectorXd::Zero( 2 );
+  for( size_t n = 0; n <= points.size(); ++n ) {
+    Eigen::MatrixXd cov = ( precision * (double)n + prior_precision ).inverse();
+    Eigen::VectorXd mean = cov * ( precision * sum + prior_precision * to_eigen_mat( prior.means ) );
+    BOOST_CHECK_EQUAL( conjugate.num_points(), n );
+    BOOST_CHECK_SMALL( ( conjugate.posterior_covariance() - cov ).norm(), 1e-12 );
+    BOOST_CHECK_SMALL( ( conjugate.posterior_mean() - mean ).norm(), 1e-12 );
+    if( n < points.size() ) {
+      conjugate.add_point( points[n] );
+      sum += to_eigen_mat( points[n].coordinate );
+    }
+  }
+
+  // removing a point undoes adding it
+  Eigen::VectorXd mean = conjugate.posterior_mean();
+  conjugate.add_point( point( 3.0, 3.0 ) );
+  BOOST_CHECK( ( conjugate.posterior_mean() - mean ).norm() > 0.1 );
+  conjugate.remove_point( point( 3.0, 3.0 ) );
+  BOOST_CHECK_SMALL( ( conjugate.posterior_mean() - mean ).norm(), 1e-12 );
+  gaussian_distribution_t dist = conjugate.posterior();
+  BOOST_CHECK_EQUAL( dist.means.size(), 2 );
+  BOOST_CHECK_CLOSE( dist.means[1], mean(1), 1e-9 );
+}
+
+BOOST_FIXTURE_TEST_CASE( gaussian_utils_mixture_add_point, fixture_cluster )
+{
+  // adding the points one at a time gives the posterior of all of them
+  std::vector<nd_point_t> first( 1, points[0] );
+  gaussian_mixture_mean_posterior_t incremental( first,
+						 negative_observations,
+						 covariance,
+						 num_distribution,
+						 prior );
+  incremental.add_point( points[1] );
+  incremental.add_point( points[2] );
+  gaussian_mixture_mean_posterior_t all( points,
+					 negative_observations,
+					 covariance,
+					 num_distribution,
+					 prior );
+  BOOST_CHECK_EQUAL( incremental.points.size(), 3 );
+  BOOST_CHECK_EQUAL( incremental.points_only_conjugate.num_points(), 3 );
+  for( size_t k = 0; k < mus.size(); k += 7 ) {
+    nd_point_t mu = mus.point( k );
+    BOOST_CHECK_CLOSE( incremental.log_posterior( mu ), all.log_posterior( mu ), 1e-9 );
+  }
+
+  // moving a point out and back in is a round trip
+  incremental.remove_point( points[1] );
+  BOOST_CHECK_EQUAL( incremental.points.size(), 2 );
+  BOOST_CHECK_EQUAL( incremental.points_only_conjugate.num_points(), 2 );
+  BOOST_CHECK( std::fabs( incremental.log_posterior( mus.point( 0 ) )
+			  - all.log_posterior( mus.point( 0 ) ) ) > 1e-6 );
+  BOOST_CHECK_THROW( incremental.remove_point( point( 7.0, 7.0 ) ), std::runtime_error );
+  incremental.add_point( points[1] );
+  for( size_t k = 0; k < mus.size(); k += 7 ) {
+    nd_point_t mu = mus.point( k );
+    BOOST_CHECK_CLOSE( incremental.log_posterior( mu ), all.log_posterior( mu ), 1e-9 );
+  }
+  BOOST_CHECK_CLOSE( incremental.scale, all.scale, 1e-9 );
+
+  // changing the points directly and recalculating is not stale
+  all.points.pop_back();
+  all.calculate_posterior();
+  BOOST_CHECK_EQUAL( all.points_only_conjugate.num_points(), 2 );
+  gaussian_mixture_mean_posterior_t two( std::vector<nd_point_t>( points.begin(), points.begin() + 2 ),
+					 negative_observations,
+					 covariance,
+					 num_distribution,
+					 prior );
+  BOOST_CHECK_CLOSE( all.log_posterior( mus.point( 5 ) ),
+		     two.log_posterior( mus.point( 5 ) ), 1e-9 );
+}
+
+BOOST_FIXTURE_TEST_CASE( gaussian_utils_fused_posterior, fixture_cluster )
+{
+  gaussian_mixture_mean_posterior_t post( points,
+					  negative_observations,
+					  covariance,
+					  num_distribution,
+					  prior );
+  BOOST_REQUIRE_EQUAL( post.negative_likelihoods.size(), 2 );
+
+  // the fused posterior is the posterior function, and the batched
+  // one agrees with each region's batched likelihood
+  std::vector<double> log_p;
+  post.log_posterior( mus, log_p );
+  BOOST_REQUIRE_EQUAL( log_p.size(), mus.size() );
+  boost::shared_ptr<math_function_t<nd_point_t,double> > posterior
+    = post.posterior_function();
+  std::vector<double> first, second;
+  post.negative_likelihoods[0]->log_likelihood( mus, first );
+  post.negative_likelihoods[1]->log_likelihood( mus, second );
+  for( size_t k = 0; k < mus.size(); ++k ) {
+    nd_point_t mu = mus.point( k );
+    BOOST_CHECK_CLOSE( post( mu ), (*posterior)( mu ), 1e-8 );
+    double gaussian = post.log_posterior( mu )
+      - post.negative_likelihoods[0]->log_likelihood( mu )
+      - post.negative_likelihoods[1]->log_likelihood( mu );
+    BOOST_CHECK_CLOSE( log_p[k], gaussian + first[k] + second[k], 1e-9 );
+    BOOST_CHECK_CLOSE( exp( log_p[k] ), post( mu ), 1e-4 );
+  }
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,71 @@
+
+#define BOOST_TEST_MODULE griding
+#include <boost/test/included/unit_test.hpp>
+
+#include <point-process-core/griding.hpp>
+#include <math-core/geom.hpp>
+
+using namespace math_core;
+using namespace point_process_core;
+
+
+BOOST_AUTO_TEST_SUITE( test_suite_griding )
+
+
+// the function evaluated over the grids, one point at a time
+// and batched over a set of points
+static double quadratic( const nd_point_t& x )
+{
+  return x.coordinate[0] * x.coordinate[0] + 3.0 * x.coordinate[1];
+}
+
+static void batched_quadratic( const soa_point_set_t& points,
+			       std::vector<double>& values )
+{
+  for( size_t i = 0; i < points.size(); ++i ) {
+    values.push_back( points( i, 0 ) * points( i, 0 ) + 3.0 * points( i, 1 ) );
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE( griding_nth_cell )
+{
+  nd_aabox_t window = aabox( point( 0.0, 0.0 ), point( 3.0, 2.0 ) );
+  marked_grid_t<double> grid( window, 0.25 );
+  marked_grid_cell_range_t range = grid.cells();
+  size_t index = 0;
+  for( marked_grid_cell_range_t::const_iterator iter = range.begin();
+       iter != range.end();
+       ++iter, ++index ) {
+    BOOST_CHECK( nth_cell( range, index ) == *iter );
+  }
+  BOOST_CHECK_EQUAL( index, range.size() );
+}
+
+BOOST_AUTO_TEST_CASE( griding_batched_evaluation_threads )
+{
+  nd_aabox_t window = aabox( point( 0.0, 0.0 ), point( 3.0, 2.0 ) );
+  marked_grid_t<double> expected( window, 0.1 );
+  evaluate_function_at_grid_center<double,double>( &quadratic, expected );
+
+  for( int s = 0; s < 3; ++s ) {
+
+    // a single thread and several threads over many small tiles
+    // (the last one partial) give the same grid
+    marked_grid_t<double> serial( window, 0.1, (marked_grid_storage_t)s );
+    marked_grid_t<double> threaded( window, 0.1, (marked_grid_storage_t)s );
+    evaluate_function_at_grid_centers<double>( &batched_quadratic, serial, 50, 1 );
+    evaluate_function_at_grid_centers<double>( &batched_quadratic, threaded, 50, 4 );
+    BOOST_CHECK( serial == threaded );
+    BOOST_CHECK_EQUAL( serial.num_marked_cells(), serial.cells().size() );
+
+    // and they match the point at a time evaluation
+    BOOST_CHECK_EQUAL( serial.num_marked_cells(), expected.num_marked_cells() );
+    for( const marked_grid_cell_t& cell : expected.cells() ) {
+      BOOST_CHECK_CLOSE( *serial( cell ) + 1.0, *expected( cell ) + 1.0, 1e-9 );
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,12 +3,18 @@
 #include <boost/test/included/unit_test.hpp>
 
 #include <point-process-core/histogram.hpp>
+#include <point-process-core/concurrent_histogram.hpp>
+#include <point-process-core/marked_grid_io.hpp>
+#include <point-process-core/out_of_core_grid.hpp>
+#include <point-process-core/summed_area_table.hpp>
+#include <point-process-core/griding.hpp>
 #include <probability-core/distributions.hpp>
 #include <math-core/matrix.hpp>
 #include <math-core/geom.hpp>
 #include <math-core/io.hpp>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 using namespace math_core;
 using namespace probability_core;
@@ -77,4 +83,432 @@ BOOST_FIXTURE_TEST_CASE( histogram_kl, fixture_unit_gaussian_samples )
 }
 
 
+BOOST_FIXTURE_TEST_CASE( histogram_kl_dense, fixture_unit_gaussian_samples )
+{
+  // the same samples in dense and sparse histograms over one window
+  nd_aabox_t window = smallest_enclosing_box( samples_1000 );
+  histogram_t<size_t> p_dense( window, 50, MARKED_GRID_DENSE_STORAGE );
+  histogram_t<size_t> q_dense( window, 50, MARKED_GRID_DENSE_STORAGE );
+  histogram_t<size_t> p_sparse( window, 50, MARKED_GRID_SPARSE_STORAGE );
+  histogram_t<size_t> q_sparse( window, 50, MARKED_GRID_SPARSE_STORAGE );
+  for( auto s : samples_10 ) {
+    p_dense.increment_bin( s );
+    p_sparse.increment_bin( s );
+  }
+  for( auto s : samples_1000 ) {
+    q_dense.increment_bin( s );
+    q_sparse.increment_bin( s );
+  }
+  
+  BOOST_CHECK( have_aligned_dense_bins( p_dense, q_dense ) );
+  BOOST_CHECK( !have_aligned_dense_bins( p_sparse, q_sparse ) );
+
+  // the fast path matches the general one
+  BOOST_CHECK_CLOSE( kl_divergenge( p_dense, q_dense ),
+		     kl_divergenge( p_sparse, q_sparse ),
+		     1e-6 );
+  BOOST_CHECK_CLOSE( kl_divergenge( q_dense, p_dense ),
+		     kl_divergenge( q_sparse, p_sparse ),
+		     1e-6 );
+}
+
+
+BOOST_FIXTURE_TEST_CASE( histogram_dense_storage, fixture_unit_gaussian_samples )
+{
+  nd_aabox_t window = smallest_enclosing_box( samples_100 );
+  histogram_t<double> dense( window, 20, MARKED_GRID_DENSE_STORAGE );
+  histogram_t<double> sparse( window, 20, MARKED_GRID_SPARSE_STORAGE );
+  for( auto s : samples_100 ) {
+    dense.increment_bin( s );
+    sparse.increment_bin( s );
+  }
+  
+  // both storages see the same counts
+  BOOST_CHECK( dense == sparse );
+  BOOST_CHECK_EQUAL( dense.num_marked_cells(), sparse.num_marked_cells() );
+
+  // the running total follows changes to the bins
+  BOOST_CHECK_CLOSE( dense.total_count(), 100.0, 1e-9 );
+  dense.decrement_bin( samples_100[0] );
+  dense.set( samples_100[1], 5.0 );
+  double sum = 0;
+  for( auto cell : dense.all_marked_cells() ) {
+    sum += *dense( cell );
+  }
+  BOOST_CHECK_CLOSE( dense.total_count(), sum, 1e-9 );
+  dense.clear();
+  BOOST_CHECK_EQUAL( dense.total_count(), 0.0 );
+}
+
+BOOST_AUTO_TEST_CASE( histogram_default_storage )
+{
+  // only small windows are dense by default
+  nd_aabox_t window = aabox( point( 0.0, 0.0 ), point( 1.0, 1.0 ) );
+  BOOST_CHECK_EQUAL( histogram_t<double>( window, 20 ).storage(),
+		     MARKED_GRID_DENSE_STORAGE );
+  BOOST_CHECK_EQUAL( histogram_t<double>( window, 100 ).storage(),
+		     MARKED_GRID_SPARSE_STORAGE );
+  BOOST_CHECK_EQUAL( histogram_t<double>( window, 100, MARKED_GRID_DENSE_STORAGE ).storage(),
+		     MARKED_GRID_DENSE_STORAGE );
+}
+
+// a count for the cell centered at x, batched and one at a time
+static double cell_count( const nd_point_t& x )
+{
+  return 1.0 + x.coordinate[0];
+}
+
+static void cell_counts( const soa_point_set_t& xs, std::vector<double>& counts )
+{
+  for( size_t i = 0; i < xs.size(); ++i ) {
+    counts.push_back( 1.0 + xs( i, 0 ) );
+  }
+}
+
+BOOST_AUTO_TEST_CASE( histogram_total_through_grid )
+{
+  nd_aabox_t window = aabox( point( 0.0, 0.0 ), point( 1.0, 1.0 ) );
+  for( int s = 0; s < 3; ++s ) {
+    histogram_t<double> hist( window, 10, (marked_grid_storage_t)s );
+    marked_grid_t<double>& grid = hist;
+    double expected = 0;
+    for( const marked_grid_cell_t& cell : grid.cells() ) {
+      expected += cell_count( centroid( grid.region( cell ) ) );
+    }
+
+    // the writers of the grid keep the total of the histogram
+    evaluate_function_at_grid_center<double,double>( &cell_count, grid );
+    BOOST_CHECK_CLOSE( hist.total_count(), expected, 1e-9 );
+    grid.clear();
+    BOOST_CHECK_EQUAL( hist.total_count(), 0.0 );
+    evaluate_function_at_grid_centers<double>( &cell_counts, grid, 7, 4 );
+    BOOST_CHECK_CLOSE( hist.total_count(), expected, 1e-9 );
+    evaluate_function_at_grid_centers<double>( &cell_counts, grid, 7, 4 );
+    BOOST_CHECK_CLOSE( hist.total_count(), expected, 1e-9 );
+    grid.transform_marks( []( double& count ) { count *= 2; } );
+    BOOST_CHECK_CLOSE( hist.total_count(), 2 * expected, 1e-9 );
+    const marked_grid_cell_t cell = grid.cell( point( 0.55, 0.15 ) );
+    const double count = *grid( cell );
+    grid.set( cell, count + 3.0 );
+    BOOST_CHECK_CLOSE( hist.total_count(), 2 * expected + 3.0, 1e-9 );
+    grid.clear_mark( cell );
+    BOOST_CHECK_CLOSE( hist.total_count(), 2 * expected - count, 1e-9 );
+
+    // and copies keep it too
+    histogram_t<double> copy( hist );
+    BOOST_CHECK_EQUAL( copy.total_count(), hist.total_count() );
+    copy.clear();
+    copy = hist;
+    BOOST_CHECK_EQUAL( copy.total_count(), hist.total_count() );
+  }
+}
+
+
+BOOST_FIXTURE_TEST_CASE( histogram_combine, fixture_unit_gaussian_samples )
+{
+  nd_aabox_t window = smallest_enclosing_box( samples_1000 );
+  histogram_t<double> a( window, 20 );
+  histogram_t<double> b( window, 20 );
+  histogram_t<double> all( window, 20 );
+  for( size_t i = 0; i < samples_100.size(); ++i ) {
+    if( i % 2 ) {
+      a.increment_bin( samples_100[i] );
+    } else {
+      b.increment_bin( samples_100[i] );
+    }
+    all.increment_bin( samples_100[i] );
+  }
+
+  // merging the halves gives the whole
+  histogram_t<double> merged = a;
+  merged.merge( b );
+  BOOST_CHECK( merged == all );
+  BOOST_CHECK_CLOSE( merged.total_count(), 100.0, 1e-9 );
+
+  // subtracting a half back out leaves the other half's counts
+  merged.subtract( b );
+  BOOST_CHECK_CLOSE( merged.total_count(), a.total_count(), 1e-9 );
+  for( auto cell : a.all_marked_cells() ) {
+    BOOST_CHECK_CLOSE( *merged( cell ), *a( cell ), 1e-9 );
+  }
+
+  // scaling and normalizing
+  all.scale( 2.0 );
+  BOOST_CHECK_CLOSE( all.total_count(), 200.0, 1e-9 );
+  all.normalize_in_place();
+  double sum = 0;
+  for( auto cell : all.all_marked_cells() ) {
+    sum += *all( cell );
+  }
+  BOOST_CHECK_CLOSE( sum, 1.0, 1e-9 );
+
+  // different bins cannot be combined
+  histogram_t<double> other( window, 10 );
+  BOOST_CHECK_THROW( other.merge( a ), std::runtime_error );
+}
+
+
+BOOST_FIXTURE_TEST_CASE( histogram_combine_storages, fixture_unit_gaussian_samples )
+{
+  // merging between every pair of storages (dense, sparse and tiled)
+  // gives the same counts
+  nd_aabox_t window = smallest_enclosing_box( samples_1000 );
+  histogram_t<double> all( window, 20, MARKED_GRID_SPARSE_STORAGE );
+  for( auto s : samples_100 ) {
+    all.increment_bin( s );
+  }
+  for( int from = 0; from < 3; ++from ) {
+    histogram_t<double> source( window, 20, (marked_grid_storage_t)from );
+    for( auto s : samples_100 ) {
+      source.increment_bin( s );
+    }
+    for( int into = 0; into < 3; ++into ) {
+      histogram_t<double> merged( window, 20, (marked_grid_storage_t)into );
+      merged.merge( source );
+      BOOST_CHECK( merged == all );
+      BOOST_CHECK_CLOSE( merged.total_count(), 100.0, 1e-9 );
+      BOOST_CHECK_EQUAL( merged.num_marked_cells(), all.num_marked_cells() );
+      merged.subtract( source );
+      BOOST_CHECK_SMALL( merged.total_count(), 1e-9 );
+    }
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE( histogram_save_load )
+{
+  nd_aabox_t window = aabox( point( 0.0, 0.0 ), point( 1.0, 1.0 ) );
+  for( int s = 0; s < 2; ++s ) {
+    histogram_t<double> hist( window, 10, (marked_grid_storage_t)s );
+    hist.increment_bin( hist.cell( point( 0.15, 0.25 ) ), 3.0 );
+    hist.increment_bin( hist.cell( point( 0.95, 0.05 ) ) );
+    hist.increment_bin( hist.cell( point( 5.0, -3.0 ) ), 2.0 );
+    save_histogram( "test-histogram-save-load.bin", hist );
+
+    // lookups in place from the mapped file
+    mapped_marked_grid_t<double> mapped( "test-histogram-save-load.bin" );
+    BOOST_CHECK_EQUAL( mapped.storage(), hist.storage() );
+    BOOST_CHECK_EQUAL( *mapped( hist.cell( point( 0.15, 0.25 ) ) ), 3.0 );
+    BOOST_CHECK_EQUAL( *mapped( hist.cell( point( 5.0, -3.0 ) ) ), 2.0 );
+    BOOST_CHECK( mapped( hist.cell( point( 0.5, 0.5 ) ) ) == NULL );
+
+    // a full load gives back the same histogram
+    histogram_t<double> loaded = load_histogram<double>( "test-histogram-save-load.bin" );
+    BOOST_CHECK( loaded == hist );
+    BOOST_CHECK_CLOSE( loaded.total_count(), 6.0, 1e-9 );
+
+    // marks of another type are refused
+    BOOST_CHECK_THROW( load_marked_grid<float>( "test-histogram-save-load.bin" ),
+		       std::runtime_error );
+  }
+}
+
+
+BOOST_AUTO_TEST_CASE( histogram_save_load_mark_types )
+{
+  nd_aabox_t window = aabox( point( 0.0, 0.0 ), point( 1.0, 1.0 ) );
+
+  // bool grids (as from point_set_as_grid) in every storage
+  std::vector<nd_point_t> points;
+  points.push_back( point( 0.15, 0.25 ) );
+  points.push_back( point( 0.95, 0.05 ) );
+  for( int s = 0; s < 3; ++s ) {
+    marked_grid_t<bool> grid( window, 0.1, (marked_grid_storage_t)s );
+    grid.set( points[0], true );
+    grid.set( points[1], false );
+    save_marked_grid( "test-histogram-save-load-bool.bin", grid );
+    marked_grid_t<bool> loaded = load_marked_grid<bool>( "test-histogram-save-load-bool.bin" );
+    BOOST_CHECK( loaded == grid );
+    BOOST_CHECK_EQUAL( *loaded( points[0] ), true );
+    BOOST_CHECK_EQUAL( *loaded( points[1] ), false );
+  }
+  marked_grid_t<bool> as_grid = point_set_as_grid( points, window, 0.1 );
+  save_marked_grid( "test-histogram-save-load-bool.bin", as_grid );
+  BOOST_CHECK( load_marked_grid<bool>( "test-histogram-save-load-bool.bin" ) == as_grid );
+
+  // marks of the same size but another kind are refused
+  marked_grid_t<double> doubles( window, 0.1 );
+  doubles.set( points[0], 2.5 );
+  save_marked_grid( "test-histogram-save-load-double.bin", doubles );
+  BOOST_CHECK_THROW( load_marked_grid<long>( "test-histogram-save-load-double.bin" ),
+		     std::runtime_error );
+  BOOST_CHECK_THROW( load_marked_grid<unsigned char>( "test-histogram-save-load-bool.bin" ),
+		     std::runtime_error );
+  BOOST_CHECK_EQUAL( *load_marked_grid<double>( "test-histogram-save-load-double.bin" )( points[0] ),
+		     2.5 );
+}
+
+
+BOOST_AUTO_TEST_CASE( out_of_core_grid_reopen )
+{
+  nd_aabox_t window = aabox( point( 0.0, 0.0 ), point( 1.0, 1.0 ) );
+  std::vector<double> resolutions( 2, 0.1 );
+  {
+    out_of_core_marked_grid_t<double> grid( "test-out-of-core-grid.bin",
+					    window, point( 0.0, 0.0 ),
+					    resolutions, 4 );
+    grid.set( point( 0.15, 0.25 ), 3.0 );
+    grid.set( point( 0.95, 0.05 ), -1.0 );
+    grid.set( point( 0.55, 0.55 ), 2.0 );
+    grid.clear_mark( point( 0.55, 0.55 ) );
+
+    // marks outside of the tiles could not be saved
+    BOOST_CHECK_THROW( grid.set( point( 5.0, -3.0 ), 2.0 ), std::out_of_range );
+    BOOST_CHECK( !grid( point( 5.0, -3.0 ) ) );
+    BOOST_CHECK_EQUAL( grid.num_marked_cells(), 2 );
+    grid.sync();
+  }
+
+  // the marks come back on reopening, read only or not
+  for( int m = 0; m < 2; ++m ) {
+    out_of_core_marked_grid_t<double> grid( "test-out-of-core-grid.bin",
+					    (out_of_core_grid_mode_t)m );
+    BOOST_CHECK_EQUAL( grid.read_only(), m == OUT_OF_CORE_GRID_READ_ONLY );
+    BOOST_CHECK_EQUAL( grid.num_marked_cells(), 2 );
+    BOOST_CHECK_EQUAL( *grid( point( 0.15, 0.25 ) ), 3.0 );
+    BOOST_CHECK_EQUAL( *grid( point( 0.95, 0.05 ) ), -1.0 );
+    BOOST_CHECK( !grid( point( 0.55, 0.55 ) ) );
+    marked_grid_t<double> loaded = grid.load_grid();
+    BOOST_CHECK_EQUAL( loaded.num_marked_cells(), 2 );
+    if( grid.read_only() ) {
+      BOOST_CHECK_THROW( grid.set( point( 0.15, 0.25 ), 1.0 ), std::runtime_error );
+      BOOST_CHECK_THROW( grid.clear_mark( point( 0.15, 0.25 ) ), std::runtime_error );
+    }
+  }
+
+  // marks of another type are refused
+  BOOST_CHECK_THROW( out_of_core_marked_grid_t<long>( "test-out-of-core-grid.bin" ),
+		     std::runtime_error );
+}
+
+BOOST_AUTO_TEST_CASE( out_of_core_grid_page_aligned_tiles )
+{
+  // every tile of 8x8x8 doubles starts on its own page
+  out_of_core_grid_file_layout_t layout
+    ( out_of_core_grid_file_header( MARKED_GRID_MARK_FLOATING_POINT,
+				    sizeof(double), 3, 8, 5 ) );
+  BOOST_CHECK_EQUAL( layout.tiles % 4096, 0 );
+  BOOST_CHECK_EQUAL( layout.tile_size % 4096, 0 );
+  BOOST_CHECK( layout.tile_size >= 512 + 512 * sizeof(double) );
+  BOOST_CHECK_EQUAL( layout.end, layout.tiles + 5 * layout.tile_size );
+}
+
+
+BOOST_FIXTURE_TEST_CASE( histogram_summed_area_table, fixture_unit_gaussian_samples )
+{
+  nd_aabox_t window = smallest_enclosing_box( samples_100 );
+  histogram_t<double> hist( window, 20 );
+  for( auto s : samples_100 ) {
+    hist.increment_bin( s );
+  }
+  summed_area_table_t<double> table( hist, 4 );
+  BOOST_CHECK_CLOSE( table.total(), hist.total_count(), 1e-9 );
+
+  // window sums match a scan of the marks, before and after changes
+  // (some pending, some folded into the table)
+  for( size_t k = 0; k < 10; ++k ) {
+    nd_aabox_t query = smallest_enclosing_box( std::vector<nd_point_t>( samples_100.begin() + 2 * k,
+									 samples_100.begin() + 2 * k + 2 ) );
+    BOOST_CHECK_CLOSE( table.sum( query ) + 1.0, sum_in_window( hist, query ) + 1.0, 1e-9 );
+    hist.increment_bin( samples_100[k], 2.0 );
+    table.add( samples_100[k], 2.0 );
+  }
+  BOOST_CHECK( table.num_pending() <= 4 );
+  BOOST_CHECK_CLOSE( table.total(), hist.total_count(), 1e-9 );
+  table.set( hist.cell( samples_100[0] ), 0.0 );
+  BOOST_CHECK_EQUAL( table.value( hist.cell( samples_100[0] ) ), 0.0 );
+}
+
+
+BOOST_AUTO_TEST_CASE( histogram_cell_range )
+{
+  // the range [(0,-1),(1,2)] iterates with the last dimension fastest
+  marked_grid_cell_t min, max;
+  min.n = max.n = 2;
+  min.coordinate = marked_grid_cell_coordinate_t( 2, 0 );
+  max.coordinate = marked_grid_cell_coordinate_t( 2, 0 );
+  min.coordinate[1] = -1;
+  max.coordinate[0] = 1;
+  max.coordinate[1] = 2;
+  marked_grid_cell_range_t range( min, max );
+  BOOST_CHECK( !range.empty() );
+  BOOST_CHECK_EQUAL( range.size(), 8 );
+  size_t count = 0;
+  for( const marked_grid_cell_t& cell : range ) {
+    BOOST_CHECK_EQUAL( cell.coordinate[0], (long)( count / 4 ) );
+    BOOST_CHECK_EQUAL( cell.coordinate[1], (long)( count % 4 ) - 1 );
+    BOOST_CHECK( range.contains( cell ) );
+    ++count;
+  }
+  BOOST_CHECK_EQUAL( count, 8 );
+  marked_grid_cell_t outside = max;
+  outside.coordinate[1] = 3;
+  BOOST_CHECK( !range.contains( outside ) );
+
+  // an inverted range is empty
+  marked_grid_cell_range_t inverted( max, min );
+  BOOST_CHECK( inverted.empty() );
+  BOOST_CHECK_EQUAL( inverted.size(), 0 );
+  BOOST_CHECK( inverted.begin() == inverted.end() );
+  BOOST_CHECK( marked_grid_cell_range_t().empty() );
+
+  // a histogram's range holds all its cells, in all_cells() order
+  histogram_t<double> hist( aabox( point( 0.0, 0.0 ), point( 1.0, 1.0 ) ), 5 );
+  marked_grid_cell_range_t cells = hist.cells();
+  std::vector<marked_grid_cell_t> all = hist.all_cells();
+  BOOST_CHECK_EQUAL( cells.size(), all.size() );
+  BOOST_CHECK( std::equal( all.begin(), all.end(), cells.begin() ) );
+  BOOST_CHECK( cells.contains( hist.cell( point( 0.1, 0.9 ) ) ) );
+  BOOST_CHECK( !cells.contains( hist.cell( point( 3.0, 0.5 ) ) ) );
+}
+
+
+BOOST_AUTO_TEST_CASE( histogram_concurrent_increments )
+{
+  nd_aabox_t window = aabox( point( 0.0 ), point( 1.0 ) );
+  const size_t num_threads = 4;
+  const size_t num_increments = 20000;
+  for( int s = 0; s < 2; ++s ) {
+    concurrent_histogram_t<double> hist( window, 10, (marked_grid_storage_t)s );
+
+    // every thread increments a bin of its own, one shared bin and
+    // a cell outside of the window
+    std::vector<std::thread> threads;
+    for( size_t t = 0; t < num_threads; ++t ) {
+      threads.push_back( std::thread( [&hist,t,num_increments]() {
+	    for( size_t i = 0; i < num_increments; ++i ) {
+	      hist.increment_bin( point( 0.05 + 0.1 * t ) );
+	      hist.increment_bin( point( 0.95 ) );
+	      hist.increment_bin( point( 3.0 ) );
+	    }
+	  } ) );
+    }
+
+    // snapshots taken meanwhile only ever grow, and every increment
+    // is either fully in or out of them
+    double last_total = 0;
+    double last_shared = 0;
+    for( size_t k = 0; k < 50; ++k ) {
+      histogram_t<double> snap = hist.snapshot();
+      double shared = snap( point( 0.95 ) ) ? *snap( point( 0.95 ) ) : 0.0;
+      BOOST_CHECK( snap.total_count() >= last_total );
+      BOOST_CHECK( shared >= last_shared );
+      last_total = snap.total_count();
+      last_shared = shared;
+    }
+    for( size_t t = 0; t < threads.size(); ++t ) {
+      threads[t].join();
+    }
+
+    histogram_t<double> final_hist = hist.snapshot();
+    BOOST_CHECK_EQUAL( final_hist.total_count(), 3.0 * num_threads * num_increments );
+    BOOST_CHECK_EQUAL( *final_hist( point( 0.95 ) ), (double)( num_threads * num_increments ) );
+    BOOST_CHECK_EQUAL( *final_hist( point( 3.0 ) ), (double)( num_threads * num_increments ) );
+    for( size_t t = 0; t < num_threads; ++t ) {
+      BOOST_CHECK_EQUAL( *final_hist( point( 0.05 + 0.1 * t ) ), (double)num_increments );
+    }
+  }
+}
+
+
 BOOST_AUTO_TEST_SUITE_END()
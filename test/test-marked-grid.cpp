@@ -35,5 +35,35 @@ int main( int argc, char** argv )
 
   std::cout << "Grids equal: " << (grid == grid1) << std::endl;
 
+  // the same marks in a dense grid
+  marked_grid_t<int> dense( window, 1.0, MARKED_GRID_DENSE_STORAGE );
+  dense.set( point( 3.5, 3.5), 1 );
+  dense.set( point( 5.5, 3.5), -3 );
+  dense.set( point( 12.5, 3.5), 7 );
+  dense.clear_mark( point( 12.5, 3.5) );
+  
+  std::cout << "Dense marked cells: " << dense.num_marked_cells() << std::endl;
+  std::cout << "Dense grid equal: " << (dense == grid) << std::endl;
+
+  // and in a tiled grid
+  marked_grid_t<int> tiled( window, 1.0, MARKED_GRID_TILED_STORAGE );
+  tiled.set( point( 3.5, 3.5), 1 );
+  tiled.set( point( 5.5, 3.5), -3 );
+  tiled.set( point( 12.5, 3.5), 7 );
+  tiled.clear_mark( point( 12.5, 3.5) );
+
+  std::cout << "Tiled marked cells: " << tiled.num_marked_cells() 
+	    << " in " << tiled.num_tiles() << " tiles" << std::endl;
+  std::cout << "Tiled grid equal: " << (tiled == grid) << std::endl;
+
+  // window queries
+  nd_aabox_t query = aabox( point( 3.0, 2.5 ), point( 6.0, 4.0 ) );
+  std::cout << "Cells inside query: " 
+	    << cells_fully_inside_window( grid, query ).size() << std::endl;
+  std::cout << "Marked cells inside query: " 
+	    << marked_cells_in_window( grid, query ).size() << std::endl;
+  std::cout << "Sum inside query: " 
+	    << sum_in_window( grid, query ) << std::endl;
+
   return 0;
 }
@@ -0,0 +1,335 @@
+
+#define BOOST_TEST_MODULE mcmc_chains
+#include <boost/test/included/unit_test.hpp>
+
+#include <point-process-core/mcmc_chains.hpp>
+#include <point-process-core/histogram.hpp>
+#include <point-process-core/entropy.hpp>
+#include <point-process-core/intensity_estimator.hpp>
+#include <math-core/geom.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+using namespace math_core;
+using namespace point_process_core;
+
+
+BOOST_AUTO_TEST_SUITE( test_suite_mcmc_chains )
+
+
+// a toy 1D process whose state is a number of points in [0,10];
+// each mcmc step moves the count by -1, 0 or +1. The random state
+// belongs to the instance, but reseeding is not supported
+class toy_process_t : public mcmc_point_process_t
+{
+public:
+
+  toy_process_t()
+    : _count( 3 )
+  {
+    _window.n = 1;
+    _window.start = point( 0.0 );
+    _window.end = point( 10.0 );
+  }
+
+  boost::shared_ptr<mcmc_point_process_t> clone() const
+  { return boost::shared_ptr<mcmc_point_process_t>( new toy_process_t( *this ) ); }
+  nd_aabox_t window() const
+  { return _window; }
+  std::vector<nd_point_t> observations() const
+  { return std::vector<nd_point_t>(); }
+  std::vector<nd_point_t> sample() const
+  {
+    boost::random::mt19937 rng( _rng );
+    boost::random::uniform_real_distribution<double> u( 0.0, 10.0 );
+    std::vector<nd_point_t> s;
+    for( int i = 0; i < _count; ++i ) {
+      s.push_back( point( u( rng ) ) );
+    }
+    return s;
+  }
+  void add_observations( const std::vector<nd_point_t>& obs ) {}
+  void add_negative_observation( const nd_aabox_t& region ) {}
+  void print_shallow_trace( std::ostream& out ) const {}
+  void trace_mcmc( const std::string& trace_dir ) {}
+  void trace_mcmc_off() {}
+  void single_mcmc_step()
+  {
+    boost::random::uniform_int_distribution<int> step( -1, 1 );
+    _count = std::max( 0, std::min( 6, _count + step( _rng ) ) );
+  }
+
+protected:
+  boost::random::mt19937 _rng;
+  int _count;
+  nd_aabox_t _window;
+};
+
+// the same process with reseeding support
+class seedable_toy_process_t : public toy_process_t
+{
+public:
+  boost::shared_ptr<mcmc_point_process_t> clone() const
+  { return boost::shared_ptr<mcmc_point_process_t>( new seedable_toy_process_t( *this ) ); }
+  bool seed_rng( const unsigned long seed )
+  {
+    _rng.seed( (boost::uint32_t)seed );
+    return true;
+  }
+};
+
+// a process counting the calls the sampling makes
+class counting_toy_process_t : public toy_process_t
+{
+public:
+  counting_toy_process_t()
+    : num_sample_and_step( 0 ),
+      num_single_steps( 0 ),
+      num_mcmc_calls( 0 )
+  {}
+  boost::shared_ptr<mcmc_point_process_t> clone() const
+  { return boost::shared_ptr<mcmc_point_process_t>( new counting_toy_process_t( *this ) ); }
+  std::vector<nd_point_t> sample_and_step()
+  {
+    ++num_sample_and_step;
+    return toy_process_t::sample_and_step();
+  }
+  void single_mcmc_step()
+  {
+    ++num_single_steps;
+    toy_process_t::single_mcmc_step();
+  }
+  void mcmc( const std::size_t& iterations, bool tick = false )
+  {
+    ++num_mcmc_calls;
+    toy_process_t::mcmc( iterations, tick );
+  }
+  size_t num_sample_and_step;
+  size_t num_single_steps;
+  size_t num_mcmc_calls;
+};
+
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_sample_batch_uses_sample_and_step )
+{
+  counting_toy_process_t process;
+  point_set_batch_t batch;
+  process.sample_batch( 5, batch, 3 );
+  BOOST_CHECK_EQUAL( batch.size(), 5 );
+  BOOST_CHECK_EQUAL( process.num_sample_and_step, 5 );
+  BOOST_CHECK_EQUAL( process.num_single_steps, 15 );
+  BOOST_CHECK_EQUAL( process.num_mcmc_calls, 5 );
+
+  // no steps between samples
+  process.sample_batch( 2, batch, 0 );
+  BOOST_CHECK_EQUAL( batch.size(), 7 );
+  BOOST_CHECK_EQUAL( process.num_sample_and_step, 5 );
+  BOOST_CHECK_EQUAL( process.num_single_steps, 15 );
+}
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_intensity_estimate_tick )
+{
+  // printing the progress does not change how the chain is stepped
+  counting_toy_process_t process;
+  boost::shared_ptr<mcmc_point_process_t> ticking = process.clone();
+  histogram_t<double> quiet
+    = process.intensity_estimate( process.window(), 10, 20, 3, false );
+  histogram_t<double> loud
+    = ticking->intensity_estimate( process.window(), 10, 20, 3, true );
+  BOOST_CHECK( quiet == loud );
+  counting_toy_process_t* counted = dynamic_cast<counting_toy_process_t*>( ticking.get() );
+  BOOST_REQUIRE( counted );
+  BOOST_CHECK_EQUAL( process.num_sample_and_step, 20 );
+  BOOST_CHECK_EQUAL( process.num_mcmc_calls, 20 );
+  BOOST_CHECK_EQUAL( counted->num_single_steps, process.num_single_steps );
+  BOOST_CHECK_EQUAL( counted->num_mcmc_calls, process.num_mcmc_calls );
+}
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_intensity_estimate_storage )
+{
+  // a window with more bins than are dense by default
+  seedable_toy_process_t process;
+  nd_aabox_t window = process.window();
+  const size_t bins = max_default_dense_histogram_bins + 10;
+  BOOST_CHECK_EQUAL( process.clone()->intensity_estimate( window, bins, 20 ).storage(),
+		     MARKED_GRID_SPARSE_STORAGE );
+
+  // can still be estimated into a flat array
+  histogram_t<double> sparse
+    = process.clone()->intensity_estimate( window, bins, 20, 1, false );
+  histogram_t<double> dense
+    = process.clone()->intensity_estimate( window, bins, 20, 1, false,
+					   MARKED_GRID_DENSE_STORAGE );
+  BOOST_CHECK_EQUAL( dense.storage(), MARKED_GRID_DENSE_STORAGE );
+  BOOST_CHECK( dense == sparse );
+  BOOST_CHECK_CLOSE( dense.total_count(), sparse.total_count(), 1e-9 );
+  BOOST_CHECK_EQUAL( parallel_intensity_estimate( process, window, bins, 20, 1, 2, 3, 2,
+						  MARKED_GRID_DENSE_STORAGE ).storage(),
+		     MARKED_GRID_DENSE_STORAGE );
+  incremental_intensity_estimator_t estimator( process.clone(), window, bins,
+					       10, 1, 0, MARKED_GRID_DENSE_STORAGE );
+  BOOST_CHECK_EQUAL( estimator.intensity_estimate().storage(),
+		     MARKED_GRID_DENSE_STORAGE );
+}
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_seeded_chains_differ )
+{
+  seedable_toy_process_t process;
+  mcmc_chains_parameters_t params;
+  params.num_chains = 2;
+  params.num_samples_per_chain = 50;
+  params.seed = 7;
+  mcmc_chains_result_t res = run_mcmc_chains( process, params );
+  BOOST_REQUIRE_EQUAL( res.traces.size(), 2 );
+  BOOST_REQUIRE_EQUAL( res.traces[0].size(), 50 );
+  BOOST_CHECK( res.traces[0] != res.traces[1] );
+
+  // the same seed gives the same chains regardless of threads
+  params.num_threads = 1;
+  mcmc_chains_result_t serial = run_mcmc_chains( process, params );
+  BOOST_CHECK( res.traces == serial.traces );
+}
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_unseedable_process_throws )
+{
+  toy_process_t process;
+  mcmc_chains_parameters_t params;
+  params.num_chains = 2;
+  params.num_samples_per_chain = 10;
+  BOOST_CHECK_THROW( run_mcmc_chains( process, params ), std::runtime_error );
+
+  // a single chain needs no reseeding
+  params.num_chains = 1;
+  mcmc_chains_result_t res = run_mcmc_chains( process, params );
+  BOOST_CHECK_EQUAL( res.traces.size(), 1 );
+  BOOST_CHECK_EQUAL( res.traces[0].size(), 10 );
+}
+
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_rhat_known_values )
+{
+  // identical chains have no between-chain variance
+  std::vector<std::vector<double> > same( 2, std::vector<double>() );
+  for( int i = 1; i <= 4; ++i ) {
+    same[0].push_back( i );
+    same[1].push_back( i );
+  }
+  BOOST_CHECK_CLOSE( gelman_rubin_rhat( same ), sqrt( 0.75 ), 1e-8 );
+
+  // shifted chains: W = 1/3, B/n = 50
+  std::vector<std::vector<double> > shifted( 2, std::vector<double>() );
+  for( int i = 0; i < 4; ++i ) {
+    shifted[0].push_back( i % 2 );
+    shifted[1].push_back( 10 + i % 2 );
+  }
+  BOOST_CHECK_CLOSE( gelman_rubin_rhat( shifted ), sqrt( 150.75 ), 1e-8 );
+
+  // constant chains have converged
+  std::vector<std::vector<double> > constant( 3, std::vector<double>( 5, 2.0 ) );
+  BOOST_CHECK_EQUAL( gelman_rubin_rhat( constant ), 1.0 );
+}
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_ess_known_values )
+{
+  // alternating chains are anti-correlated, the negative lags are
+  // truncated and the size is the number of draws
+  std::vector<std::vector<double> > alternating( 2, std::vector<double>() );
+  for( int i = 0; i < 6; ++i ) {
+    alternating[0].push_back( i % 2 );
+    alternating[1].push_back( i % 2 );
+  }
+  BOOST_CHECK_CLOSE( effective_sample_size( alternating ), 12.0, 1e-8 );
+
+  // slowly varying chains: rho(1) = 0.6, rho(2) = 0, then a negative pair
+  std::vector<std::vector<double> > sticky( 2, std::vector<double>() );
+  for( int i = 0; i < 6; ++i ) {
+    sticky[0].push_back( i < 3 ? 0 : 1 );
+    sticky[1].push_back( i < 3 ? 1 : 0 );
+  }
+  BOOST_CHECK_CLOSE( effective_sample_size( sticky ), 12.0 / 2.2, 1e-8 );
+
+  // constant chains count every draw
+  std::vector<std::vector<double> > constant( 3, std::vector<double>( 5, 2.0 ) );
+  BOOST_CHECK_EQUAL( effective_sample_size( constant ), 15.0 );
+}
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_parallel_intensity_estimate )
+{
+  seedable_toy_process_t process;
+  nd_aabox_t window = process.window();
+
+  // the estimate only depends on the seed and number of chains
+  histogram_t<double> threaded
+    = parallel_intensity_estimate( process, window, 10, 200, 1, 4, 3, 4 );
+  histogram_t<double> serial
+    = parallel_intensity_estimate( process, window, 10, 200, 1, 4, 3, 1 );
+  BOOST_CHECK( threaded == serial );
+  BOOST_CHECK( threaded.total_count() > 0 );
+
+  // an unseedable process falls back to a single serial chain
+  toy_process_t unseedable;
+  histogram_t<double> fallback
+    = parallel_intensity_estimate( unseedable, window, 10, 200, 1, 4, 3, 4 );
+  histogram_t<double> single
+    = unseedable.clone()->intensity_estimate( window, 10, 200, 1 );
+  BOOST_CHECK( fallback == single );
+  BOOST_CHECK_CLOSE( fallback.total_count(), single.total_count(), 1e-8 );
+}
+
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_parallel_entropy )
+{
+  entropy_estimator_parameters_t params;
+  params.num_samples = 200;
+  params.histogram_grid_cell_size = 2.5;
+
+  // an unseedable process falls back to a single serial chain
+  toy_process_t unseedable;
+  boost::shared_ptr<mcmc_point_process_t> single = unseedable.clone();
+  BOOST_CHECK_EQUAL( estimate_entropy_from_samples_in_parallel( params, unseedable, 4, 3 ),
+		     estimate_entropy_from_samples( params, single ) );
+
+  // with a target precision the rounds only depend on the seed
+  seedable_toy_process_t process;
+  params.target_precision = 0.5;
+  double threaded = estimate_entropy_from_samples_in_parallel( params, process, 4, 3, 4 );
+  double serial = estimate_entropy_from_samples_in_parallel( params, process, 4, 3, 1 );
+  BOOST_CHECK_EQUAL( threaded, serial );
+  BOOST_CHECK( threaded > 0 );
+}
+
+
+BOOST_AUTO_TEST_CASE( mcmc_chains_incremental_estimate_burns_in )
+{
+  boost::shared_ptr<counting_toy_process_t> counting( new counting_toy_process_t() );
+  boost::shared_ptr<mcmc_point_process_t> process = counting;
+  incremental_intensity_estimator_t estimator( process, process->window(), 10,
+					       10, 1, 25 );
+
+  // the first fill draws samples without a burn-in
+  BOOST_CHECK_EQUAL( estimator.update(), 10 );
+  BOOST_CHECK_EQUAL( counting->num_sample_and_step, 10 );
+  BOOST_CHECK_EQUAL( counting->num_single_steps, 10 );
+
+  // new observations burn the chain in before the replacements
+  estimator.add_observations( std::vector<nd_point_t>( 1, point( 1.0 ) ), 0.5 );
+  BOOST_CHECK_EQUAL( estimator.num_stale(), 5 );
+  BOOST_CHECK_EQUAL( estimator.update(), 5 );
+  BOOST_CHECK_EQUAL( counting->num_sample_and_step, 15 );
+  BOOST_CHECK_EQUAL( counting->num_single_steps, 10 + 25 + 5 );
+  BOOST_CHECK_EQUAL( estimator.num_samples(), 10 );
+
+  // plain invalidation does not
+  estimator.invalidate( 2 );
+  BOOST_CHECK_EQUAL( estimator.update(), 2 );
+  BOOST_CHECK_EQUAL( counting->num_single_steps, 10 + 25 + 5 + 2 );
+  BOOST_CHECK_CLOSE( estimator.intensity_estimate().total_count(),
+		     estimator.counts().total_count() / 10.0, 1e-9 );
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
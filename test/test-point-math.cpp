@@ -0,0 +1,175 @@
+
+#define BOOST_TEST_MODULE point_math
+#include <boost/test/included/unit_test.hpp>
+
+#include <point-process-core/point_math.hpp>
+#include <math-core/matrix.hpp>
+#include <math-core/geom.hpp>
+#include <stdexcept>
+#include <cmath>
+
+using namespace math_core;
+using namespace point_process_core;
+
+
+BOOST_AUTO_TEST_SUITE( test_suite_point_math )
+
+
+// a fixture with a deterministic spread of 3D points, an odd number
+// of them so the kernels' partial sums do not divide evenly
+struct fixture_points
+{
+  fixture_points()
+  {
+    for( int i = 0; i < 1003; ++i ) {
+      std::vector<double> c( 3 );
+      c[0] = 10.0 + 3.0 * sin( 0.37 * i );
+      c[1] = -2.0 + cos( 1.3 * i ) + 0.5 * c[0];
+      c[2] = 0.01 * i;
+      points.push_back( point( c ) );
+    }
+  }
+  std::vector<nd_point_t> points;
+};
+
+
+BOOST_FIXTURE_TEST_CASE( point_math_soa_matches_aos, fixture_points )
+{
+  soa_point_set_t soa( points );
+  point_vector_view_t view( points );
+  BOOST_REQUIRE_EQUAL( soa.size(), points.size() );
+  BOOST_REQUIRE_EQUAL( soa.dimension(), 3 );
+
+  // the mean and variance by a plain loop over the points
+  std::vector<double> m( 3, 0.0 );
+  for( size_t i = 0; i < points.size(); ++i ) {
+    for( size_t d = 0; d < 3; ++d ) {
+      m[d] += points[i].coordinate[d] / points.size();
+    }
+  }
+  double var = 0;
+  for( size_t i = 0; i < points.size(); ++i ) {
+    for( size_t d = 0; d < 3; ++d ) {
+      var += ( points[i].coordinate[d] - m[d] ) * ( points[i].coordinate[d] - m[d] ) / points.size();
+    }
+  }
+
+  nd_point_t soa_mean = mean( soa );
+  nd_point_t aos_mean = mean( points );
+  for( size_t d = 0; d < 3; ++d ) {
+    BOOST_CHECK_CLOSE( soa_mean.coordinate[d], m[d], 1e-9 );
+    BOOST_CHECK_CLOSE( aos_mean.coordinate[d], m[d], 1e-9 );
+  }
+  BOOST_CHECK_CLOSE( variance( soa ), var, 1e-9 );
+  BOOST_CHECK_CLOSE( variance( points ), var, 1e-9 );
+  BOOST_CHECK_CLOSE( variance( view ), var, 1e-9 );
+
+  // the covariance has the variance as its trace
+  Eigen::MatrixXd soa_cov = to_eigen_mat( covariance( soa ) );
+  Eigen::MatrixXd aos_cov = to_eigen_mat( covariance( points ) );
+  BOOST_CHECK_CLOSE( soa_cov.trace(), var, 1e-9 );
+  BOOST_CHECK( ( soa_cov - aos_cov ).cwiseAbs().maxCoeff() < 1e-9 );
+  BOOST_CHECK( ( soa_cov - soa_cov.transpose() ).cwiseAbs().maxCoeff() == 0 );
+
+  // bounding boxes agree with the enclosing box of the points
+  nd_aabox_t box = smallest_enclosing_box( points );
+  nd_aabox_t soa_box = bounding_box( soa );
+  nd_aabox_t view_box = bounding_box( view );
+  for( size_t d = 0; d < 3; ++d ) {
+    BOOST_CHECK_EQUAL( soa_box.start.coordinate[d], box.start.coordinate[d] );
+    BOOST_CHECK_EQUAL( soa_box.end.coordinate[d], box.end.coordinate[d] );
+    BOOST_CHECK_EQUAL( view_box.start.coordinate[d], box.start.coordinate[d] );
+    BOOST_CHECK_EQUAL( view_box.end.coordinate[d], box.end.coordinate[d] );
+  }
+
+  // points round trip through the set
+  BOOST_CHECK( soa.point( 17 ).coordinate == points[17].coordinate );
+}
+
+BOOST_AUTO_TEST_CASE( point_math_empty_sets )
+{
+  std::vector<nd_point_t> none;
+  soa_point_set_t soa( 2 );
+  BOOST_CHECK_EQUAL( variance( none ), 0.0 );
+  BOOST_CHECK_EQUAL( variance( soa ), 0.0 );
+  BOOST_CHECK_EQUAL( mean( soa ).n, 2 );
+  BOOST_CHECK_EQUAL( mean( soa ).coordinate[1], 0.0 );
+}
+
+
+BOOST_FIXTURE_TEST_CASE( point_math_statistics_updates, fixture_points )
+{
+  // adding every point matches the batch statistics
+  point_statistics_t all( 0, true );
+  for( size_t i = 0; i < points.size(); ++i ) {
+    all.add( points[i] );
+  }
+  BOOST_REQUIRE_EQUAL( all.count(), points.size() );
+  BOOST_REQUIRE_EQUAL( all.dimension(), 3 );
+  nd_point_t m = mean( points );
+  for( size_t d = 0; d < 3; ++d ) {
+    BOOST_CHECK_CLOSE( all.mean().coordinate[d], m.coordinate[d], 1e-9 );
+  }
+  BOOST_CHECK_CLOSE( all.variance(), variance( points ), 1e-9 );
+  Eigen::MatrixXd cov = to_eigen_mat( covariance( points ) );
+  BOOST_CHECK( ( to_eigen_mat( all.covariance() ) - cov ).cwiseAbs().maxCoeff() < 1e-9 );
+
+  // removing the second half leaves the statistics of the first
+  std::vector<nd_point_t> half( points.begin(), points.begin() + 500 );
+  for( size_t i = 500; i < points.size(); ++i ) {
+    all.remove( points[i] );
+  }
+  BOOST_CHECK_EQUAL( all.count(), 500 );
+  BOOST_CHECK_CLOSE( all.variance(), variance( half ), 1e-7 );
+  BOOST_CHECK( ( to_eigen_mat( all.covariance() ) - to_eigen_mat( covariance( half ) ) ).cwiseAbs().maxCoeff() < 1e-7 );
+
+  // merging the two halves gives back all of the points
+  point_statistics_t rest( 3, true );
+  for( size_t i = 500; i < points.size(); ++i ) {
+    rest.add( points[i] );
+  }
+  all.merge( rest );
+  BOOST_CHECK_EQUAL( all.count(), points.size() );
+  BOOST_CHECK_CLOSE( all.variance(), variance( points ), 1e-7 );
+  BOOST_CHECK( ( to_eigen_mat( all.covariance() ) - cov ).cwiseAbs().maxCoeff() < 1e-7 );
+
+  // removing every point empties the accumulator
+  point_statistics_t single( 3 );
+  single.add( points[0] );
+  single.remove( points[0] );
+  BOOST_CHECK_EQUAL( single.count(), 0 );
+  BOOST_CHECK_EQUAL( single.variance(), 0.0 );
+}
+
+BOOST_FIXTURE_TEST_CASE( point_math_statistics_tracking, fixture_points )
+{
+  point_statistics_t untracked( 3 );
+  point_statistics_t tracked( 3, true );
+  for( size_t i = 0; i < 10; ++i ) {
+    untracked.add( points[i] );
+    tracked.add( points[i] );
+  }
+  BOOST_CHECK( !untracked.tracks_covariance() );
+  BOOST_CHECK_THROW( untracked.covariance(), std::runtime_error );
+
+  // merging into an empty accumulator keeps its own tracking
+  point_statistics_t empty_tracked( 0, true );
+  empty_tracked.merge( tracked );
+  BOOST_CHECK( empty_tracked.tracks_covariance() );
+  BOOST_CHECK_EQUAL( empty_tracked.count(), 10 );
+  BOOST_CHECK( to_eigen_mat( empty_tracked.covariance() ) == to_eigen_mat( tracked.covariance() ) );
+  point_statistics_t empty_untracked( 3 );
+  empty_untracked.merge( tracked );
+  BOOST_CHECK( !empty_untracked.tracks_covariance() );
+  BOOST_CHECK_EQUAL( empty_untracked.variance(), tracked.variance() );
+  BOOST_CHECK_THROW( empty_untracked.covariance(), std::runtime_error );
+
+  // copies are independent of the original
+  point_statistics_t copy( tracked );
+  copy.add( points[10] );
+  BOOST_CHECK_EQUAL( tracked.count(), 10 );
+  BOOST_CHECK_EQUAL( copy.count(), 11 );
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()